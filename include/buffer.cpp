@@ -3,6 +3,11 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
 #include "log.hpp"
 #include "buffer.hpp"
 
@@ -10,11 +15,179 @@
 
 static const int EVBUFFER_MAX_READ = 4096;
 
-static void evbuffer_align(struct evbuffer* buf)
+/* evbuffer_add_buffer copies a lone segment up to this size instead of moving it */
+#define EVBUFFER_COPY_TAIL	1024
+
+/* set once at startup, before the reactors run */
+static int evbuffer_max_iovec = EVBUFFER_MAX_IOVEC;
+
+#define EVBUFFER_CHAIN_SPACE(ch)	((ch)->buffer_len - (ch)->misalign - (ch)->off)
+
+/* segments are EVBUFFER_CHAIN_SIZE bytes unless one write needs more in one piece */
+static struct evbuffer_chain* evbuffer_chain_new(struct evbuffer* buf, size_t size)
 {
-	memmove(buf->orig_buffer, buf->buffer, buf->off);
-	buf->buffer = buf->orig_buffer;
-	buf->misalign = 0;
+	struct evbuffer_chain* chain;
+
+	if (size <= EVBUFFER_CHAIN_SIZE && buf->spare != NULL)
+	{
+		chain = buf->spare;
+		buf->spare = NULL;
+	}
+	else
+	{
+		if (size < EVBUFFER_CHAIN_SIZE)
+		{
+			size = EVBUFFER_CHAIN_SIZE;
+		}
+		if ((chain = (struct evbuffer_chain*)malloc(sizeof(struct evbuffer_chain) + size)) == NULL)
+		{
+			Error("malloc failed, errno = %d\n", errno);
+			return NULL;
+		}
+		chain->buffer_len = size;
+		chain->buffer = (u_char*)(chain + 1);
+	}
+	chain->next = NULL;
+	chain->misalign = 0;
+	chain->off = 0;
+	chain->flags = 0;
+	return chain;
+}
+
+/* one standard segment is kept back, so a buffer that empties and refills does not touch malloc */
+static void evbuffer_chain_free(struct evbuffer* buf, struct evbuffer_chain* chain)
+{
+	if (buf->reserved == chain)
+	{
+		buf->reserved = NULL;
+	}
+	if (chain->flags & EVBUFFER_REFERENCE)
+	{
+		if (chain->cleanup != NULL)
+		{
+			(*chain->cleanup)(chain->buffer, chain->buffer_len, chain->cleanup_arg);
+		}
+		free(chain);
+		return;
+	}
+	if (chain->flags & EVBUFFER_FILE)
+	{
+		close(chain->fd);
+		free(chain);
+		return;
+	}
+	if (buf->spare == NULL && chain->buffer_len == EVBUFFER_CHAIN_SIZE)
+	{
+		buf->spare = chain;
+		return;
+	}
+	free(chain);
+}
+
+static void evbuffer_chain_free_data(const void* data, size_t datlen, void* arg)
+{
+	free((void*)data);
+}
+
+/*
+ * Reads the first len bytes of a file segment into memory, for callers
+ * that need the bytes themselves. The segment then references the copy;
+ * if len is short of the segment, the rest is split off into a new file
+ * segment behind it, otherwise the fd is closed. A pipe segment is read
+ * only as far as asked, so the rest stays in the pipe.
+ */
+static int evbuffer_chain_load(struct evbuffer* buf, struct evbuffer_chain* chain, size_t len)
+{
+	struct evbuffer_chain* rest = NULL;
+	u_char* data;
+	size_t done = 0;
+
+	if (len < chain->off && (rest = (struct evbuffer_chain*)malloc(sizeof(struct evbuffer_chain))) == NULL)
+	{
+		Error("malloc failed, errno = %d\n", errno);
+		return -1;
+	}
+	if ((data = (u_char*)malloc(len)) == NULL)
+	{
+		Error("malloc failed, errno = %d\n", errno);
+		free(rest);
+		return -1;
+	}
+	while (done < len)
+	{
+		ssize_t n;
+		if (chain->flags & EVBUFFER_PIPE)
+		{
+			n = read(chain->fd, data + done, len - done);
+		}
+		else
+		{
+			n = pread(chain->fd, data + done, len - done, chain->misalign + done);
+		}
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			Error("read of file segment failed, fd = %d, errno = %d\n", chain->fd, n == 0 ? 0 : errno);
+			free(data);
+			free(rest);
+			return -1;
+		}
+		done += n;
+	}
+	if (rest != NULL)
+	{
+		*rest = *chain;
+		rest->misalign += len;
+		rest->off -= len;
+		chain->next = rest;
+		if (buf->last == chain)
+		{
+			buf->last = rest;
+		}
+	}
+	else
+	{
+		close(chain->fd);
+	}
+	chain->buffer = data;
+	chain->buffer_len = len;
+	chain->misalign = 0;
+	chain->off = len;
+	chain->flags = EVBUFFER_REFERENCE;
+	chain->cleanup = evbuffer_chain_free_data;
+	chain->cleanup_arg = NULL;
+	return 0;
+}
+
+static void evbuffer_chain_insert(struct evbuffer* buf, struct evbuffer_chain* chain)
+{
+	if (buf->last == NULL)
+	{
+		buf->first = chain;
+	}
+	else
+	{
+		buf->last->next = chain;
+	}
+	buf->last = chain;
+}
+
+static void evbuffer_drain_chains(struct evbuffer* buf, size_t len);
+
+static void evbuffer_free_chains(struct evbuffer* buf)
+{
+	struct evbuffer_chain* chain;
+	struct evbuffer_chain* next;
+
+	for (chain = buf->first; chain != NULL; chain = next)
+	{
+		next = chain->next;
+		evbuffer_chain_free(buf, chain);
+	}
+	buf->first = buf->last = NULL;
 }
 
 
@@ -26,97 +199,319 @@ struct evbuffer* evbuffer_new(void)
 
 void evbuffer_free(struct evbuffer* buffer)
 {
-	if (buffer->orig_buffer != NULL)
+	evbuffer_free_chains(buffer);
+	if (buffer->spare != NULL)
 	{
-		free(buffer->orig_buffer);
+		free(buffer->spare);
 	}
 	free(buffer);
 }
 
+/* makes datlen bytes of contiguous space available at the end of the buffer */
 int evbuffer_expand(struct evbuffer* buf, size_t datlen)
 {
-	size_t need = buf->misalign + buf->off + datlen;
-	if (buf->totallen >= need)
+	struct evbuffer_chain* chain;
+
+	if (buf->last != NULL && EVBUFFER_CHAIN_SPACE(buf->last) >= datlen)
 	{
 		return 0;
 	}
-	if (buf->misalign >= datlen) 
+	if (buf->off == 0)
 	{
-		evbuffer_align(buf);
-	} 
-	else 
+		evbuffer_free_chains(buf);
+	}
+	if ((chain = evbuffer_chain_new(buf, datlen)) == NULL)
 	{
-		u_char* newbuf;
-		size_t length = buf->totallen;
-		if (length < 256)
+		return -1;
+	}
+	evbuffer_chain_insert(buf, chain);
+	return 0;
+}
+
+int evbuffer_add(struct evbuffer* buf, const void* data, size_t datlen)
+{
+	const u_char* p = (const u_char*)data;
+	size_t oldoff = buf->off;
+	size_t remain = datlen;
+	struct evbuffer_chain* chain = buf->last;
+
+	if (chain != NULL && EVBUFFER_CHAIN_SPACE(chain) > 0)
+	{
+		size_t n = EVBUFFER_CHAIN_SPACE(chain);
+		if (n > remain)
+		{
+			n = remain;
+		}
+		memcpy(chain->buffer + chain->misalign + chain->off, p, n);
+		chain->off += n;
+		p += n;
+		remain -= n;
+	}
+	if (remain > 0)
+	{
+		if ((chain = evbuffer_chain_new(buf, remain)) == NULL)
 		{
-			length = 256;
+			Error("evbuffer_chain_new failed\n");
+			buf->off += datlen - remain;
+			return -1;
 		}
-		while (length < need)
+		memcpy(chain->buffer, p, remain);
+		chain->off = remain;
+		evbuffer_chain_insert(buf, chain);
+	}
+	buf->off += datlen;
+	if (datlen && buf->cb != NULL)
+	{
+		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+	}
+	return 0;
+}
+
+/*
+ * Queues caller memory without copying it. The memory must stay valid and
+ * unchanged until cleanup runs, which happens once the last of its bytes
+ * has been drained or written, or the buffer is freed. On failure -1 is
+ * returned, cleanup is not called and the memory stays with the caller.
+ */
+int evbuffer_add_reference(struct evbuffer* buf, const void* data, size_t datlen, evbuffer_ref_cleanup_cb cleanup, void* arg)
+{
+	struct evbuffer_chain* chain;
+	size_t oldoff = buf->off;
+
+	if (datlen == 0)
+	{
+		if (cleanup != NULL)
 		{
-			length <<= 1;
+			(*cleanup)(data, datlen, arg);
 		}
-		if (buf->orig_buffer != buf->buffer)
+		return 0;
+	}
+	if ((chain = (struct evbuffer_chain*)malloc(sizeof(struct evbuffer_chain))) == NULL)
+	{
+		Error("malloc failed, errno = %d\n", errno);
+		return -1;
+	}
+	chain->next = NULL;
+	chain->buffer_len = datlen;
+	chain->misalign = 0;
+	chain->off = datlen;
+	chain->buffer = (u_char*)data;
+	chain->flags = EVBUFFER_REFERENCE;
+	chain->cleanup = cleanup;
+	chain->cleanup_arg = arg;
+	if (buf->off == 0)
+	{
+		evbuffer_free_chains(buf);
+	}
+	evbuffer_chain_insert(buf, chain);
+	buf->off += datlen;
+	if (buf->cb != NULL)
+	{
+		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+	}
+	return 0;
+}
+
+/*
+ * Queues length bytes of fd starting at offset; evbuffer_write hands them
+ * to sendfile, or to splice if fd is a pipe (offset must then be 0), so
+ * they never pass through user memory. fd must be a regular file holding
+ * the whole range or a pipe that already holds length bytes: a pipe that
+ * has yet to be filled would leave the writer retrying an empty splice
+ * for as long as the socket stays writable. The buffer owns fd from here
+ * on and closes it once the range is sent or drained; on failure it stays
+ * with the caller. Removing or pulling up these bytes reads them in first.
+ */
+int evbuffer_add_file(struct evbuffer* buf, int fd, off_t offset, off_t length)
+{
+	struct evbuffer_chain* chain;
+	struct stat st;
+	size_t oldoff = buf->off;
+	int queued = 0;
+
+	if (offset < 0 || length < 0 || fstat(fd, &st) == -1)
+	{
+		Error("evbuffer_add_file: bad fd or range, fd = %d\n", fd);
+		return -1;
+	}
+	if (S_ISREG(st.st_mode))
+	{
+		if (offset > st.st_size || length > st.st_size - offset)
 		{
-			evbuffer_align(buf);
+			Error("evbuffer_add_file: range past the end of the file, fd = %d\n", fd);
+			return -1;
 		}
-		if ((newbuf = (u_char*)realloc(buf->buffer, length)) == NULL)
+	}
+	else if (S_ISFIFO(st.st_mode))
+	{
+		if (offset != 0 || ioctl(fd, FIONREAD, &queued) == -1 || queued < length)
 		{
-			Error("realloc failed, errno = %d\n", errno);
+			Error("evbuffer_add_file: pipe does not hold the range, fd = %d\n", fd);
 			return -1;
 		}
-		buf->orig_buffer = buf->buffer = newbuf;
-		buf->totallen = length;
+	}
+	else
+	{
+		Error("evbuffer_add_file: not a regular file or pipe, fd = %d\n", fd);
+		return -1;
+	}
+	if (length == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	if ((chain = (struct evbuffer_chain*)malloc(sizeof(struct evbuffer_chain))) == NULL)
+	{
+		Error("malloc failed, errno = %d\n", errno);
+		return -1;
+	}
+	chain->next = NULL;
+	chain->buffer_len = offset + length;
+	chain->misalign = offset;
+	chain->off = length;
+	chain->buffer = NULL;
+	chain->flags = EVBUFFER_FILE | (S_ISFIFO(st.st_mode) ? EVBUFFER_PIPE : 0);
+	chain->fd = fd;
+	chain->cleanup = NULL;
+	chain->cleanup_arg = NULL;
+	if (buf->off == 0)
+	{
+		evbuffer_free_chains(buf);
+	}
+	evbuffer_chain_insert(buf, chain);
+	buf->off += length;
+	if (buf->cb != NULL)
+	{
+		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
 	}
 	return 0;
 }
 
-int evbuffer_add(struct evbuffer* buf, const void* data, size_t datlen)
+/*
+ * Moves every segment of inbuf to the end of outbuf without copying. A
+ * lone small segment is copied instead and stays with inbuf, and a moving
+ * inbuf takes outbuf's spare, so an echo that hands each read over does
+ * not allocate a segment per read. A reservation on inbuf is dropped.
+ */
+int evbuffer_add_buffer(struct evbuffer* outbuf, struct evbuffer* inbuf)
 {
-	size_t need = buf->misalign + buf->off + datlen;
-	size_t oldoff = buf->off;
-	if (buf->totallen < need) 
+	struct evbuffer_chain* chain = inbuf->first;
+	size_t oldoff = outbuf->off;
+	size_t inoff = inbuf->off;
+
+	inbuf->reserved = NULL;
+	if (inoff == 0)
 	{
-		if (evbuffer_expand(buf, datlen) == -1)
+		return 0;
+	}
+	if (chain == inbuf->last && chain->flags == 0 && chain->buffer_len == EVBUFFER_CHAIN_SIZE && chain->off <= EVBUFFER_COPY_TAIL)
+	{
+		if (evbuffer_add(outbuf, chain->buffer + chain->misalign, chain->off) == -1)
 		{
-			Error("evbuffer_expand failed\n");
 			return -1;
 		}
+		evbuffer_drain_chains(inbuf, inoff);
+		return 0;
 	}
-	memcpy(buf->buffer + buf->off, data, datlen);
-	buf->off += datlen;
-	if (datlen && buf->cb != NULL)
+	if (outbuf->off == 0)
 	{
-		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+		evbuffer_free_chains(outbuf);
+	}
+	if (outbuf->last == NULL)
+	{
+		outbuf->first = inbuf->first;
+	}
+	else
+	{
+		outbuf->last->next = inbuf->first;
+	}
+	outbuf->last = inbuf->last;
+	outbuf->off += inoff;
+	inbuf->first = inbuf->last = NULL;
+	inbuf->off = 0;
+	if (inbuf->spare == NULL)
+	{
+		inbuf->spare = outbuf->spare;
+		outbuf->spare = NULL;
+	}
+
+	if (outbuf->cb != NULL)
+	{
+		(*outbuf->cb)(outbuf, oldoff, outbuf->off, outbuf->cbarg);
+	}
+	if (inbuf->cb != NULL)
+	{
+		(*inbuf->cb)(inbuf, inoff, 0, inbuf->cbarg);
 	}
 	return 0;
 }
 
 int evbuffer_remove(struct evbuffer* buf, void* data, size_t datlen)
 {
+	struct evbuffer_chain* chain;
+	u_char* p = (u_char*)data;
 	size_t nread = datlen;
+	size_t remain;
+
 	if (nread >= buf->off)
 	{
 		nread = buf->off;
 	}
-	memcpy(data, buf->buffer, nread);
-	evbuffer_drain(buf, nread);
+	remain = nread;
+	for (chain = buf->first; remain > 0; chain = chain->next)
+	{
+		size_t n = chain->off < remain ? chain->off : remain;
+		if ((chain->flags & EVBUFFER_FILE) && evbuffer_chain_load(buf, chain, n) == -1)
+		{
+			return -1;
+		}
+		memcpy(p, chain->buffer + chain->misalign, n);
+		p += n;
+		remain -= n;
+	}
+	if (evbuffer_drain(buf, nread) == -1)
+	{
+		return -1;
+	}
 	return nread;
 }
 
-void evbuffer_drain(struct evbuffer* buf, size_t len)
+static void evbuffer_drain_chains(struct evbuffer* buf, size_t len)
 {
+	struct evbuffer_chain* chain;
 	size_t oldoff = buf->off;
+
 	if (len >= buf->off) 
 	{
+		if (buf->first != NULL && buf->first == buf->last && buf->first->flags == 0)
+		{
+			/* keep a lone segment for the next add */
+			buf->first->misalign = 0;
+			buf->first->off = 0;
+		}
+		else
+		{
+			evbuffer_free_chains(buf);
+		}
 		buf->off = 0;
-		buf->buffer = buf->orig_buffer;
-		buf->misalign = 0;
 		goto done;
 	}
-	buf->buffer += len;
-	buf->misalign += len;
 	buf->off -= len;
+	while ((chain = buf->first) != NULL && len >= chain->off)
+	{
+		len -= chain->off;
+		buf->first = chain->next;
+		evbuffer_chain_free(buf, chain);
+	}
+	if (buf->first == NULL)
+	{
+		buf->last = NULL;
+	}
+	else
+	{
+		buf->first->misalign += len;
+		buf->first->off -= len;
+	}
 done:
 	if (buf->off != oldoff && buf->cb != NULL)
 	{
@@ -124,41 +519,307 @@ done:
 	}
 }
 
+/* returns -1, with nothing drained, if a pipe segment cut in the middle cannot be read */
+int evbuffer_drain(struct evbuffer* buf, size_t len)
+{
+	struct evbuffer_chain* chain = buf->first;
+	size_t skip = len;
+
+	/* a pipe can only skip bytes by reading them, so the part of a segment being cut is read in first */
+	if (len < buf->off)
+	{
+		while (skip >= chain->off)
+		{
+			skip -= chain->off;
+			chain = chain->next;
+		}
+		if (skip > 0 && (chain->flags & EVBUFFER_PIPE) && evbuffer_chain_load(buf, chain, skip) == -1)
+		{
+			return -1;
+		}
+	}
+	evbuffer_drain_chains(buf, len);
+	return 0;
+}
+
+/*
+ * Makes the first size bytes contiguous (all of them if size is negative)
+ * and returns a pointer to them, or NULL if the buffer holds fewer. Only
+ * the bytes that straddle a segment boundary are copied.
+ */
+u_char* evbuffer_pullup(struct evbuffer* buf, ssize_t size)
+{
+	struct evbuffer_chain* chain;
+	struct evbuffer_chain* tmp;
+	size_t remain;
+
+	if (size < 0)
+	{
+		size = buf->off;
+	}
+	if ((size_t)size > buf->off)
+	{
+		return NULL;
+	}
+	if (size == 0)
+	{
+		return (buf->first != NULL && buf->first->buffer != NULL) ? buf->first->buffer + buf->first->misalign : NULL;
+	}
+	/* file segments in the range are read in before anything is moved */
+	remain = size;
+	for (chain = buf->first; remain > 0; chain = chain->next)
+	{
+		size_t n = chain->off < remain ? chain->off : remain;
+		if ((chain->flags & EVBUFFER_FILE) && evbuffer_chain_load(buf, chain, n) == -1)
+		{
+			return NULL;
+		}
+		remain -= n;
+	}
+	chain = buf->first;
+	if (chain->off >= (size_t)size)
+	{
+		return chain->buffer + chain->misalign;
+	}
+
+	if ((tmp = evbuffer_chain_new(buf, size)) == NULL)
+	{
+		return NULL;
+	}
+	remain = size;
+	while (remain > 0)
+	{
+		size_t n = chain->off < remain ? chain->off : remain;
+		memcpy(tmp->buffer + tmp->off, chain->buffer + chain->misalign, n);
+		tmp->off += n;
+		remain -= n;
+		if (n == chain->off)
+		{
+			struct evbuffer_chain* next = chain->next;
+			evbuffer_chain_free(buf, chain);
+			chain = next;
+		}
+		else
+		{
+			chain->misalign += n;
+			chain->off -= n;
+		}
+	}
+	tmp->next = chain;
+	buf->first = tmp;
+	if (chain == NULL)
+	{
+		buf->last = tmp;
+	}
+	return tmp->buffer;
+}
+
+/*
+ * Points vec at the segments holding the first len bytes (all of them if
+ * len is negative) without copying or draining. Returns the number of
+ * iovecs the range needs, which may exceed n_vec; only n_vec are filled.
+ * File segments in the range are read in first.
+ */
+int evbuffer_peek(struct evbuffer* buf, ssize_t len, struct iovec* vec, int n_vec)
+{
+	struct evbuffer_chain* chain;
+	size_t remain;
+	int n = 0;
+
+	if (len < 0 || (size_t)len > buf->off)
+	{
+		len = buf->off;
+	}
+	remain = len;
+	for (chain = buf->first; remain > 0; chain = chain->next)
+	{
+		size_t take = chain->off < remain ? chain->off : remain;
+		if (chain->off == 0)
+		{
+			continue;
+		}
+		if (n < n_vec)
+		{
+			if ((chain->flags & EVBUFFER_FILE) && evbuffer_chain_load(buf, chain, take) == -1)
+			{
+				return -1;
+			}
+			vec[n].iov_base = chain->buffer + chain->misalign;
+			vec[n].iov_len = take;
+		}
+		remain -= take;
+		++n;
+	}
+	return n;
+}
+
+/*
+ * Hands out at least size bytes of writable space at the end of the
+ * buffer: the free space of the last segment and, if that is short and
+ * n_vec allows, one fresh segment for the rest; with n_vec == 1 the space
+ * is contiguous. Returns the number of iovecs filled. Nothing becomes
+ * readable until evbuffer_commit_space, and the buffer must not be
+ * changed in between.
+ */
+int evbuffer_reserve_space(struct evbuffer* buf, ssize_t size, struct iovec* vec, int n_vec)
+{
+	struct evbuffer_chain* tail;
+	struct evbuffer_chain* fresh;
+	size_t space;
+
+	if (size < 0 || n_vec < 1)
+	{
+		return -1;
+	}
+	if (n_vec == 1 || buf->last == NULL || EVBUFFER_CHAIN_SPACE(buf->last) == 0 || EVBUFFER_CHAIN_SPACE(buf->last) >= (size_t)size)
+	{
+		if (evbuffer_expand(buf, size) == -1)
+		{
+			return -1;
+		}
+		tail = buf->last;
+		buf->reserved = tail;
+		vec[0].iov_base = tail->buffer + tail->misalign + tail->off;
+		vec[0].iov_len = EVBUFFER_CHAIN_SPACE(tail);
+		return 1;
+	}
+
+	tail = buf->last;
+	space = EVBUFFER_CHAIN_SPACE(tail);
+	if ((fresh = evbuffer_chain_new(buf, size - space)) == NULL)
+	{
+		return -1;
+	}
+	evbuffer_chain_insert(buf, fresh);
+	buf->reserved = tail;
+	vec[0].iov_base = tail->buffer + tail->misalign + tail->off;
+	vec[0].iov_len = space;
+	vec[1].iov_base = fresh->buffer;
+	vec[1].iov_len = fresh->buffer_len;
+	return 2;
+}
+
+/*
+ * Makes the bytes written into reserved space readable. vec holds the
+ * iovecs from evbuffer_reserve_space, with iov_len cut down to what was
+ * written; trailing ones may be dropped. Fails with -1 if they no longer
+ * match the reservation.
+ */
+int evbuffer_commit_space(struct evbuffer* buf, struct iovec* vec, int n_vec)
+{
+	struct evbuffer_chain* chain = buf->reserved;
+	size_t oldoff = buf->off;
+	size_t added = 0;
+	int i;
+
+	for (i = 0; i < n_vec; ++i, chain = chain->next)
+	{
+		if (chain == NULL || vec[i].iov_base != chain->buffer + chain->misalign + chain->off || vec[i].iov_len > EVBUFFER_CHAIN_SPACE(chain))
+		{
+			Error("evbuffer_commit_space: iovec %d does not match the reservation\n", i);
+			return -1;
+		}
+	}
+	for (i = 0, chain = buf->reserved; i < n_vec; ++i, chain = chain->next)
+	{
+		chain->off += vec[i].iov_len;
+		added += vec[i].iov_len;
+	}
+	buf->reserved = NULL;
+	buf->off += added;
+	if (added && buf->cb != NULL)
+	{
+		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+	}
+	return 0;
+}
+
+/*
+ * A read goes into the free space left in the last segment plus as many
+ * fresh standard segments as the rest of howmuch needs, so a single readv
+ * never needs the tail to be contiguous and no segment is larger than
+ * EVBUFFER_CHAIN_SIZE. Fresh segments are only linked in if data reached
+ * them.
+ */
 int evbuffer_read(struct evbuffer* buf, int fd, int howmuch)
 {
-	u_char* p;
+	struct evbuffer_chain* tail = buf->last;
+	struct evbuffer_chain* fresh[EVBUFFER_READ_SEGMENTS];
+	struct iovec iov[EVBUFFER_READ_SEGMENTS + 1];
 	size_t oldoff = buf->off;
+	size_t space = 0;
+	size_t remain;
+	int nfresh = 0;
+	int niov = 0;
 	int n = EVBUFFER_MAX_READ;
+	int i;
 
+	/* sized by what the socket holds, not by what is buffered, so an emptied buffer still reads in bulk */
 	if (ioctl(fd, FIONREAD, &n) == -1 || n <= 0) 
 	{
 		n = EVBUFFER_MAX_READ;
 	} 
-	else if (n > EVBUFFER_MAX_READ && n > howmuch) 
+	else if (n > EVBUFFER_READ_SEGMENTS * EVBUFFER_CHAIN_SIZE) 
+	{
+		n = EVBUFFER_READ_SEGMENTS * EVBUFFER_CHAIN_SIZE;
+	}
+	if (howmuch < 0 || howmuch > n)
 	{
-		if ((size_t)n > buf->totallen << 2)
+		howmuch = n;
+	}
+
+	if (tail != NULL && (space = EVBUFFER_CHAIN_SPACE(tail)) > 0)
+	{
+		if (space > (size_t)howmuch)
 		{
-			n = buf->totallen << 2;
+			space = howmuch;
 		}
-		if (n < EVBUFFER_MAX_READ)
+		iov[niov].iov_base = tail->buffer + tail->misalign + tail->off;
+		iov[niov].iov_len = space;
+		++niov;
+	}
+	for (remain = howmuch - space; remain > 0 && nfresh < EVBUFFER_READ_SEGMENTS; ++nfresh)
+	{
+		size_t len = remain < EVBUFFER_CHAIN_SIZE ? remain : EVBUFFER_CHAIN_SIZE;
+		if ((fresh[nfresh] = evbuffer_chain_new(buf, len)) == NULL)
 		{
-			n = EVBUFFER_MAX_READ;
+			break;
 		}
+		iov[niov].iov_base = fresh[nfresh]->buffer;
+		iov[niov].iov_len = len;
+		++niov;
+		remain -= len;
 	}
-	if (howmuch < 0 || howmuch > n)
+	if (niov == 0)
 	{
-		howmuch = n;
+		return -1;
+	}
+
+	n = readv(fd, iov, niov);
+	remain = n > 0 ? n : 0;
+	if (space > 0)
+	{
+		size_t len = remain < space ? remain : space;
+		tail->off += len;
+		remain -= len;
 	}
-	if (evbuffer_expand(buf, howmuch) == -1)
+	for (i = 0; i < nfresh; ++i)
 	{
-		Error("evbuffer_expand failed\n");
-		return -1;
+		if (remain == 0)
+		{
+			evbuffer_chain_free(buf, fresh[i]);
+			continue;
+		}
+		fresh[i]->off = remain < iov[niov - nfresh + i].iov_len ? remain : iov[niov - nfresh + i].iov_len;
+		remain -= fresh[i]->off;
+		evbuffer_chain_insert(buf, fresh[i]);
 	}
-	p = buf->buffer + buf->off;
-	n = read(fd, p, howmuch);
 	if (n == -1)
 	{
-		Error("read failed, errno = %d\n", errno);
+		if (errno != EAGAIN && errno != EINTR)
+		{
+			Error("readv failed, errno = %d\n", errno);
+		}
 		return -1;
 	}
 	if (n == 0)
@@ -173,23 +834,101 @@ int evbuffer_read(struct evbuffer* buf, int fd, int howmuch)
 	return n;
 }
 
+static int evbuffer_write_file(struct evbuffer* buffer, struct evbuffer_chain* chain, int fd)
+{
+	size_t count = chain->off < (1 << 30) ? chain->off : (1 << 30);
+	ssize_t n;
+
+	/* the pipe held the whole range when it was queued, so EAGAIN here means the socket is full */
+	if (chain->flags & EVBUFFER_PIPE)
+	{
+		n = splice(chain->fd, NULL, fd, NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	}
+	else
+	{
+		off_t offset = chain->misalign;
+		n = sendfile(fd, chain->fd, &offset, count);
+	}
+	if (n == -1)
+	{
+		if (errno != EAGAIN && errno != EINTR)
+		{
+			Error("%s failed, errno = %d\n", (chain->flags & EVBUFFER_PIPE) ? "splice" : "sendfile", errno);
+		}
+		return -1;
+	}
+	if (n == 0)
+	{
+		/* the file or pipe ran out before the queued range did */
+		Error("file segment ended early, fd = %d\n", chain->fd);
+		return 0;
+	}
+	evbuffer_drain_chains(buffer, n);
+	return n;
+}
+
+/*
+ * Gathers up to evbuffer_max_iovec memory segments from the front into one
+ * writev; a file segment at the front is sent on its own instead.
+ */
 int evbuffer_write(struct evbuffer* buffer, int fd)
 {
+	struct evbuffer_chain* chain;
+	struct iovec iov[IOV_MAX];
+	int niov = 0;
 	int n;
-	n = write(fd, buffer->buffer, buffer->off);
+
+	for (chain = buffer->first; chain != NULL && niov < evbuffer_max_iovec; chain = chain->next)
+	{
+		/* an empty segment can sit ahead of data after evbuffer_expand */
+		if (chain->off == 0)
+		{
+			continue;
+		}
+		if (chain->flags & EVBUFFER_FILE)
+		{
+			if (niov == 0)
+			{
+				return evbuffer_write_file(buffer, chain, fd);
+			}
+			break;
+		}
+		iov[niov].iov_base = chain->buffer + chain->misalign;
+		iov[niov].iov_len = chain->off;
+		++niov;
+	}
+	if (niov == 0)
+	{
+		return 0;
+	}
+	n = writev(fd, iov, niov);
 	if (n == -1)
 	{
-		Error("write failed, errno = %d\n", errno);
+		if (errno != EAGAIN && errno != EINTR)
+		{
+			Error("writev failed, errno = %d\n", errno);
+		}
 		return -1;
 	}
 	if (n == 0)
 	{
 		return 0;
 	}
-	evbuffer_drain(buffer, n);
+	evbuffer_drain_chains(buffer, n);
 	return n;
 }
 
+/* bounds the number of segments one evbuffer_write hands to writev, 1 to IOV_MAX */
+int evbuffer_set_max_iovec(int max_iovec)
+{
+	if (max_iovec < 1 || max_iovec > IOV_MAX)
+	{
+		return -1;
+	}
+	evbuffer_max_iovec = max_iovec;
+	return 0;
+}
+
 void evbuffer_setcb(struct evbuffer* buffer, void (*cb)(struct evbuffer*, size_t, size_t, void*), void* cbarg)
 {
 	buffer->cb = cb;
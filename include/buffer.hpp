@@ -5,15 +5,58 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
 typedef unsigned char u_char;
 
-struct evbuffer 
+/*
+ * Buffered data lives in a chain of segments. Appends fill the last
+ * segment and link a new one when it is full; drains advance the first
+ * segment and unlink it once empty. Data already in the buffer is never
+ * moved, except by evbuffer_pullup. off is the total over all segments.
+ */
+#define EVBUFFER_CHAIN_SIZE	4096
+
+/* one evbuffer_read fills at most this many fresh segments */
+#define EVBUFFER_READ_SEGMENTS	16
+
+/* default bound on the segments written by one writev, see evbuffer_set_max_iovec */
+#define EVBUFFER_MAX_IOVEC	64
+
+typedef void (*evbuffer_ref_cleanup_cb)(const void* data, size_t datlen, void* arg);
+
+/* the segment points at caller memory, handed back through cleanup once drained */
+#define EVBUFFER_REFERENCE	0x01
+/* the segment is a range of fd, misalign being the file offset; sent with sendfile */
+#define EVBUFFER_FILE		0x02
+/* with EVBUFFER_FILE: fd is a pipe, sent with splice */
+#define EVBUFFER_PIPE		0x04
+
+struct evbuffer_chain
 {
-	u_char* buffer;
-	u_char* orig_buffer;
+	struct evbuffer_chain* next;
 
+	size_t buffer_len;
 	size_t misalign;
-	size_t totallen;
+	size_t off;
+
+	u_char* buffer;
+
+	int flags;
+	int fd;
+	evbuffer_ref_cleanup_cb cleanup;
+	void* cleanup_arg;
+};
+
+struct evbuffer 
+{
+	struct evbuffer_chain* first;
+	struct evbuffer_chain* last;
+	struct evbuffer_chain* spare;
+	struct evbuffer_chain* reserved;
+
 	size_t off;
 
 	void (*cb)(struct evbuffer*, size_t, size_t, void*);
@@ -26,10 +69,18 @@ struct evbuffer* evbuffer_new(void);
 void evbuffer_free(struct evbuffer* buffer);
 int evbuffer_expand(struct evbuffer* buf, size_t datlen);
 int evbuffer_add(struct evbuffer* buf, const void* data, size_t datlen);
+int evbuffer_add_reference(struct evbuffer* buf, const void* data, size_t datlen, evbuffer_ref_cleanup_cb cleanup, void* arg);
+int evbuffer_add_file(struct evbuffer* buf, int fd, off_t offset, off_t length);
+int evbuffer_add_buffer(struct evbuffer* outbuf, struct evbuffer* inbuf);
 int evbuffer_remove(struct evbuffer* buf, void* data, size_t datlen);
-void evbuffer_drain(struct evbuffer* buf, size_t len);
+int evbuffer_drain(struct evbuffer* buf, size_t len);
+u_char* evbuffer_pullup(struct evbuffer* buf, ssize_t size);
+int evbuffer_peek(struct evbuffer* buf, ssize_t len, struct iovec* vec, int n_vec);
+int evbuffer_reserve_space(struct evbuffer* buf, ssize_t size, struct iovec* vec, int n_vec);
+int evbuffer_commit_space(struct evbuffer* buf, struct iovec* vec, int n_vec);
 int evbuffer_read(struct evbuffer* buf, int fd, int howmuch);
 int evbuffer_write(struct evbuffer* buffer, int fd);
+int evbuffer_set_max_iovec(int max_iovec);
 void evbuffer_setcb(struct evbuffer* buffer, void (*cb)(struct evbuffer*, size_t, size_t, void*), void* cbarg);
 
 
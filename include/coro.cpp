@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "log.hpp"
+#include "coro.hpp"
+
+
+/*
+ * Frames are recycled through per-thread free lists, one per 64-byte size
+ * class; a coroutine is created and destroyed on its loop thread, so no
+ * locking is needed. Frames above CORO_POOL_MAX go straight to malloc.
+ */
+#define CORO_POOL_CLASS	64
+#define CORO_POOL_MAX	4096
+
+struct coro_frame
+{
+	struct coro_frame* next;
+};
+
+static __thread struct coro_frame* coro_pool[CORO_POOL_MAX / CORO_POOL_CLASS];
+
+void* coro_frame_alloc(size_t size)
+{
+	size_t cls = (size + CORO_POOL_CLASS - 1) / CORO_POOL_CLASS;
+	struct coro_frame* frame;
+
+	if (cls > 0 && cls <= CORO_POOL_MAX / CORO_POOL_CLASS && (frame = coro_pool[cls - 1]) != NULL)
+	{
+		coro_pool[cls - 1] = frame->next;
+		return (frame);
+	}
+	if (cls <= CORO_POOL_MAX / CORO_POOL_CLASS)
+	{
+		size = cls * CORO_POOL_CLASS;
+	}
+	if ((frame = (struct coro_frame*)malloc(size)) == NULL)
+	{
+		Error("malloc failed, errno = %d", errno);
+		std::terminate();
+	}
+	return (frame);
+}
+
+void coro_frame_free(void* p, size_t size)
+{
+	size_t cls = (size + CORO_POOL_CLASS - 1) / CORO_POOL_CLASS;
+	struct coro_frame* frame = (struct coro_frame*)p;
+
+	if (cls == 0 || cls > CORO_POOL_MAX / CORO_POOL_CLASS)
+	{
+		free(p);
+		return;
+	}
+	frame->next = coro_pool[cls - 1];
+	coro_pool[cls - 1] = frame;
+}
+
+/* gives the bufferevent its own callbacks back */
+void coro_bev_awaiter::release()
+{
+	if (suspended)
+	{
+		suspended = 0;
+		bufferevent_setcb(bev, saved_readcb, saved_writecb, saved_errorcb, saved_cbarg);
+	}
+}
+
+coro_bev_awaiter::~coro_bev_awaiter()
+{
+	release();
+}
+
+/* detaches the awaiter before resuming: the coroutine may await again or free the bufferevent */
+static void coro_bev_complete(struct coro_bev_awaiter* a, int result)
+{
+	a->release();
+	a->result = result;
+	a->handle.resume();
+}
+
+static void coro_bev_readcb(struct bufferevent* bev, void* arg)
+{
+	struct coro_bev_awaiter* a = (struct coro_bev_awaiter*)arg;
+
+	if (a != NULL && a->op == CORO_BEV_READ && bev->input->off >= a->want)
+	{
+		coro_bev_complete(a, (int)bev->input->off);
+	}
+}
+
+static void coro_bev_writecb(struct bufferevent* bev, void* arg)
+{
+	struct coro_bev_awaiter* a = (struct coro_bev_awaiter*)arg;
+
+	if (a != NULL && a->op == CORO_BEV_WRITE && bev->output->off == 0)
+	{
+		coro_bev_complete(a, 0);
+	}
+}
+
+/*
+ * Errors are sticky: a read EOF or error stops the read side for good, so
+ * it is kept for the next async_read. A pending write may still drain
+ * after the peer stops sending, so it only fails on a write error.
+ */
+static void coro_bev_errorcb(struct bufferevent* bev, short what, void* arg)
+{
+	struct coro_bev_awaiter* a = (struct coro_bev_awaiter*)arg;
+
+	if (!bev->pending_error)
+	{
+		bev->pending_error = what;
+	}
+	if (a == NULL)
+	{
+		return;
+	}
+	if (a->op == CORO_BEV_READ)
+	{
+		coro_bev_complete(a, bev->input->off >= a->want ? (int)bev->input->off : -1);
+	}
+	else if (what & EVBUFFER_WRITE)
+	{
+		coro_bev_complete(a, -1);
+	}
+	else if (bev->output->off == 0)
+	{
+		coro_bev_complete(a, 0);
+	}
+}
+
+bool coro_bev_awaiter::await_ready()
+{
+	if (op == CORO_BEV_READ)
+	{
+		if (bev->input->off >= want)
+		{
+			result = (int)bev->input->off;
+			return (true);
+		}
+		if (bev->pending_error)
+		{
+			result = -1;
+			return (true);
+		}
+		return (false);
+	}
+	if (bev->pending_error & EVBUFFER_WRITE)
+	{
+		result = -1;
+		return (true);
+	}
+	if (bev->output->off == 0)
+	{
+		result = 0;
+		return (true);
+	}
+	return (false);
+}
+
+void coro_bev_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+	handle = h;
+	saved_readcb = bev->readcb;
+	saved_writecb = bev->writecb;
+	saved_errorcb = bev->errorcb;
+	saved_cbarg = bev->cbarg;
+	suspended = 1;
+	bufferevent_setcb(bev, coro_bev_readcb, coro_bev_writecb, coro_bev_errorcb, this);
+	/* a level-triggered event is not re-added after an error; arming it again makes the error come back here */
+	if (op == CORO_BEV_READ && (!(bev->enabled & EV_READ) || !event_pending(&bev->ev_read, EV_READ, NULL)))
+	{
+		bufferevent_enable(bev, EV_READ);
+	}
+	else if (op == CORO_BEV_WRITE && (bev->enabled & EV_WRITE) && !event_pending(&bev->ev_write, EV_WRITE, NULL))
+	{
+		bufferevent_enable(bev, EV_WRITE);
+	}
+}
+
+coro_bev_awaiter async_read(struct bufferevent* bev, size_t n)
+{
+	coro_bev_awaiter a;
+
+	a.bev = bev;
+	a.want = n;
+	a.op = CORO_BEV_READ;
+	a.result = -1;
+	a.suspended = 0;
+	return (a);
+}
+
+coro_bev_awaiter async_write(struct bufferevent* bev, const void* data, size_t size)
+{
+	coro_bev_awaiter a;
+
+	a.bev = bev;
+	a.want = 0;
+	a.op = CORO_BEV_WRITE;
+	a.result = -1;
+	a.suspended = 0;
+	if (!(bev->pending_error & EVBUFFER_WRITE) && size > 0)
+	{
+		bufferevent_write(bev, data, size);
+	}
+	return (a);
+}
+
+static void coro_event_cb(int fd, short what, void* arg)
+{
+	struct coro_event_awaiter* a = (struct coro_event_awaiter*)arg;
+
+	a->pending = 0;
+	a->result = what;
+	a->handle.resume();
+}
+
+/* a frame destroyed while suspended must not leave its event in the base */
+coro_event_awaiter::~coro_event_awaiter()
+{
+	if (pending)
+	{
+		event_del(&ev);
+	}
+}
+
+/* returning false resumes the coroutine at once, with result -1 */
+bool coro_event_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+	handle = h;
+	event_set(&ev, fd, events, coro_event_cb, this);
+	event_base_set(base, &ev);
+	if (event_add(&ev, has_tv ? &tv : NULL) == -1)
+	{
+		Error("event_add failed, fd = %d", fd);
+		result = -1;
+		return (false);
+	}
+	pending = 1;
+	return (true);
+}
+
+coro_event_awaiter readable(struct event_base* base, int fd, const struct timeval* tv)
+{
+	coro_event_awaiter a;
+
+	a.base = base;
+	a.fd = fd;
+	a.events = EV_READ;
+	a.has_tv = (tv != NULL);
+	if (tv != NULL)
+	{
+		a.tv = *tv;
+	}
+	a.pending = 0;
+	a.result = 0;
+	return (a);
+}
+
+coro_event_awaiter sleep_for(struct event_base* base, const struct timeval* tv)
+{
+	coro_event_awaiter a;
+
+	a.base = base;
+	a.fd = -1;
+	a.events = 0;
+	a.has_tv = 1;
+	a.tv = *tv;
+	a.pending = 0;
+	a.result = 0;
+	return (a);
+}
@@ -0,0 +1,137 @@
+#ifndef _CORO_HPP_
+#define _CORO_HPP_
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <stddef.h>
+#include <exception>
+#include <chrono>
+#include <coroutine>
+#include "event.hpp"
+#include "evbuffer.hpp"
+#include "buffer.hpp"
+
+/*
+ * Awaitable layer over event_base and bufferevent. A coroutine returning
+ * coro_task starts at once, runs until its first co_await and frees its
+ * own frame when it returns. Awaiters live in the coroutine frame and are
+ * resumed straight from the event callback that completes them, so a
+ * suspended step costs no allocation; frames come from a per-thread pool.
+ *
+ *	coro_task echo(struct bufferevent* bev)
+ *	{
+ *		int n;
+ *		while ((n = co_await async_read(bev, 1)) > 0)
+ *		{
+ *			...
+ *		}
+ *	}
+ *
+ * Two g++ 12 bugs hit any awaiter, these included. A co_await in an if,
+ * while or for condition corrupts the frame when the coroutine body
+ * declares no variable at its outermost scope (PR 106188, fixed in 12.3),
+ * so declare one there. And a co_await on either side of && or || in a
+ * loop condition runs even when the other side decides, so test it in the
+ * loop body instead.
+ *
+ * While an async_read or async_write waits, the bufferevent's callbacks
+ * and cbarg are swapped for the awaiter's; the caller's are put back
+ * before the coroutine resumes, so between awaits they run as usual. An
+ * EOF or error that arrives between awaits reaches the next await: an
+ * edge-triggered bufferevent keeps it in pending_error, and a
+ * level-triggered one reports it again once the awaiter re-arms its event.
+ *
+ * Destroying a suspended frame is safe: the awaiter's destructor deletes
+ * its event or gives the bufferevent its callbacks back. The bufferevent
+ * itself must still be alive then.
+ */
+
+void* coro_frame_alloc(size_t size);
+void coro_frame_free(void* frame, size_t size);
+
+struct coro_task
+{
+	struct promise_type
+	{
+		coro_task get_return_object() noexcept { return coro_task(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+
+		static void* operator new(size_t size) { return coro_frame_alloc(size); }
+		static void operator delete(void* frame, size_t size) { coro_frame_free(frame, size); }
+	};
+};
+
+enum coro_bev_op
+{
+	CORO_BEV_READ,
+	CORO_BEV_WRITE
+};
+
+struct coro_bev_awaiter
+{
+	struct bufferevent* bev;
+	size_t want;
+	int op;
+	int result;
+	int suspended;
+	std::coroutine_handle<> handle;
+
+	/* the bufferevent's own callbacks while this awaiter holds it */
+	evbuffercb saved_readcb;
+	evbuffercb saved_writecb;
+	everrorcb saved_errorcb;
+	void* saved_cbarg;
+
+	~coro_bev_awaiter();
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h);
+	int await_resume() { return result; }
+	void release();
+};
+
+struct coro_event_awaiter
+{
+	struct event ev;
+	struct event_base* base;
+	int fd;
+	short events;
+	struct timeval tv;
+	int has_tv;
+	int pending;
+	short result;
+	std::coroutine_handle<> handle;
+
+	~coro_event_awaiter();
+	bool await_ready() { return false; }
+	bool await_suspend(std::coroutine_handle<> h);
+	short await_resume() { return result; }
+};
+
+/* resumes with the number of buffered input bytes once there are at least n, -1 on EOF, error or timeout first */
+coro_bev_awaiter async_read(struct bufferevent* bev, size_t n);
+
+/* queues data and resumes with 0 once the output buffer has drained, -1 on a write error or timeout */
+coro_bev_awaiter async_write(struct bufferevent* bev, const void* data, size_t size);
+
+/* resumes with EV_READ, or EV_TIMEOUT if tv is given and expires first */
+coro_event_awaiter readable(struct event_base* base, int fd, const struct timeval* tv = NULL);
+
+coro_event_awaiter sleep_for(struct event_base* base, const struct timeval* tv);
+
+template <class Rep, class Period>
+coro_event_awaiter sleep_for(struct event_base* base, std::chrono::duration<Rep, Period> d)
+{
+	long long usec = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+	struct timeval tv;
+
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+	return sleep_for(base, &tv);
+}
+
+#endif
+
+#endif
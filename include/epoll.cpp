@@ -3,10 +3,15 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
 #include "log.hpp"
 #include "signal.hpp"
 #include "event.hpp"
+#include "evmap.hpp"
 #include "epoll.hpp"
 
 
@@ -75,6 +80,10 @@ static void* epoll_init(struct event_base* base)
 		return (NULL);
 	}
 	epollop->nfds = INITIAL_NFILES;
+	epollop->use_changelist = (base->flags & EVENT_BASE_FLAG_EPOLL_CHANGELIST) != 0;
+	epollop->precise = (base->flags & EVENT_BASE_FLAG_PRECISE_TIMER) != 0;
+	epollop->use_pwait2 = epollop->precise;
+	epollop->timerfd = -1;
 
 	evsignal_init(base);
 
@@ -107,11 +116,202 @@ static int epoll_recalc(struct event_base* base, void* arg, int max)
 	return (0);
 }
 
+/*
+ * Changelist mode: epoll_add/epoll_del only update the fd's event list and
+ * queue the fd; the net change per fd is applied just before epoll_wait.
+ * An fd whose interest ends up where it started costs no syscall, unless
+ * evmap set verify because the fd had no events in between and may have
+ * been closed and reused: that gets a MOD which falls back to ADD if the
+ * kernel dropped the fd on close.
+ */
+static int epoll_queue_change(struct epollop* epollop, int fd)
+{
+	struct evepoll* evep = &epollop->fds[fd];
+
+	if (evep->changed)
+	{
+		return (0);
+	}
+	if (epollop->nchanges == epollop->achanges)
+	{
+		int achanges = epollop->achanges ? epollop->achanges * 2 : INITIAL_NFILES;
+		int* changes = (int*)realloc(epollop->changes, achanges * sizeof(int));
+		if (changes == NULL)
+		{
+			Error("realloc failed, errno = %d\n", errno);
+			return (-1);
+		}
+		epollop->changes = changes;
+		epollop->achanges = achanges;
+	}
+	epollop->changes[epollop->nchanges++] = fd;
+	evep->changed = 1;
+	return (0);
+}
+
+static int epoll_interest(struct evepoll* evep)
+{
+	short interest = evmap_io_interest(&evep->io);
+	int events = 0;
+
+	if (interest & EV_READ)
+	{
+		events |= EPOLLIN;
+	}
+	if (interest & EV_WRITE)
+	{
+		events |= EPOLLOUT;
+	}
+	if (interest & EV_ET)
+	{
+		events |= EPOLLET;
+	}
+	return (events);
+}
+
+static void epoll_apply_change(struct epollop* epollop, int fd)
+{
+	struct evepoll* evep = &epollop->fds[fd];
+	struct epoll_event epev = {0, {0}};
+	int events = epoll_interest(evep);
+	int op;
+
+	evep->changed = 0;
+	if (events == evep->registered && (!evep->io.verify || events == 0))
+	{
+		evep->io.verify = 0;
+		return;
+	}
+
+	epev.data.fd = fd;
+	epev.events = events;
+	if (events == 0)
+	{
+		/* the fd may already be closed, which removed it from the set */
+		if (epoll_ctl(epollop->epfd, EPOLL_CTL_DEL, fd, &epev) == -1 && errno != ENOENT && errno != EBADF)
+		{
+			Error("epoll_ctl DEL failed, fd = %d, errno = %d", fd, errno);
+		}
+	}
+	else
+	{
+		op = evep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		if (epoll_ctl(epollop->epfd, op, fd, &epev) == -1)
+		{
+			op = (errno == ENOENT) ? EPOLL_CTL_ADD : (errno == EEXIST) ? EPOLL_CTL_MOD : -1;
+			if (op == -1 || epoll_ctl(epollop->epfd, op, fd, &epev) == -1)
+			{
+				Error("epoll_ctl failed, fd = %d, errno = %d", fd, errno);
+				events = 0;
+			}
+		}
+	}
+	evep->registered = events;
+	evep->io.verify = 0;
+}
+
+static void epoll_apply_changes(struct epollop* epollop)
+{
+	for (int i = 0; i < epollop->nchanges; ++i)
+	{
+		epoll_apply_change(epollop, epollop->changes[i]);
+	}
+	epollop->nchanges = 0;
+}
+
+static int epoll_timerfd_init(struct epollop* epollop)
+{
+	struct epoll_event epev = {0, {0}};
+
+	if ((epollop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+	{
+		Error("timerfd_create failed, errno = %d", errno);
+		return (-1);
+	}
+	epev.data.fd = epollop->timerfd;
+	epev.events = EPOLLIN;
+	if (epoll_ctl(epollop->epfd, EPOLL_CTL_ADD, epollop->timerfd, &epev) == -1)
+	{
+		Error("epoll_ctl failed, errno = %d", errno);
+		close(epollop->timerfd);
+		epollop->timerfd = -1;
+		return (-1);
+	}
+	return (0);
+}
+
+static int epoll_timerfd_arm(struct epollop* epollop, const struct timeval* tv)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (tv != NULL)
+	{
+		its.it_value.tv_sec = tv->tv_sec;
+		its.it_value.tv_nsec = tv->tv_usec * 1000;
+	}
+	else if (!epollop->timerfd_armed)
+	{
+		return (0);
+	}
+	if (timerfd_settime(epollop->timerfd, 0, &its, NULL) == -1)
+	{
+		Error("timerfd_settime failed, errno = %d", errno);
+		return (-1);
+	}
+	epollop->timerfd_armed = (tv != NULL);
+	return (0);
+}
+
+/*
+ * Waits for exactly tv instead of rounding up to the next millisecond.
+ * epoll_pwait2 takes a timespec directly; before Linux 5.11 a timerfd in
+ * the epoll set is armed to the timeout and epoll_wait blocks until it or
+ * an I/O event fires.
+ */
+static int epoll_wait_precise(struct epollop* epollop, struct timeval* tv)
+{
+	int res;
+
+	if (epollop->use_pwait2)
+	{
+#ifdef __NR_epoll_pwait2
+		struct timespec ts;
+
+		if (tv != NULL)
+		{
+			ts.tv_sec = tv->tv_sec;
+			ts.tv_nsec = tv->tv_usec * 1000;
+		}
+		res = syscall(__NR_epoll_pwait2, epollop->epfd, epollop->events, epollop->nevents, tv != NULL ? &ts : NULL, NULL, 0);
+		if (res != -1 || errno != ENOSYS)
+		{
+			return (res);
+		}
+#endif
+		epollop->use_pwait2 = 0;
+		if (epoll_timerfd_init(epollop) == -1)
+		{
+			epollop->precise = 0;
+			return (epoll_wait(epollop->epfd, epollop->events, epollop->nevents, 0));
+		}
+	}
+
+	if (tv != NULL && !timerisset(tv))
+	{
+		return (epoll_wait(epollop->epfd, epollop->events, epollop->nevents, 0));
+	}
+	if (epoll_timerfd_arm(epollop, tv) == -1)
+	{
+		return (-1);
+	}
+	return (epoll_wait(epollop->epfd, epollop->events, epollop->nevents, -1));
+}
+
 static int epoll_dispatch(struct event_base* base, void* arg, struct timeval* tv)
 {
 	struct epollop* epollop = (struct epollop*)arg;
-	struct epoll_event* events = epollop->events;
-	struct evepoll* evep;
+	struct epoll_event* events;
 	int res;
 	int timeout = -1;
 
@@ -124,7 +324,20 @@ static int epoll_dispatch(struct event_base* base, void* arg, struct timeval* tv
 		timeout = MAX_EPOLL_TIMEOUT_MSEC;
 	}
 
-	res = epoll_wait(epollop->epfd, events, epollop->nevents, timeout);
+	if (epollop->nchanges)
+	{
+		epoll_apply_changes(epollop);
+	}
+
+	if (epollop->precise)
+	{
+		res = epoll_wait_precise(epollop, tv);
+	}
+	else
+	{
+		res = epoll_wait(epollop->epfd, epollop->events, epollop->nevents, timeout);
+	}
+	events = epollop->events;
 
 	if (res == -1) 
 	{
@@ -133,60 +346,48 @@ static int epoll_dispatch(struct event_base* base, void* arg, struct timeval* tv
 			Error("epoll_wait failed, errno = %d\n", errno);
 			return (-1);
 		}
-
-		evsignal_process(base);
 		return (0);
 	} 
-	else if (base->sig->evsignal_caught) 
-	{
-		evsignal_process(base);
-	}
 
 	Debug("epoll_wait reports %d", res);
 
 	for (int i = 0; i < res; ++i) 
 	{
 		int what = events[i].events;
-		struct event* evread = NULL; 
-		struct event* evwrite = NULL;
 		int fd = events[i].data.fd;
+		short active = 0;
 
+		if (fd == epollop->timerfd)
+		{
+			uint64_t expirations;
+			if (read(fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+			{
+				Error("read failed, errno = %d", errno);
+			}
+			epollop->timerfd_armed = 0;
+			continue;
+		}
 		if (fd < 0 || fd >= epollop->nfds)
 		{
 			continue;
 		}
-		evep = &epollop->fds[fd];
 
 		if (what & (EPOLLHUP | EPOLLERR)) 
 		{
-			evread = evep->evread;
-			evwrite = evep->evwrite;
+			active = EV_READ | EV_WRITE;
 		} 
 		else 
 		{
 			if (what & EPOLLIN) 
 			{
-				evread = evep->evread;
+				active |= EV_READ;
 			}
-
 			if (what & EPOLLOUT) 
 			{
-				evwrite = evep->evwrite;
+				active |= EV_WRITE;
 			}
 		}
-
-		if (!(evread || evwrite))
-		{
-			continue;
-		}
-		if (evread != NULL)
-		{
-			event_active(evread, EV_READ, 1);
-		}
-		if (evwrite != NULL)
-		{
-			event_active(evwrite, EV_WRITE, 1);
-		}
+		evmap_io_active(&epollop->fds[fd].io, active);
 	}
 
 	if (res == epollop->nevents && epollop->nevents < MAX_NEVENTS) 
@@ -226,41 +427,31 @@ static int epoll_add(void* arg, struct event* ev)
 		}
 	}
 	evep = &epollop->fds[fd];
-	op = EPOLL_CTL_ADD;
-	events = 0;
-	if (evep->evread != NULL) 
+	if (epollop->use_changelist)
 	{
-		events |= EPOLLIN;
-		op = EPOLL_CTL_MOD;
-	}
-	if (evep->evwrite != NULL) 
-	{
-		events |= EPOLLOUT;
-		op = EPOLL_CTL_MOD;
+		if (epoll_queue_change(epollop, fd) == -1)
+		{
+			return (-1);
+		}
+		evmap_io_add(&evep->io, ev);
+		return (0);
 	}
 
-	if (ev->ev_events & EV_READ)
+	evmap_io_add(&evep->io, ev);
+	events = epoll_interest(evep);
+	if (events == evep->registered)
 	{
-		events |= EPOLLIN;
-	}
-	if (ev->ev_events & EV_WRITE)
-	{
-		events |= EPOLLOUT;
+		return (0);
 	}
+	op = evep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
 	epev.data.fd = fd;
 	epev.events = events;
-	if (epoll_ctl(epollop->epfd, op, ev->ev_fd, &epev) == -1)
-	{
-			return (-1);
-	}
-	if (ev->ev_events & EV_READ)
-	{
-		evep->evread = ev;
-	}
-	if (ev->ev_events & EV_WRITE)
+	if (epoll_ctl(epollop->epfd, op, fd, &epev) == -1)
 	{
-		evep->evwrite = ev;
+		evmap_io_del(&evep->io, ev);
+		return (-1);
 	}
+	evep->registered = events;
 	return (0);
 }
 
@@ -269,8 +460,7 @@ static int epoll_del(void* arg, struct event* ev)
 	struct epollop* epollop = (struct epollop*)arg;
 	struct epoll_event epev = {0, {0}};
 	struct evepoll* evep;
-	int fd, events, op;
-	int needwritedelete = 1, needreaddelete = 1;
+	int fd, op, events;
 
 	if (ev->ev_events & EV_SIGNAL)
 	{
@@ -282,45 +472,26 @@ static int epoll_del(void* arg, struct event* ev)
 		return (0);
 	}
 	evep = &epollop->fds[fd];
-
-	op = EPOLL_CTL_DEL;
-	events = 0;
-
-	if (ev->ev_events & EV_READ)
+	if (epollop->use_changelist)
 	{
-		events |= EPOLLIN;
-	}
-	if (ev->ev_events & EV_WRITE)
-	{
-		events |= EPOLLOUT;
-	}
-	if ((events & (EPOLLIN | EPOLLOUT)) != (EPOLLIN | EPOLLOUT)) 
-	{
-		if ((events & EPOLLIN) && evep->evwrite != NULL) 
-		{
-			needwritedelete = 0;
-			events = EPOLLOUT;
-			op = EPOLL_CTL_MOD;
-		} 
-		else if ((events & EPOLLOUT) && evep->evread != NULL) 
+		if (epoll_queue_change(epollop, fd) == -1)
 		{
-			needreaddelete = 0;
-			events = EPOLLIN;
-			op = EPOLL_CTL_MOD;
+			return (-1);
 		}
+		evmap_io_del(&evep->io, ev);
+		return (0);
 	}
 
-	epev.events = events;
-	epev.data.fd = fd;
-
-	if (needreaddelete)
-	{
-		evep->evread = NULL;
-	}
-	if (needwritedelete)
+	evmap_io_del(&evep->io, ev);
+	events = epoll_interest(evep);
+	if (events == evep->registered)
 	{
-		evep->evwrite = NULL;
+		return (0);
 	}
+	op = events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+	epev.data.fd = fd;
+	epev.events = events;
+	evep->registered = events;
 	if (epoll_ctl(epollop->epfd, op, fd, &epev) == -1)
 	{
 		return (-1);
@@ -333,6 +504,10 @@ static void epoll_dealloc(struct event_base* base, void* arg)
 	struct epollop* epollop = (struct epollop*)arg;
 
 	evsignal_dealloc(base);
+	if (epollop->timerfd != -1)
+	{
+		close(epollop->timerfd);
+	}
 	if (epollop->fds)
 	{
 		free(epollop->fds);
@@ -341,6 +516,10 @@ static void epoll_dealloc(struct event_base* base, void* arg)
 	{
 		free(epollop->events);
 	}
+	if (epollop->changes)
+	{
+		free(epollop->changes);
+	}
 	if (epollop->epfd >= 0)
 	{
 		close(epollop->epfd);
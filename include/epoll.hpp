@@ -7,12 +7,17 @@ extern "C"
 {
 #endif
 
+#include "evmap.hpp"
+
 
 struct event;
 struct evepoll 
 {
-	struct event* evread;
-	struct event* evwrite;
+	struct evmap_io io;
+
+	/* the EPOLL* mask the kernel was last given for this fd */
+	int registered;
+	int changed;
 };
 
 struct epollop 
@@ -22,6 +27,17 @@ struct epollop
 	struct epoll_event* events;
 	int nevents;
 	int epfd;
+
+	int use_changelist;
+	int* changes;
+	int nchanges;
+	int achanges;
+
+	/* EVENT_BASE_FLAG_PRECISE_TIMER: epoll_pwait2, or a timerfd on kernels without it */
+	int precise;
+	int use_pwait2;
+	int timerfd;
+	int timerfd_armed;
 };
 
 struct eventop 
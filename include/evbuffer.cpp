@@ -26,6 +26,117 @@ static int bufferevent_add(struct event* ev, int timeout)
 }
 
 
+/*
+ * Without an errorcb, an edge-triggered bufferevent keeps the first error
+ * in pending_error for whoever looks next, since its persistent event will
+ * not report the EOF again. A level-triggered one reports it again once
+ * its read or write event is re-added.
+ */
+static void bufferevent_error(struct bufferevent* bufev, short what)
+{
+	if (bufev->errorcb == NULL)
+	{
+		if ((bufev->ev_read.ev_events & EV_ET) && !bufev->pending_error)
+		{
+			bufev->pending_error = what;
+		}
+		return;
+	}
+	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+
+/*
+ * Edge-triggered read: drain the socket until EAGAIN and hand the whole
+ * burst to readcb at once. Past BUFFEREVENT_ET_READ_MAX the event is made
+ * active again instead, so one fast sender cannot hold the loop; the rest
+ * is read on the next pass. An EOF or error seen after some data is kept
+ * in pending_error: readcb gets the data first, and errorcb runs once the
+ * output queued in response has been written.
+ */
+static void bufferevent_readcb_et(struct bufferevent* bufev, int fd)
+{
+	short what = EVBUFFER_READ;
+	size_t total = 0;
+	size_t len;
+	int res;
+
+	if (bufev->pending_error)
+	{
+		if (bufev->output->off == 0 || !event_pending(&bufev->ev_write, EV_WRITE, NULL))
+		{
+			bufferevent_error(bufev, bufev->pending_error);
+		}
+		return;
+	}
+
+	for (;;)
+	{
+		int howmuch = -1;
+
+		if (bufev->wm_read.high != 0) 
+		{
+			howmuch = bufev->wm_read.high - bufev->input->off;
+			if (howmuch <= 0) 
+			{
+				/* not drained: re-adding the event later reports the rest */
+				event_del(&bufev->ev_read);
+				evbuffer_setcb(bufev->input, bufferevent_read_pressure_cb, bufev);
+				break;
+			}
+		}
+
+		res = evbuffer_read(bufev->input, fd, howmuch);
+		if (res > 0)
+		{
+			total += res;
+			if (total >= BUFFEREVENT_ET_READ_MAX)
+			{
+				/* no edge will come for what is left: queue this event behind the others */
+				event_active(&bufev->ev_read, EV_READ, 1);
+				break;
+			}
+			continue;
+		}
+		if (res == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (res == -1 && errno == EAGAIN)
+		{
+			break;
+		}
+
+		what |= (res == 0) ? EVBUFFER_EOF : EVBUFFER_ERROR;
+		if (total == 0)
+		{
+			bufferevent_error(bufev, what);
+			return;
+		}
+		bufev->pending_error = what;
+		event_active(&bufev->ev_read, EV_READ, 1);
+		break;
+	}
+
+	if (total == 0)
+	{
+		return;
+	}
+	if (bufev->ev_read.ev_flags & EVLIST_INSERTED)
+	{
+		bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+	}
+
+	len = bufev->input->off;
+	if (bufev->wm_read.low != 0 && len < bufev->wm_read.low)
+	{
+		return;
+	}
+	if (bufev->readcb != NULL)
+	{
+		(*bufev->readcb)(bufev, bufev->cbarg);
+	}
+}
+
 static void bufferevent_readcb(int fd, short event, void* arg)
 {
 	struct bufferevent* bufev = (struct bufferevent*)arg;
@@ -39,6 +150,11 @@ static void bufferevent_readcb(int fd, short event, void* arg)
 		what |= EVBUFFER_TIMEOUT;
 		goto error;
 	}
+	if (bufev->ev_read.ev_events & EV_ET)
+	{
+		bufferevent_readcb_et(bufev, fd);
+		return;
+	}
 	if (bufev->wm_read.high != 0) 
 	{
 		howmuch = bufev->wm_read.high - bufev->input->off;
@@ -95,7 +211,7 @@ reschedule:
 	return;
 
 error:
-	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+	bufferevent_error(bufev, what);
 }
 
 static void bufferevent_writecb(int fd, short event, void* arg)
@@ -133,6 +249,11 @@ static void bufferevent_writecb(int fd, short event, void* arg)
 
 	if (bufev->output->off != 0)
 		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+	else if (bufev->pending_error)
+	{
+		bufferevent_error(bufev, bufev->pending_error);
+		return;
+	}
 
 	if (bufev->writecb != NULL && bufev->output->off <= bufev->wm_write.low)
 	{
@@ -148,7 +269,7 @@ reschedule:
 	return;
 
 error:
-	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+	bufferevent_error(bufev, what);
 }
 
 
@@ -240,10 +361,13 @@ void bufferevent_setcb(struct bufferevent* bufev, evbuffercb readcb, evbuffercb
 
 void bufferevent_setfd(struct bufferevent* bufev, int fd)
 {
+	short read_events = bufev->ev_read.ev_events;
+
 	event_del(&bufev->ev_read);
 	event_del(&bufev->ev_write);
+	bufev->pending_error = 0;
 
-	event_set(&bufev->ev_read, fd, EV_READ, bufferevent_readcb, bufev);
+	event_set(&bufev->ev_read, fd, read_events, bufferevent_readcb, bufev);
 	event_set(&bufev->ev_write, fd, EV_WRITE, bufferevent_writecb, bufev);
 	if (bufev->ev_base != NULL) 
 	{
@@ -252,6 +376,36 @@ void bufferevent_setfd(struct bufferevent* bufev, int fd)
 	}
 }
 
+int bufferevent_setedge(struct bufferevent* bufev, int edge)
+{
+	short events = edge ? (EV_READ | EV_PERSIST | EV_ET) : EV_READ;
+	int pri = bufev->ev_read.ev_pri;
+
+	if (bufev->ev_read.ev_events == events)
+	{
+		return (0);
+	}
+	if (event_del(&bufev->ev_read) == -1)
+	{
+		Error("event_del failed");
+		return (-1);
+	}
+
+	event_set(&bufev->ev_read, bufev->ev_read.ev_fd, events, bufferevent_readcb, bufev);
+	if (bufev->ev_base != NULL)
+	{
+		event_base_set(bufev->ev_base, &bufev->ev_read);
+	}
+	bufev->ev_read.ev_pri = pri;
+
+	if ((bufev->enabled & EV_READ) && bufferevent_add(&bufev->ev_read, bufev->timeout_read) == -1)
+	{
+		Error("bufferevent_add failed");
+		return (-1);
+	}
+	return (0);
+}
+
 int bufferevent_write(struct bufferevent* bufev, const void* data, size_t size)
 {
 	int res;
@@ -270,33 +424,47 @@ int bufferevent_write(struct bufferevent* bufev, const void* data, size_t size)
 	return (res);
 }
 
-int bufferevent_write_buffer(struct bufferevent* bufev, struct evbuffer* buf)
+/* like bufferevent_write, but data is sent in place; see evbuffer_add_reference */
+int bufferevent_write_reference(struct bufferevent* bufev, const void* data, size_t size, evbuffer_ref_cleanup_cb cleanup, void* arg)
 {
 	int res;
 
-	res = bufferevent_write(bufev, buf->buffer, buf->off);
-	if (res != -1)
+	res = evbuffer_add_reference(bufev->output, data, size, cleanup, arg);
+
+	if (res == -1)
 	{
-		evbuffer_drain(buf, buf->off);
+		Error("evbuffer_add_reference failed");
+		return (res);
+	}
+	if (size > 0 && (bufev->enabled & EV_WRITE))
+	{
+		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
 	}
 	return (res);
 }
 
-size_t bufferevent_read(struct bufferevent* bufev, void* data, size_t size)
+int bufferevent_write_buffer(struct bufferevent* bufev, struct evbuffer* buf)
 {
-	struct evbuffer* buf = bufev->input;
+	size_t size = buf->off;
+	int res;
 
-	if (buf->off < size)
+	res = evbuffer_add_buffer(bufev->output, buf);
+
+	if (res == -1)
 	{
-		size = buf->off;
+		Error("evbuffer_add_buffer failed");
+		return (res);
 	}
-	memcpy(data, buf->buffer, size);
-
-	if (size)
+	if (size > 0 && (bufev->enabled & EV_WRITE))
 	{
-		evbuffer_drain(buf, size);
+		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
 	}
-	return (size);
+	return (res);
+}
+
+size_t bufferevent_read(struct bufferevent* bufev, void* data, size_t size)
+{
+	return (evbuffer_remove(bufev->input, data, size));
 }
 
 
@@ -7,6 +7,7 @@ extern "C" {
 #endif
 
 #include "event.hpp"
+#include "buffer.hpp"
 
 #define EVBUFFER_READ		0x01
 #define EVBUFFER_WRITE		0x02
@@ -14,6 +15,9 @@ extern "C" {
 #define EVBUFFER_ERROR		0x20
 #define EVBUFFER_TIMEOUT	0x40
 
+/* an edge-triggered bufferevent reads at most this much per wakeup before yielding to other events */
+#define BUFFEREVENT_ET_READ_MAX	(4 * EVBUFFER_READ_SEGMENTS * EVBUFFER_CHAIN_SIZE)
+
 struct bufferevent;
 typedef void (*evbuffercb)(struct bufferevent *, void *);
 typedef void (*everrorcb)(struct bufferevent *, short what, void *);
@@ -48,6 +52,7 @@ struct bufferevent
 	int timeout_write;
 
 	short enabled;
+	short pending_error;
 };
 
 
@@ -59,7 +64,9 @@ int bufferevent_priority_set(struct bufferevent* bufev, int priority);
 void bufferevent_free(struct bufferevent* bufev);
 void bufferevent_setcb(struct bufferevent* bufev, evbuffercb readcb, evbuffercb writecb, everrorcb errorcb, void* cbarg);
 void bufferevent_setfd(struct bufferevent* bufev, int fd);
+int bufferevent_setedge(struct bufferevent* bufev, int edge);
 int bufferevent_write(struct bufferevent* bufev, const void* data, size_t size);
+int bufferevent_write_reference(struct bufferevent* bufev, const void* data, size_t size, evbuffer_ref_cleanup_cb cleanup, void* arg);
 int bufferevent_write_buffer(struct bufferevent* bufev, struct evbuffer* buf);
 size_t bufferevent_read(struct bufferevent* bufev, void* data, size_t size);
 int bufferevent_enable(struct bufferevent* bufev, short event);
@@ -4,18 +4,28 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/socket.h>
 #include "log.hpp"
 #include "minheap.hpp"
+#include "timerwheel.hpp"
 #include "signal.hpp"
+#include "notify.hpp"
 #include "epoll.hpp"
+#include "evstats.hpp"
+#include "watchdog.hpp"
 #include "event.hpp"
 
+/* what dispatch touches must fit in the first 64 bytes of an event */
+static_assert(offsetof(struct event, min_heap_idx) == 64, "hot fields of struct event outgrew 64 bytes");
+
 struct event_base* current_base = NULL;
-int (*event_sigcb)(void);
-volatile sig_atomic_t event_gotsig;
 
+/* io_uring first; its init fails, and epoll is used, when the kernel lacks it or EVENT_NOURING is set */
 static const struct eventop *eventops[] = 
 {
+	&uringops,
 	&epollops,
 	NULL
 };
@@ -23,12 +33,57 @@ static const struct eventop *eventops[] =
 
 static int use_monotonic;
 
+/*
+ * Events added with a registered common duration are kept in a FIFO per
+ * duration; deadlines in it are sorted because the clock only moves
+ * forward. Only timeout_event, armed to the head's deadline, sits in the
+ * heap or wheel. min_heap_idx of a queued event carries
+ * COMMON_TIMEOUT_IDX_FLAG plus the queue index.
+ */
+#define MAX_COMMON_TIMEOUTS	256
+#define COMMON_TIMEOUT_IDX_FLAG	0x40000000
+#define COMMON_TIMEOUT_IDX_MASK	0x000000ff
+
+struct common_timeout_list
+{
+	struct event_list events;
+	struct timeval duration;
+	struct event timeout_event;
+	struct event_base* base;
+};
+
+struct event_once 
+{
+	struct event ev;
+
+	void (*cb)(int, short, void *);
+	void *arg;
+	struct event_once* next;
+};
+
+/*
+ * Once-events come from a per-base free list that grows EVENT_ONCE_CHUNK
+ * at a time and is only given back when the base is freed, so a warm
+ * base schedules them without touching malloc.
+ */
+#define EVENT_ONCE_CHUNK	64
+
+struct event_once_chunk
+{
+	struct event_once_chunk* next;
+	struct event_once items[EVENT_ONCE_CHUNK];
+};
+
 static void	event_queue_insert(struct event_base*, struct event*, int);
 static void	event_queue_remove(struct event_base*, struct event*, int);
 static int	event_haveevents(struct event_base*);
 
 static void	event_process_active(struct event_base*);
 
+static struct event* timeout_first(struct event_base*);
+static int	is_common_timeout(struct event*);
+static struct common_timeout_list* common_timeout_match(struct event_base*, const struct timeval*, int*);
+static void	common_timeout_schedule(struct common_timeout_list*, struct event*);
 static int	timeout_next(struct event_base*, struct timeval**);
 static void	timeout_process(struct event_base*);
 static void	timeout_correct(struct event_base*, struct timeval*);
@@ -68,6 +123,20 @@ static int gettime(struct event_base* base, struct timeval* tp)
 	return gettimeofday(tp, NULL);
 }
 
+/* uncached, on the same clock as gettime(), for the loop statistics */
+static uint64_t gettime_nsec(void)
+{
+	struct timespec	ts;
+	struct timeval tv;
+
+	if (use_monotonic && clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	{
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+}
+
 struct event_base* event_init(void)
 {
 	struct event_base* base = event_base_new();
@@ -80,33 +149,75 @@ struct event_base* event_init(void)
 }
 
 struct event_base* event_base_new(void)
+{
+	return event_base_new_with_flags(0);
+}
+
+/* undoes event_base_new_with_flags before a backend is up: nothing can have been added yet */
+static struct event_base* event_base_abort(struct event_base* base)
+{
+	if (base->timewheel != NULL)
+	{
+		timer_wheel_dtor(base->timewheel);
+		free(base->timewheel);
+	}
+	if (base->timeheap != NULL)
+	{
+		min_heap_dtor(base->timeheap);
+		free(base->timeheap);
+	}
+	free(base->eventqueue);
+	free(base->sig);
+	free(base);
+	return (NULL);
+}
+
+struct event_base* event_base_new_with_flags(int flags)
 {
 	struct event_base* base;
 
 	if ((base = (struct event_base*)calloc(1, sizeof(struct event_base))) == NULL)
 	{
 		Error("calloc failed, errno = %d", errno);
+		return (NULL);
 	}
-	event_sigcb = NULL;
-	event_gotsig = 0;
+	base->flags = flags;
 
 	detect_monotonic();
 	gettime(base, &base->event_tv);
 	
-	base->timeheap = (struct min_heap*)calloc(1, sizeof(struct min_heap));
+	if ((base->timeheap = (struct min_heap*)calloc(1, sizeof(struct min_heap))) == NULL)
+	{
+		Error("calloc failed, errno = %d", errno);
+		return (event_base_abort(base));
+	}
 	min_heap_ctor(base->timeheap);
+
+	if (flags & EVENT_BASE_FLAG_TIMERWHEEL)
+	{
+		base->timewheel = (struct timer_wheel*)calloc(1, sizeof(struct timer_wheel));
+		if (base->timewheel == NULL || timer_wheel_ctor(base->timewheel, &base->event_tv) == -1)
+		{
+			Error("timer_wheel_ctor failed");
+			return (event_base_abort(base));
+		}
+	}
  
 	base->eventqueue = (struct event_list*)calloc(1, sizeof(struct event_list));
 	if (base->eventqueue == NULL)
 	{
 		Error("calloc failed, errno = %d", errno);
+		return (event_base_abort(base));
 	}
 	(base->eventqueue)->tqh_first = NULL;
 	(base->eventqueue)->tqh_last = &(base->eventqueue)->tqh_first;
 
-	base->sig = (struct evsignal_info*)calloc(1, sizeof(struct evsignal_info));
-	base->sig->ev_signal_pair[0] = -1;
-	base->sig->ev_signal_pair[1] = -1;
+	if ((base->sig = (struct evsignal_info*)calloc(1, sizeof(struct evsignal_info))) == NULL)
+	{
+		Error("calloc failed, errno = %d", errno);
+		return (event_base_abort(base));
+	}
+	base->sig->ev_signal_fd = -1;
 	
 	base->evbase = NULL;
 	for (int i = 0; eventops[i] && !base->evbase; ++i) 
@@ -118,10 +229,29 @@ struct event_base* event_base_new(void)
 	if (base->evbase == NULL)
 	{
 		Error("no event mechanism available");
+		return (event_base_abort(base));
 	}
 
+	/* without the notify fd nothing can reach the loop from another thread */
+	if ((base->notify = (struct evnotify_info*)calloc(1, sizeof(struct evnotify_info))) == NULL)
+	{
+		Error("calloc failed, errno = %d", errno);
+		event_base_free(base);
+		return (NULL);
+	}
+	base->notify->ev_notify_fd = -1;
+	if (evnotify_init(base) == -1)
+	{
+		event_base_free(base);
+		return (NULL);
+	}
 
 	event_base_priority_init(base, 1);
+	if (event_base_once_reserve(base, EVENT_ONCE_CHUNK) == -1)
+	{
+		event_base_free(base);
+		return (NULL);
+	}
 
 	return (base);
 }
@@ -150,7 +280,17 @@ void event_base_free(struct event_base* base)
 		}
 		ev = next;
 	}
-	while ((ev = min_heap_top(base->timeheap)) != NULL) 
+	for (i = 0; i < base->n_common_timeouts; ++i) 
+	{
+		struct common_timeout_list* ctl = base->common_timeout_queues[i];
+		while ((ev = ctl->events.tqh_first) != NULL) 
+		{
+			event_del(ev);
+			++n_deleted;
+		}
+		event_del(&ctl->timeout_event);
+	}
+	while ((ev = timeout_first(base)) != NULL) 
 	{
 		event_del(ev);
 		++n_deleted;
@@ -174,6 +314,8 @@ void event_base_free(struct event_base* base)
 	{
 		Debug("%d events were still set in base", n_deleted);
 	}
+	evnotify_dealloc(base);
+	evwatchdog_dealloc(base);
 	if (base->evsel->dealloc != NULL)
 	{
 		base->evsel->dealloc(base, base->evbase);
@@ -184,17 +326,39 @@ void event_base_free(struct event_base* base)
 	}
 	assert(min_heap_empty(base->timeheap));
 	min_heap_dtor(base->timeheap);
+	if (base->timewheel != NULL)
+	{
+		assert(timer_wheel_empty(base->timewheel));
+		timer_wheel_dtor(base->timewheel);
+		free(base->timewheel);
+	}
+
+	for (i = 0; i < base->n_common_timeouts; ++i)
+	{
+		free(base->common_timeout_queues[i]);
+	}
+	free(base->common_timeout_queues);
 
 	for (i = 0; i < base->nactivequeues; ++i)
 	{
 		free(base->activequeues[i]);
 	}
 	free(base->activequeues);
+	free(base->priority_weights);
+	free(base->stats);
+	while (base->once_chunks != NULL)
+	{
+		struct event_once_chunk* chunk = base->once_chunks;
+		base->once_chunks = chunk->next;
+		free(chunk);
+	}
 
 	free(base->timeheap);
 
 	free(base->sig);
 
+	free(base->notify);
+
 	assert(base->eventqueue->tqh_first == NULL);
 
 	free(base->eventqueue);
@@ -259,6 +423,14 @@ int event_base_priority_init(struct event_base *base, int npriorities)
 	{
 		return (0);
 	}
+	if (base->priority_weights != NULL)
+	{
+		/* the weights were per priority, so they go with the old queues */
+		free(base->priority_weights);
+		base->priority_weights = NULL;
+		base->rr_queue = 0;
+		base->rr_used = 0;
+	}
 	if (base->nactivequeues) 
 	{
 		for (i = 0; i < base->nactivequeues; ++i) 
@@ -296,46 +468,134 @@ int event_haveevents(struct event_base* base)
 	return (base->event_count > 0);
 }
 
-static void event_process_active(struct event_base* base)
+/*
+ * Runs callbacks from one active queue until it is empty or max callbacks
+ * have been made (max <= 0: no limit). Returns the number of callbacks
+ * made, or -1 if the loop has to stop.
+ */
+static int event_process_queue(struct event_base* base, struct event_list* activeq, int max)
 {
+	struct event_stats* stats = base->stats;
+	struct event_watchdog* watchdog = base->watchdog;
 	struct event *ev;
-	struct event_list *activeq = NULL;
-	int i;
-	short ncalls;
+	int count = 0;
+	uint64_t start = 0;
 
-	for (i = 0; i < base->nactivequeues; ++i) 
+	for (ev = activeq->tqh_first; ev && (max <= 0 || count < max); ev = activeq->tqh_first) 
 	{
-		if (base->activequeues[i]->tqh_first != NULL) 
+		if (ev->ev_events & EV_PERSIST)
 		{
-			activeq = base->activequeues[i];
-			break;
+			event_queue_remove(base, ev, EVLIST_ACTIVE);
+		}
+		else
+		{
+			event_del(ev);
 		}
+		/* kept in the base, so a callback that deletes and frees ev ends the loop without touching it */
+		base->running_event = ev;
+		base->running_ncalls = ev->ev_ncalls;
+		while (base->running_ncalls) 
+		{
+			ev->ev_ncalls = --base->running_ncalls;
+			if (stats != NULL || watchdog != NULL)
+			{
+				start = gettime_nsec();
+				if (stats != NULL && (ev->ev_res & EV_TIMEOUT) && start > min_heap_deadline(ev))
+				{
+					evstats_record(&stats->timer_late_nsec, start - min_heap_deadline(ev));
+				}
+				if (watchdog != NULL)
+				{
+					evwatchdog_enter(watchdog, ev, start);
+				}
+			}
+			(*ev->ev_callback)((int)ev->ev_fd, ev->ev_res, ev->ev_arg);
+			if (stats != NULL || watchdog != NULL)
+			{
+				uint64_t end = gettime_nsec();
+				if (stats != NULL)
+				{
+					evstats_record(&stats->callback_nsec, end - start);
+				}
+				if (watchdog != NULL)
+				{
+					evwatchdog_leave(watchdog, end);
+				}
+			}
+			++count;
+			if (base->event_break)
+			{
+				base->running_event = NULL;
+				return (-1);
+			}
+		}
+		base->running_event = NULL;
 	}
+	return (count);
+}
 
-	assert(activeq != NULL);
+/*
+ * Without weights only the highest non-empty priority is served, as
+ * before. With weights each queue gets up to its weight in callbacks per
+ * round, resuming where the previous pass stopped. Either way a pass ends
+ * after max_callbacks; what is left stays active, so the loop polls with
+ * a zero timeout and runs expired timers before the next batch.
+ */
+static void event_process_active(struct event_base* base)
+{
+	int budget = base->max_callbacks;
+	int done = 0, idle = 0;
+	int i, n;
 
-	for (ev = activeq->tqh_first; ev; ev = activeq->tqh_first) 
+	if (base->stats != NULL)
 	{
-		if (ev->ev_events & EV_PERSIST)
+		evstats_record(&base->stats->active_depth, base->event_count_active);
+	}
+	if (base->priority_weights == NULL)
+	{
+		for (i = 0; i < base->nactivequeues; ++i) 
 		{
-			event_queue_remove(base, ev, EVLIST_ACTIVE);
+			if (base->activequeues[i]->tqh_first != NULL) 
+			{
+				event_process_queue(base, base->activequeues[i], budget);
+				return;
+			}
 		}
-		else
+		assert(0);
+		return;
+	}
+
+	while (idle < base->nactivequeues)
+	{
+		struct event_list* activeq = base->activequeues[base->rr_queue];
+		int quota = base->priority_weights[base->rr_queue] - base->rr_used;
+
+		if (budget > 0 && quota > budget - done)
 		{
-			event_del(ev);
+			quota = budget - done;
 		}
-		ncalls = ev->ev_ncalls;
-		ev->ev_pncalls = &ncalls;
-		while (ncalls) 
+		n = 0;
+		if (activeq->tqh_first != NULL && (n = event_process_queue(base, activeq, quota)) == -1)
 		{
-			ncalls--;
-			ev->ev_ncalls = ncalls;
-			(*ev->ev_callback)((int)ev->ev_fd, ev->ev_res, ev->ev_arg);
-			if (event_gotsig || base->event_break)
+			return;
+		}
+		idle = n ? 0 : idle + 1;
+		done += n;
+		base->rr_used += n;
+		if (base->rr_used >= base->priority_weights[base->rr_queue] || activeq->tqh_first == NULL)
+		{
+			base->rr_used = 0;
+			base->rr_queue = (base->rr_queue + 1) % base->nactivequeues;
+			/* without a budget one round per pass keeps the loop responsive */
+			if (budget <= 0 && base->rr_queue == 0)
 			{
 				return;
 			}
 		}
+		if (budget > 0 && done >= budget)
+		{
+			return;
+		}
 	}
 }
 
@@ -360,9 +620,53 @@ int event_loopexit(const struct timeval *tv)
 	return (event_once(-1, EV_TIMEOUT, event_loopexit_cb, current_base, tv));
 }
 
+struct event_loopexit_req
+{
+	struct event_base* base;
+	struct timeval tv;
+};
+
+static void event_loopexit_in_loop(void* arg)
+{
+	struct event_loopexit_req* req = (struct event_loopexit_req*)arg;
+
+	event_base_once(req->base, -1, EV_TIMEOUT, event_loopexit_cb, req->base, &req->tv);
+	free(req);
+}
+
 int event_base_loopexit(struct event_base *event_base, const struct timeval *tv)
 {
-	return (event_base_once(event_base, -1, EV_TIMEOUT, event_loopexit_cb, event_base, tv));
+	struct event_loopexit_req* req;
+
+	if (evnotify_in_loop(event_base))
+	{
+		return (event_base_once(event_base, -1, EV_TIMEOUT, event_loopexit_cb, event_base, tv));
+	}
+
+	/*
+	 * The timer heap belongs to the loop thread, so arm the exit timer from
+	 * there. This also holds before the loop has started: the owner may be
+	 * entering it right now, and the task simply waits for the first pass.
+	 */
+	if ((req = (struct event_loopexit_req*)malloc(sizeof(struct event_loopexit_req))) == NULL)
+	{
+		return (-1);
+	}
+	req->base = event_base;
+	if (tv != NULL)
+	{
+		req->tv = *tv;
+	}
+	else
+	{
+		timerclear(&req->tv);
+	}
+	if (event_base_run_in_loop(event_base, event_loopexit_in_loop, req) == -1)
+	{
+		free(req);
+		return (-1);
+	}
+	return (0);
 }
 
 int event_loopbreak(void)
@@ -377,6 +681,10 @@ int event_base_loopbreak(struct event_base *event_base)
 		return (-1);
 	}
 	event_base->event_break = 1;
+	if (!evnotify_in_loop(event_base))
+	{
+		event_base_notify(event_base);
+	}
 	return (0);
 }
 
@@ -386,6 +694,145 @@ int event_loop(int flags)
 	return event_base_loop(current_base, flags);
 }
 
+int event_base_set_busy_poll(struct event_base* base, int budget_usec, int so_busy_poll_usec)
+{
+	if (budget_usec < 0 || so_busy_poll_usec < 0)
+	{
+		return (-1);
+	}
+	base->busy_poll_usec = budget_usec;
+	base->so_busy_poll_usec = so_busy_poll_usec;
+	return (0);
+}
+
+void event_base_get_busy_poll_stats(struct event_base* base, struct event_busy_poll_stats* stats)
+{
+	*stats = base->busy_poll_stats;
+}
+
+int event_base_set_max_callbacks(struct event_base* base, int max_callbacks)
+{
+	if (max_callbacks < 0)
+	{
+		return (-1);
+	}
+	base->max_callbacks = max_callbacks;
+	return (0);
+}
+
+/* weights has one entry >= 1 per priority; NULL goes back to strict priority */
+int event_base_set_priority_weights(struct event_base* base, const int* weights)
+{
+	int* copy = NULL;
+
+	if (weights != NULL)
+	{
+		for (int i = 0; i < base->nactivequeues; ++i)
+		{
+			if (weights[i] < 1)
+			{
+				return (-1);
+			}
+		}
+		if ((copy = (int*)malloc(base->nactivequeues * sizeof(int))) == NULL)
+		{
+			Error("malloc failed, errno = %d", errno);
+			return (-1);
+		}
+		memcpy(copy, weights, base->nactivequeues * sizeof(int));
+	}
+	free(base->priority_weights);
+	base->priority_weights = copy;
+	base->rr_queue = 0;
+	base->rr_used = 0;
+	return (0);
+}
+
+/* once enabled the stats stay allocated until the base is freed, so readers never race a free */
+int event_base_enable_stats(struct event_base* base)
+{
+	struct event_stats* stats;
+
+	if (base->stats != NULL)
+	{
+		return (0);
+	}
+	if ((stats = (struct event_stats*)calloc(1, sizeof(struct event_stats))) == NULL)
+	{
+		Error("calloc failed, errno = %d", errno);
+		return (-1);
+	}
+	__atomic_store_n(&base->stats, stats, __ATOMIC_RELEASE);
+	return (0);
+}
+
+int event_base_get_stats(struct event_base* base, struct event_stats* snapshot)
+{
+	struct event_stats* stats = __atomic_load_n(&base->stats, __ATOMIC_ACQUIRE);
+
+	if (stats == NULL)
+	{
+		return (-1);
+	}
+	evstats_snapshot(stats, snapshot);
+	return (0);
+}
+
+static long long event_elapsed_usec(const struct timeval* from, const struct timeval* to)
+{
+	return (long long)(to->tv_sec - from->tv_sec) * 1000000 + (to->tv_usec - from->tv_usec);
+}
+
+/*
+ * Poll with a zero timeout for up to busy_poll_usec, never past the next
+ * timer. Returns 1 if something became active, 0 if the budget ran out
+ * (tv is then reduced by the time spent), -1 on a dispatch error.
+ */
+static int event_busy_poll(struct event_base* base, struct timeval* tv)
+{
+	const struct eventop* evsel = base->evsel;
+	struct timeval zero, start, now;
+	long long budget = base->busy_poll_usec;
+	long long spent = 0;
+
+	if (tv != NULL && (long long)tv->tv_sec * 1000000 + tv->tv_usec < budget)
+	{
+		budget = (long long)tv->tv_sec * 1000000 + tv->tv_usec;
+	}
+
+	timerclear(&zero);
+	gettime(base, &start);
+	do
+	{
+		if (evsel->dispatch(base, base->evbase, &zero) == -1)
+		{
+			return (-1);
+		}
+		++base->busy_poll_stats.spins;
+		gettime(base, &now);
+		spent = event_elapsed_usec(&start, &now);
+		if (base->event_count_active)
+		{
+			++base->busy_poll_stats.spin_hits;
+			base->busy_poll_stats.spin_usec += spent;
+			return (1);
+		}
+	} while (spent < budget);
+
+	base->busy_poll_stats.spin_usec += spent;
+	if (tv != NULL)
+	{
+		long long left = (long long)tv->tv_sec * 1000000 + tv->tv_usec - spent;
+		if (left < 0)
+		{
+			left = 0;
+		}
+		tv->tv_sec = left / 1000000;
+		tv->tv_usec = left % 1000000;
+	}
+	return (0);
+}
+
 int event_base_loop(struct event_base *base, int flags)
 {
 	const struct eventop *evsel = base->evsel;
@@ -393,13 +840,13 @@ int event_base_loop(struct event_base *base, int flags)
 	struct timeval tv;
 	struct timeval *tv_p;
 	int res, done;
+	int nactive = 0;
+	uint64_t poll_start = 0;
 
 	base->tv_cache.tv_sec = 0;
 
-	if (base->sig->ev_signal_added)
-	{
-		evsignal_base = base;
-	}
+	evnotify_set_owner(base);
+
 	done = 0;
 	while (!done) 
 	{
@@ -414,19 +861,6 @@ int event_base_loop(struct event_base *base, int flags)
 			base->event_break = 0;
 			break;
 		}
-		while (event_gotsig) 
-		{
-			event_gotsig = 0;
-			if (event_sigcb) 
-			{
-				res = (*event_sigcb)();
-				if (res == -1) 
-				{
-					errno = EINTR;
-					return (-1);
-				}
-			}
-		}
 
 		timeout_correct(base, &tv);
 
@@ -440,7 +874,7 @@ int event_base_loop(struct event_base *base, int flags)
 			timerclear(&tv);
 		}
 		
-		if (!event_haveevents(base)) 
+		if (!event_haveevents(base) && !(flags & EVLOOP_NO_EXIT_ON_EMPTY)) 
 		{
 			Debug("no events registered.");
 			return (1);
@@ -450,12 +884,44 @@ int event_base_loop(struct event_base *base, int flags)
 
 		base->tv_cache.tv_sec = 0;
 
-		res = evsel->dispatch(base, evbase, tv_p);
+		if (base->stats != NULL)
+		{
+			evstats_add(&base->stats->loops, 1);
+			nactive = base->event_count_active;
+			poll_start = gettime_nsec();
+		}
+
+		res = 0;
+		if (base->busy_poll_usec > 0 && (tv_p == NULL || timerisset(tv_p)))
+		{
+			res = event_busy_poll(base, tv_p);
+		}
+		if (res == 0)
+		{
+			struct timeval start, end;
+
+			if (base->busy_poll_usec > 0)
+			{
+				gettime(base, &start);
+			}
+			res = evsel->dispatch(base, evbase, tv_p);
+			if (base->busy_poll_usec > 0)
+			{
+				gettime(base, &end);
+				++base->busy_poll_stats.sleeps;
+				base->busy_poll_stats.sleep_usec += event_elapsed_usec(&start, &end);
+			}
+		}
 
 		if (res == -1)
 		{
 			return (-1);
 		}
+		if (base->stats != NULL)
+		{
+			evstats_record(&base->stats->dispatch_nsec, gettime_nsec() - poll_start);
+			evstats_record(&base->stats->events_per_wake, base->event_count_active - nactive);
+		}
 		gettime(base, &base->tv_cache);
 
 		timeout_process(base);
@@ -481,21 +947,67 @@ int event_base_loop(struct event_base *base, int flags)
 }
 
 
-struct event_once 
+int event_base_once_reserve(struct event_base* base, int n)
 {
-	struct event ev;
+	while (n > 0)
+	{
+		struct event_once_chunk* chunk;
 
-	void (*cb)(int, short, void *);
-	void *arg;
-};
+		if ((chunk = (struct event_once_chunk*)malloc(sizeof(struct event_once_chunk))) == NULL)
+		{
+			Error("malloc failed, errno = %d", errno);
+			return (-1);
+		}
+		chunk->next = base->once_chunks;
+		base->once_chunks = chunk;
+		for (int i = EVENT_ONCE_CHUNK - 1; i >= 0; --i)
+		{
+			chunk->items[i].next = base->once_free;
+			base->once_free = &chunk->items[i];
+		}
+		n -= EVENT_ONCE_CHUNK;
+	}
+	return (0);
+}
+
+void event_base_get_once_stats(struct event_base* base, struct event_once_stats* stats)
+{
+	*stats = base->once_stats;
+}
+
+static struct event_once* event_once_get(struct event_base* base)
+{
+	struct event_once* eonce;
+
+	if (base->once_free != NULL)
+	{
+		++base->once_stats.hits;
+	}
+	else
+	{
+		++base->once_stats.misses;
+		if (event_base_once_reserve(base, EVENT_ONCE_CHUNK) == -1)
+		{
+			return (NULL);
+		}
+	}
+	eonce = base->once_free;
+	base->once_free = eonce->next;
+	return (eonce);
+}
 
+static void event_once_put(struct event_base* base, struct event_once* eonce)
+{
+	eonce->next = base->once_free;
+	base->once_free = eonce;
+}
 
 static void event_once_cb(int fd, short events, void *arg)
 {
 	struct event_once *eonce = (struct event_once*)arg;
 
 	(*eonce->cb)(fd, events, eonce->arg);
-	free(eonce);
+	event_once_put(eonce->ev.ev_base, eonce);
 }
 
 int event_once(int fd, short events, void (*callback)(int, short, void *), void *arg, const struct timeval *tv)
@@ -513,7 +1025,7 @@ int event_base_once(struct event_base *base, int fd, short events, void (*callba
 	{
 		return (-1);
 	}
-	if ((eonce = (struct event_once*)calloc(1, sizeof(struct event_once))) == NULL)
+	if ((eonce = event_once_get(base)) == NULL)
 	{
 		return (-1);
 	}
@@ -538,7 +1050,7 @@ int event_base_once(struct event_base *base, int fd, short events, void (*callba
 	} 
 	else 
 	{
-		free(eonce);
+		event_once_put(base, eonce);
 		return (-1);
 	}
 
@@ -549,7 +1061,7 @@ int event_base_once(struct event_base *base, int fd, short events, void (*callba
 	}
 	if (res != 0) 
 	{
-		free(eonce);
+		event_once_put(base, eonce);
 		return (res);
 	}
 
@@ -567,7 +1079,6 @@ void event_set(struct event *ev, int fd, short events, void (*callback)(int, sho
 	ev->ev_res = 0;
 	ev->ev_flags = EVLIST_INIT;
 	ev->ev_ncalls = 0;
-	ev->ev_pncalls = NULL;
 
 	min_heap_elem_init(ev);
 
@@ -589,6 +1100,76 @@ int event_base_set(struct event_base* base, struct event* ev)
 	return (0);
 }
 
+static void common_timeout_callback(int fd, short what, void* arg)
+{
+	struct common_timeout_list* ctl = (struct common_timeout_list*)arg;
+	struct event_base* base = ctl->base;
+	struct timeval now;
+	struct event* ev;
+
+	gettime(base, &now);
+	while ((ev = ctl->events.tqh_first) != NULL) 
+	{
+		if (timercmp(&ev->ev_timeout, &now, >))
+		{
+			break;
+		}
+		event_del(ev);
+
+		Debug("common_timeout_callback: call %p", ev->ev_callback);
+		event_active(ev, EV_TIMEOUT, 1);
+	}
+
+	/* the head may have been deleted since we were armed; re-arm to the new one */
+	if (ev != NULL)
+	{
+		common_timeout_schedule(ctl, ev);
+	}
+}
+
+int event_base_add_common_timeout(struct event_base* base, const struct timeval* duration)
+{
+	struct common_timeout_list* ctl;
+	struct common_timeout_list** queues;
+
+	if (common_timeout_match(base, duration, NULL) != NULL)
+	{
+		return (0);
+	}
+	if (base->n_common_timeouts == MAX_COMMON_TIMEOUTS)
+	{
+		Error("too many common timeouts, max = %d", MAX_COMMON_TIMEOUTS);
+		return (-1);
+	}
+
+	queues = (struct common_timeout_list**)realloc(base->common_timeout_queues, (base->n_common_timeouts + 1) * sizeof(*queues));
+	if (queues == NULL)
+	{
+		Error("realloc failed, errno = %d", errno);
+		return (-1);
+	}
+	base->common_timeout_queues = queues;
+
+	if ((ctl = (struct common_timeout_list*)calloc(1, sizeof(struct common_timeout_list))) == NULL)
+	{
+		Error("calloc failed, errno = %d", errno);
+		return (-1);
+	}
+	ctl->events.tqh_first = NULL;
+	ctl->events.tqh_last = &ctl->events.tqh_first;
+	ctl->duration = *duration;
+	ctl->base = base;
+
+	evtimer_set(&ctl->timeout_event, common_timeout_callback, ctl);
+	ctl->timeout_event.ev_base = base;
+	ctl->timeout_event.ev_pri = 0;
+	ctl->timeout_event.ev_flags |= EVLIST_INTERNAL;
+
+	base->common_timeout_queues[base->n_common_timeouts++] = ctl;
+
+	return (0);
+}
+
 int event_priority_set(struct event* ev, int pri)
 {
 	if (ev->ev_flags & EVLIST_ACTIVE)
@@ -634,6 +1215,16 @@ int event_pending(struct event* ev, short event, struct timeval* tv)
 	return (flags & event);
 }
 
+/* once per event_set, so a re-added event does not pay a setsockopt each time */
+static void event_set_so_busy_poll(struct event_base* base, struct event* ev)
+{
+	ev->ev_flags |= EVLIST_BUSY_POLL;
+	if (setsockopt(ev->ev_fd, SOL_SOCKET, SO_BUSY_POLL, &base->so_busy_poll_usec, sizeof(base->so_busy_poll_usec)) == -1 && errno != ENOTSOCK)
+	{
+		Debug("setsockopt SO_BUSY_POLL failed, fd = %d, errno = %d", ev->ev_fd, errno);
+	}
+}
+
 int event_add(struct event* ev, const struct timeval* tv)
 {
 	struct event_base* base = ev->ev_base;
@@ -651,7 +1242,7 @@ int event_add(struct event* ev, const struct timeval* tv)
 
 	assert(!(ev->ev_flags & ~EVLIST_ALL));
 
-	if (tv != NULL && !(ev->ev_flags & EVLIST_TIMEOUT)) 
+	if (tv != NULL && !(ev->ev_flags & EVLIST_TIMEOUT) && base->timewheel == NULL) 
 	{
 		if (min_heap_reserve(base->timeheap, 1 + min_heap_size(base->timeheap)) == -1)
 		{
@@ -662,6 +1253,10 @@ int event_add(struct event* ev, const struct timeval* tv)
 
 	if ((ev->ev_events & (EV_READ|EV_WRITE|EV_SIGNAL)) && !(ev->ev_flags & (EVLIST_INSERTED|EVLIST_ACTIVE))) 
 	{
+		if (base->so_busy_poll_usec > 0 && !(ev->ev_flags & (EVLIST_BUSY_POLL|EVLIST_INTERNAL)) && (ev->ev_events & (EV_READ|EV_WRITE)))
+		{
+			event_set_so_busy_poll(base, ev);
+		}
 		res = evsel->add(evbase, ev);
 		if (res != -1)
 		{
@@ -672,6 +1267,7 @@ int event_add(struct event* ev, const struct timeval* tv)
 	if (res != -1 && tv != NULL) 
 	{
 		struct timeval now;
+		int common_idx;
 
 		if (ev->ev_flags & EVLIST_TIMEOUT)
 		{
@@ -679,9 +1275,9 @@ int event_add(struct event* ev, const struct timeval* tv)
 		}
 		if ((ev->ev_flags & EVLIST_ACTIVE) && (ev->ev_res & EV_TIMEOUT)) 
 		{
-			if (ev->ev_ncalls && ev->ev_pncalls) 
+			if (ev == base->running_event)
 			{
-				*ev->ev_pncalls = 0;
+				base->running_ncalls = 0;
 			}
 			
 			event_queue_remove(base, ev, EVLIST_ACTIVE);
@@ -692,6 +1288,10 @@ int event_add(struct event* ev, const struct timeval* tv)
 
 		Debug("event_add: timeout in %ld seconds, call %p", tv->tv_sec, ev->ev_callback);
 
+		if (!(ev->ev_flags & EVLIST_INTERNAL) && common_timeout_match(base, tv, &common_idx) != NULL)
+		{
+			ev->min_heap_idx = COMMON_TIMEOUT_IDX_FLAG | common_idx;
+		}
 		event_queue_insert(base, ev, EVLIST_TIMEOUT);
 	}
 
@@ -716,9 +1316,9 @@ int event_del(struct event* ev)
 
 	assert(!(ev->ev_flags & ~EVLIST_ALL));
 
-	if (ev->ev_ncalls && ev->ev_pncalls) 
+	if (ev == base->running_event)
 	{
-		*ev->ev_pncalls = 0;
+		base->running_ncalls = 0;
 	}
 
 	if (ev->ev_flags & EVLIST_TIMEOUT)
@@ -748,33 +1348,87 @@ void event_active(struct event* ev, int res, short ncalls)
 
 	ev->ev_res = res;
 	ev->ev_ncalls = ncalls;
-	ev->ev_pncalls = NULL;
 	event_queue_insert(ev->ev_base, ev, EVLIST_ACTIVE);
 }
 
+static int is_common_timeout(struct event* ev)
+{
+	return (ev->min_heap_idx != (unsigned int)-1 && (ev->min_heap_idx & COMMON_TIMEOUT_IDX_FLAG));
+}
+
+static struct common_timeout_list* common_timeout_match(struct event_base* base, const struct timeval* tv, int* idx)
+{
+	for (int i = 0; i < base->n_common_timeouts; ++i) 
+	{
+		if (timercmp(&base->common_timeout_queues[i]->duration, tv, ==))
+		{
+			if (idx != NULL)
+			{
+				*idx = i;
+			}
+			return base->common_timeout_queues[i];
+		}
+	}
+	return NULL;
+}
+
+static void common_timeout_schedule(struct common_timeout_list* ctl, struct event* head)
+{
+	struct event* tev = &ctl->timeout_event;
+
+	if (tev->ev_flags & EVLIST_TIMEOUT)
+	{
+		event_queue_remove(ctl->base, tev, EVLIST_TIMEOUT);
+	}
+	tev->ev_timeout = head->ev_timeout;
+	event_queue_insert(ctl->base, tev, EVLIST_TIMEOUT);
+}
+
+static struct event* timeout_first(struct event_base* base)
+{
+	if (base->timewheel != NULL)
+	{
+		return timer_wheel_first(base->timewheel);
+	}
+	return min_heap_top(base->timeheap);
+}
+
 static int timeout_next(struct event_base* base, struct timeval** tv_p)
 {
 	struct timeval now;
+	struct timeval deadline;
 	struct event *ev;
 	struct timeval *tv = *tv_p;
 
-	if ((ev = min_heap_top(base->timeheap)) == NULL) 
+	if (base->timewheel != NULL)
 	{
-		*tv_p = NULL;
-		return (0);
+		if (timer_wheel_next(base->timewheel, &deadline) == -1)
+		{
+			*tv_p = NULL;
+			return (0);
+		}
+	}
+	else
+	{
+		if ((ev = min_heap_top(base->timeheap)) == NULL) 
+		{
+			*tv_p = NULL;
+			return (0);
+		}
+		deadline = ev->ev_timeout;
 	}
 
 	if (gettime(base, &now) == -1)
 	{
 		return (-1);
 	}
-	if (timercmp(&ev->ev_timeout, &now, <=)) 
+	if (timercmp(&deadline, &now, <=)) 
 	{
 		timerclear(tv);
 		return (0);
 	}
 
-	timersub(&ev->ev_timeout, &now, tv);
+	timersub(&deadline, &now, tv);
 
 	assert(tv->tv_sec >= 0);
 	assert(tv->tv_usec >= 0);
@@ -785,7 +1439,7 @@ static int timeout_next(struct event_base* base, struct timeval** tv_p)
 
 static void timeout_correct(struct event_base* base, struct timeval* tv)
 {
-	struct event** pev;
+	struct min_heap_entry* pev;
 	unsigned int size;
 	struct timeval off;
 
@@ -803,12 +1457,27 @@ static void timeout_correct(struct event_base* base, struct timeval* tv)
 	Debug("%s: time is running backwards, corrected", __func__);
 	timersub(&base->event_tv, tv, &off);
 
+	if (base->timewheel != NULL)
+	{
+		timer_wheel_shift(base->timewheel, &off, tv);
+	}
+
+	for (int i = 0; i < base->n_common_timeouts; ++i)
+	{
+		struct event* ev;
+		for (ev = base->common_timeout_queues[i]->events.tqh_first; ev; ev = ev->ev_timeout_next.tqe_next)
+		{
+			timersub(&ev->ev_timeout, &off, &ev->ev_timeout);
+		}
+	}
+
 	pev = base->timeheap->p;
 	size = base->timeheap->n;
 	for (; size-- > 0; ++pev) 
 	{
-		struct timeval* ev_tv = &(**pev).ev_timeout;
+		struct timeval* ev_tv = &pev->ev->ev_timeout;
 		timersub(ev_tv, &off, ev_tv);
+		pev->deadline = min_heap_deadline(pev->ev);
 	}
 	base->event_tv = *tv;
 }
@@ -818,6 +1487,22 @@ void timeout_process(struct event_base* base)
 	struct timeval now;
 	struct event* ev;
 
+	if (base->timewheel != NULL)
+	{
+		gettime(base, &now);
+
+		/* collect every due slot first, then activate the whole batch */
+		timer_wheel_expire(base->timewheel, &now);
+		while ((ev = timer_wheel_expired(base->timewheel))) 
+		{
+			event_del(ev);
+
+			Debug("timeout_process: call %p", ev->ev_callback);
+			event_active(ev, EV_TIMEOUT, 1);
+		}
+		return;
+	}
+
 	if (min_heap_empty(base->timeheap))
 	{
 		return;
@@ -876,7 +1561,28 @@ void event_queue_remove(struct event_base* base, struct event* ev, int queue)
 		
 		break;
 	case EVLIST_TIMEOUT:
-		min_heap_erase(base->timeheap, ev);
+		if (is_common_timeout(ev))
+		{
+			struct common_timeout_list* ctl = base->common_timeout_queues[ev->min_heap_idx & COMMON_TIMEOUT_IDX_MASK];
+			if (ev->ev_timeout_next.tqe_next != NULL)
+			{
+				ev->ev_timeout_next.tqe_next->ev_timeout_next.tqe_prev = ev->ev_timeout_next.tqe_prev;
+			}
+			else
+			{
+				ctl->events.tqh_last = ev->ev_timeout_next.tqe_prev;
+			}
+			*ev->ev_timeout_next.tqe_prev = ev->ev_timeout_next.tqe_next;
+			ev->min_heap_idx = -1;
+		}
+		else if (base->timewheel != NULL)
+		{
+			timer_wheel_del(base->timewheel, ev);
+		}
+		else
+		{
+			min_heap_erase(base->timeheap, ev);
+		}
 		break;
 	default:
 		Error("unknown queue %x", queue);
@@ -920,7 +1626,26 @@ void event_queue_insert(struct event_base* base, struct event* ev, int queue)
 		break;
 	case EVLIST_TIMEOUT: 
 		{
-		min_heap_push(base->timeheap, ev);
+		if (is_common_timeout(ev))
+		{
+			struct common_timeout_list* ctl = base->common_timeout_queues[ev->min_heap_idx & COMMON_TIMEOUT_IDX_MASK];
+			ev->ev_timeout_next.tqe_next = NULL;
+			ev->ev_timeout_next.tqe_prev = ctl->events.tqh_last;
+			*ctl->events.tqh_last = ev;
+			ctl->events.tqh_last = &ev->ev_timeout_next.tqe_next;
+			if (ctl->events.tqh_first == ev)
+			{
+				common_timeout_schedule(ctl, ev);
+			}
+		}
+		else if (base->timewheel != NULL)
+		{
+			timer_wheel_add(base->timewheel, ev);
+		}
+		else
+		{
+			min_heap_push(base->timeheap, ev);
+		}
 		break;
 		}
 	default:
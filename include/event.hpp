@@ -16,8 +16,9 @@ extern "C" {
 #define EVLIST_SIGNAL	0x04
 #define EVLIST_ACTIVE	0x08
 #define EVLIST_INTERNAL	0x10
+#define EVLIST_BUSY_POLL	0x20
 #define EVLIST_INIT	0x80
-#define EVLIST_ALL	(0xf000 | 0x9f)
+#define EVLIST_ALL	(0xf000 | 0xbf)
 
 
 
@@ -26,43 +27,52 @@ extern "C" {
 #define EV_WRITE	0x04
 #define EV_SIGNAL	0x08
 #define EV_PERSIST	0x10
+#define EV_ET		0x20	/* edge-triggered; applies to every event on the fd */
 
 struct event_base;
+/*
+ * Everything dispatch touches, from evmap_io_active walking ev_io_next to
+ * the callback itself, comes first and fills 64 bytes. Timer,
+ * registration and signal bookkeeping follows and is read only when an
+ * event is added, deleted or times out.
+ */
 struct event 
 {
-	struct 
-	{ 
-		struct event* tqe_next;  
-		struct event** tqe_prev; 
-	} ev_next;
 	struct 
 	{ 
 		struct event* tqe_next;  
 		struct event** tqe_prev; 
 	} ev_active_next;
-	struct 
-	{ 
-		struct event* tqe_next;  
-		struct event** tqe_prev; 
-	} ev_signal_next;
-	unsigned int min_heap_idx;
 
+	void (*ev_callback)(int, short, void*);
+	void* ev_arg;
 	struct event_base* ev_base;
+	struct event* ev_io_next;
 
 	int ev_fd;
 	short ev_events;
 	short ev_ncalls;
-	short* ev_pncalls;
+	short ev_res;
+	short ev_pri;
+	int ev_flags;
 
+	unsigned int min_heap_idx;
 	struct timeval ev_timeout;
-
-	int ev_pri;
-
-	void (*ev_callback)(int, short, void*);
-	void* ev_arg;
-
-	int ev_res;
-	int ev_flags;
+	struct 
+	{ 
+		struct event* tqe_next;  
+		struct event** tqe_prev; 
+	} ev_timeout_next;
+	struct 
+	{ 
+		struct event* tqe_next;  
+		struct event** tqe_prev; 
+	} ev_next;
+	struct 
+	{ 
+		struct event* tqe_next;  
+		struct event** tqe_prev; 
+	} ev_signal_next;
 };
 
 struct event_list  
@@ -71,9 +81,32 @@ struct event_list
 	struct event** tqh_last;  
 };  
 
+struct event_busy_poll_stats
+{
+	unsigned long long spins;
+	unsigned long long spin_hits;
+	unsigned long long sleeps;
+	unsigned long long spin_usec;
+	unsigned long long sleep_usec;
+};
+
+struct event_once_stats
+{
+	unsigned long long hits;
+	unsigned long long misses;
+};
+
 struct eventop;
 struct min_heap;
+struct timer_wheel;
+struct common_timeout_list;
 struct evsignal_info;
+struct evnotify_info;
+struct event_stats;
+struct event_watchdog;
+struct event_slow_callback;
+struct event_once;
+struct event_once_chunk;
 struct event_base 
 {
 	const struct eventop* evsel;
@@ -88,30 +121,74 @@ struct event_base
 	int nactivequeues;
 
 	struct evsignal_info* sig;
+	struct evnotify_info* notify;
 
 	struct event_list* eventqueue;
 	struct timeval event_tv;
 
 	struct min_heap* timeheap;
+	struct timer_wheel* timewheel;
+
+	struct common_timeout_list** common_timeout_queues;
+	int n_common_timeouts;
 
 	struct timeval tv_cache;
+
+	int busy_poll_usec;
+	int so_busy_poll_usec;
+	struct event_busy_poll_stats busy_poll_stats;
+
+	int max_callbacks;
+	int* priority_weights;
+	int rr_queue;
+	int rr_used;
+
+	struct event_stats* stats;
+	struct event_watchdog* watchdog;
+
+	struct event_once* once_free;
+	struct event_once_chunk* once_chunks;
+	struct event_once_stats once_stats;
+
+	/* calls left for the event whose callback is running; event_del zeroes it */
+	struct event* running_event;
+	short running_ncalls;
+
+	int flags;
 };
 
+extern const struct eventop uringops;
 extern const struct eventop epollops;
-extern struct event_base* evsignal_base;
 
 
 
+#define EVENT_BASE_FLAG_TIMERWHEEL	0x01
+#define EVENT_BASE_FLAG_EPOLL_CHANGELIST	0x02
+#define EVENT_BASE_FLAG_PRECISE_TIMER	0x04
+
 struct event_base* event_base_new(void);
+struct event_base* event_base_new_with_flags(int flags);
 struct event_base* event_init(void);
 int event_reinit(struct event_base* base);
 int event_dispatch(void);
 int event_base_dispatch(struct event_base*);
 void event_base_free(struct event_base*);
 int event_base_set(struct event_base*, struct event*);
+int event_base_add_common_timeout(struct event_base*, const struct timeval*);
+int event_base_set_busy_poll(struct event_base*, int budget_usec, int so_busy_poll_usec);
+void event_base_get_busy_poll_stats(struct event_base*, struct event_busy_poll_stats*);
+int event_base_set_max_callbacks(struct event_base*, int max_callbacks);
+int event_base_set_priority_weights(struct event_base*, const int* weights);
+int event_base_enable_stats(struct event_base*);
+int event_base_get_stats(struct event_base*, struct event_stats*);
+int event_base_set_watchdog(struct event_base*, int slow_usec, int stuck_msec);
+int event_base_get_slow_callbacks(struct event_base*, struct event_slow_callback*, int max);
+int event_base_once_reserve(struct event_base*, int n);
+void event_base_get_once_stats(struct event_base*, struct event_once_stats*);
 
 #define EVLOOP_ONCE	0x01
 #define EVLOOP_NONBLOCK	0x02
+#define EVLOOP_NO_EXIT_ON_EMPTY	0x04
 
 int event_loop(int);
 int event_base_loop(struct event_base*, int);
@@ -119,6 +196,8 @@ int event_loopexit(const struct timeval*);
 int event_base_loopexit(struct event_base*, const struct timeval*);
 int event_loopbreak(void);
 int event_base_loopbreak(struct event_base*);
+int event_base_notify(struct event_base*);
+int event_base_run_in_loop(struct event_base*, void (*)(void*), void*);
 
 #define evtimer_add(ev, tv)	event_add(ev, tv)
 #define evtimer_set(ev, cb, arg) event_set(ev, -1, 0, cb, arg)
@@ -134,6 +213,11 @@ int event_base_loopbreak(struct event_base*);
 #define timeout_initialized(ev)	((ev)->ev_flags & EVLIST_INIT)
 
 
+/*
+ * The first signal_add of a signal blocks it in the calling thread until
+ * its last event is deleted: only signals still pending there reach the
+ * signalfd, so call it from the loop thread.
+ */
 #define signal_add(ev, tv)	event_add(ev, tv)
 #define signal_set(ev, x, cb, arg)	event_set(ev, x, EV_SIGNAL | EV_PERSIST, cb, arg)
 #define signal_del(ev) event_del(ev)
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include "log.hpp"
+#include "event.hpp"
+#include "evmap.hpp"
+
+
+
+short evmap_io_interest(const struct evmap_io* io)
+{
+	short events = 0;
+
+	if (io->nread)
+	{
+		events |= EV_READ;
+	}
+	if (io->nwrite)
+	{
+		events |= EV_WRITE;
+	}
+	if (io->net && events)
+	{
+		events |= EV_ET;
+	}
+	return (events);
+}
+
+void evmap_io_add(struct evmap_io* io, struct event* ev)
+{
+	struct event** pev;
+
+	/* append, so events on one fd run in the order they were added */
+	for (pev = &io->events; *pev != NULL; pev = &(*pev)->ev_io_next)
+	{
+		;
+	}
+	ev->ev_io_next = NULL;
+	*pev = ev;
+
+	if (ev->ev_events & EV_READ)
+	{
+		++io->nread;
+	}
+	if (ev->ev_events & EV_WRITE)
+	{
+		++io->nwrite;
+	}
+	if (ev->ev_events & EV_ET)
+	{
+		++io->net;
+	}
+
+	/*
+	 * Under EV_ET a one-shot event re-added in the callback that consumed
+	 * it would otherwise leave the kernel registration untouched, and an
+	 * fd that stayed ready never reports another edge; make the backend
+	 * re-arm so readiness is checked again.
+	 */
+	if (io->net && !(ev->ev_events & EV_PERSIST))
+	{
+		io->verify = 1;
+	}
+}
+
+void evmap_io_del(struct evmap_io* io, struct event* ev)
+{
+	struct event** pev;
+
+	for (pev = &io->events; *pev != NULL && *pev != ev; pev = &(*pev)->ev_io_next)
+	{
+		;
+	}
+	if (*pev == NULL)
+	{
+		return;
+	}
+	*pev = ev->ev_io_next;
+	ev->ev_io_next = NULL;
+
+	if (ev->ev_events & EV_READ)
+	{
+		--io->nread;
+	}
+	if (ev->ev_events & EV_WRITE)
+	{
+		--io->nwrite;
+	}
+	if (ev->ev_events & EV_ET)
+	{
+		--io->net;
+	}
+	/*
+	 * Nothing tells us whether the fd is closed next, and a new socket
+	 * can get the same number (and a new event the same address) before
+	 * the backend applies this change, so the kernel state must be redone
+	 * if the fd is in use again by then.
+	 */
+	if (io->events == NULL)
+	{
+		io->verify = 1;
+	}
+}
+
+/* what is EV_READ and/or EV_WRITE; pass both for a hangup or error */
+void evmap_io_active(struct evmap_io* io, short what)
+{
+	struct event* ev;
+
+	for (ev = io->events; ev != NULL; ev = ev->ev_io_next)
+	{
+		short res = ev->ev_events & what;
+		if (res)
+		{
+			event_active(ev, res, 1);
+		}
+	}
+}
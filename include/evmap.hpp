@@ -0,0 +1,42 @@
+#ifndef _EVMAP_HPP_
+#define _EVMAP_HPP_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "event.hpp"
+
+/*
+ * Every I/O event registered on one fd, chained through ev_io_next, with
+ * counts from which the fd's combined interest is derived. All-zero is the
+ * empty state and nothing points into the struct, so backends can keep
+ * these in a realloc'd array indexed by fd.
+ *
+ * verify tells a backend that defers kernel updates not to trust an
+ * unchanged interest mask: it is set whenever the fd loses its last event,
+ * since the fd may be closed and its number handed to a new socket before
+ * the deferred update runs. The backend clears it once it has re-synced
+ * the fd with the kernel.
+ */
+struct evmap_io
+{
+	struct event* events;
+	unsigned short nread;
+	unsigned short nwrite;
+	unsigned short net;
+	unsigned short verify;
+};
+
+
+short evmap_io_interest(const struct evmap_io* io);
+void evmap_io_add(struct evmap_io* io, struct event* ev);
+void evmap_io_del(struct evmap_io* io, struct event* ev);
+void evmap_io_active(struct evmap_io* io, short what);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
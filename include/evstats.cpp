@@ -0,0 +1,62 @@
+#include <stddef.h>
+#include "evstats.hpp"
+
+
+static void evstats_copy(const uint64_t* from, uint64_t* to, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Each counter is read atomically, but the snapshot as a whole is not a
+ * consistent cut: a histogram's count may be a record ahead of its buckets.
+ */
+void evstats_snapshot(const struct event_stats* from, struct event_stats* to)
+{
+	evstats_copy((const uint64_t*)from, (uint64_t*)to, sizeof(struct event_stats) / sizeof(uint64_t));
+}
+
+uint64_t evstats_bucket_floor(int idx)
+{
+	int group = idx / EVSTATS_SUB_BUCKETS;
+	int sub = idx % EVSTATS_SUB_BUCKETS;
+
+	if (group == 0)
+	{
+		return ((uint64_t)idx);
+	}
+	return ((uint64_t)(EVSTATS_SUB_BUCKETS + sub) << (group - 1));
+}
+
+/* lower bound of the bucket holding the pct-th percentile of a snapshot, 0 if empty */
+uint64_t evstats_percentile(const struct event_histogram* h, double pct)
+{
+	uint64_t total = 0, rank, seen = 0;
+	int i;
+
+	for (i = 0; i < EVSTATS_BUCKETS; ++i)
+	{
+		total += h->buckets[i];
+	}
+	if (total == 0)
+	{
+		return (0);
+	}
+	rank = (uint64_t)(total * pct / 100.0);
+	if (rank >= total)
+	{
+		rank = total - 1;
+	}
+	for (i = 0; i < EVSTATS_BUCKETS; ++i)
+	{
+		seen += h->buckets[i];
+		if (seen > rank)
+		{
+			break;
+		}
+	}
+	return (evstats_bucket_floor(i));
+}
@@ -0,0 +1,81 @@
+#ifndef _EVSTATS_HPP_
+#define _EVSTATS_HPP_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram: values below EVSTATS_SUB_BUCKETS get a bucket
+ * each, above that every power of two is split into EVSTATS_SUB_BUCKETS
+ * linear buckets, so a bucket is never wider than 1/8 of its value.
+ * Values past the last bucket are counted in it.
+ *
+ * Only the loop thread writes, with plain relaxed stores; any thread may
+ * read with evstats_snapshot() while the loop keeps running.
+ */
+#define EVSTATS_SUB_BITS	3
+#define EVSTATS_SUB_BUCKETS	(1 << EVSTATS_SUB_BITS)
+#define EVSTATS_GROUPS		40
+#define EVSTATS_BUCKETS		(EVSTATS_GROUPS * EVSTATS_SUB_BUCKETS)
+
+struct event_histogram
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[EVSTATS_BUCKETS];
+};
+
+/* times are in nanoseconds */
+struct event_stats
+{
+	uint64_t loops;
+	struct event_histogram events_per_wake;
+	struct event_histogram dispatch_nsec;
+	struct event_histogram callback_nsec;
+	struct event_histogram timer_late_nsec;
+	struct event_histogram active_depth;
+};
+
+static inline void evstats_add(uint64_t* counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline int evstats_bucket(uint64_t value)
+{
+	int msb, idx;
+
+	if (value < EVSTATS_SUB_BUCKETS)
+	{
+		return ((int)value);
+	}
+	msb = 63 - __builtin_clzll(value);
+	idx = (msb - EVSTATS_SUB_BITS + 1) * EVSTATS_SUB_BUCKETS + (int)((value >> (msb - EVSTATS_SUB_BITS)) & (EVSTATS_SUB_BUCKETS - 1));
+	return (idx < EVSTATS_BUCKETS ? idx : EVSTATS_BUCKETS - 1);
+}
+
+static inline void evstats_record(struct event_histogram* h, uint64_t value)
+{
+	evstats_add(&h->count, 1);
+	evstats_add(&h->sum, value);
+	if (value > h->max)
+	{
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+	}
+	evstats_add(&h->buckets[evstats_bucket(value)], 1);
+}
+
+void evstats_snapshot(const struct event_stats* from, struct event_stats* to);
+uint64_t evstats_bucket_floor(int idx);
+uint64_t evstats_percentile(const struct event_histogram* h, double pct);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
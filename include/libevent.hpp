@@ -3,10 +3,17 @@
 
 #include "log.hpp"
 #include "minheap.hpp"
+#include "timerwheel.hpp"
 #include "evbuffer.hpp"
 #include "buffer.hpp"
 #include "signal.hpp"
+#include "notify.hpp"
+#include "evmap.hpp"
+#include "evstats.hpp"
+#include "watchdog.hpp"
 #include "epoll.hpp"
+#include "uring.hpp"
 #include "event.hpp"
+#include "coro.hpp"
 
 #endif
@@ -8,29 +8,61 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "log.hpp"
 
 
+/*
+ * Each thread formats its lines into its own single-producer ring; one
+ * flusher thread drains every ring into a file it keeps open. A full ring
+ * drops the line rather than block, and the drop count is logged later.
+ * Without a flusher, before LogInit or after LogShutdown, lines go straight
+ * to stderr and no ring is allocated.
+ */
+#define LOG_RING_SIZE			(1 << 20)
+#define LOG_MAX_LINE			16384
+#define LOG_WRITE_BUFSIZE		65536
+#define LOG_FLUSH_INTERVAL_USEC	10000
+#define LOG_WRAP_MARK			0xffffffffu
+#define LOG_RECORD_SIZE(len)	((sizeof(uint32_t) + (len) + 3) & ~(uint64_t)3)
 
-static int ShiftFiles(const char* cpszLogBaseName, long lMaxLogSize, int iMaxLogNum)
+struct LogRing
 {
-	struct stat stStat;
-	char szLogFileName[256];
-	char szNewLogFileName[256];
+	char* pBuf;
+	volatile uint64_t ullHead;
+	volatile uint64_t ullTail;
+	volatile uint64_t ullDropped;
+	volatile int iDead;
+	struct LogRing* volatile pNext;
+};
 
-	sprintf(szLogFileName, "%s.log", cpszLogBaseName);
+volatile int g_iLogLevel = (LOG_DEFAULT_LEVEL > LOG_COMPILE_LEVEL) ? LOG_DEFAULT_LEVEL : LOG_COMPILE_LEVEL;
 
-	if(stat(szLogFileName, &stStat) < 0)
-	{
-		printf("[file %s] [function %s] [line %d] stat failed, errno = %d\n", __FILE__, __FUNCTION__, __LINE__, errno);
-		return -1;
-	}
+static char sszLogBaseName[256];
+static long slMaxLogSize;
+static int siMaxLogNum;
+static int siLogInitialized = 0;
 
-	if (stStat.st_size < lMaxLogSize)
-	{
-		return 0;
-	}
+static struct LogRing* volatile spRings = NULL;
+static pthread_mutex_t sRingsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t sRingKey;
+static pthread_once_t sRingKeyOnce = PTHREAD_ONCE_INIT;
+static __thread struct LogRing* stpRing = NULL;
+
+static pthread_t sFlusher;
+static volatile int siFlusherStop = 0;
+static int siLogFd = -1;
+static long slLogFileSize = 0;
+static char sszWriteBuf[LOG_WRITE_BUFSIZE];
+static size_t suWriteLen = 0;
+
+
+static int ShiftFiles(const char* cpszLogBaseName, int iMaxLogNum)
+{
+	char szLogFileName[256];
+	char szNewLogFileName[256];
 
 	sprintf(szLogFileName,"%s%d.log", cpszLogBaseName, iMaxLogNum - 1);
 	if (access(szLogFileName, F_OK) == 0)
@@ -65,62 +97,236 @@ static int ShiftFiles(const char* cpszLogBaseName, long lMaxLogSize, int iMaxLog
 	return 0;
 }
 
-static void GetCurrentTimeStr(char* szTimeStr)
+static int OpenLogFile(void)
 {
-	timeval tval;
-	gettimeofday(&tval, NULL);
-	struct tm curr;
-	curr = *localtime(&tval.tv_sec);
+	char szLogFileName[256];
+	struct stat stStat;
 
-	sprintf(szTimeStr, 
-		"%04d-%02d-%02d %02d:%02d:%02d.%06d", 
-		curr.tm_year + 1900, 
-		curr.tm_mon + 1, 
-		curr.tm_mday,
-		curr.tm_hour, 
-		curr.tm_min, 
-		curr.tm_sec,
-		(int)tval.tv_usec);
+	snprintf(szLogFileName, sizeof(szLogFileName) - 1, "%.250s.log", sszLogBaseName);
+	if ((siLogFd = open(szLogFileName, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0)
+	{
+		printf("[file %s] [function %s] [line %d] Fail to open log file %s\n", __FILE__, __FUNCTION__, __LINE__, szLogFileName);
+		return -1;
+	}
+	slLogFileSize = fstat(siLogFd, &stStat) == 0 ? stStat.st_size : 0;
+	return 0;
 }
 
-static int VWriteLog(const char* cpszLogBaseName, long lMaxLogSize, int iMaxLogNum,const char* cpszFormat, va_list ap)
+static void FlushWriteBuf(void)
 {
-	FILE* pFile;
-	char szLogFileName[256];
+	size_t uOff = 0;
 
-	sprintf(szLogFileName, "%s.log", cpszLogBaseName);
-	if ((pFile = fopen(szLogFileName, "a+")) == NULL)
+	if (siLogFd < 0 && OpenLogFile() < 0)
 	{
-		printf("[file %s] [function %s] [line %d] Fail to open log file %s\n", __FILE__, __FUNCTION__, __LINE__, szLogFileName);
-		return -1;
+		suWriteLen = 0;
+		return;
 	}
 
-	char szTimeStr[256];
-	GetCurrentTimeStr(szTimeStr);
+	while (uOff < suWriteLen)
+	{
+		ssize_t n = write(siLogFd, sszWriteBuf + uOff, suWriteLen - uOff);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			printf("[file %s] [function %s] [line %d] write failed, errno = %d\n", __FILE__, __FUNCTION__, __LINE__, errno);
+			break;
+		}
+		uOff += n;
+	}
+	slLogFileSize += uOff;
+	suWriteLen = 0;
 
-	fprintf(pFile, "[%s] ", szTimeStr);
-	vfprintf(pFile, cpszFormat, ap);
-	fclose(pFile);
+	if (slMaxLogSize > 0 && slLogFileSize >= slMaxLogSize)
+	{
+		close(siLogFd);
+		siLogFd = -1;
+		ShiftFiles(sszLogBaseName, siMaxLogNum);
+		OpenLogFile();
+	}
+}
 
-	return ShiftFiles(cpszLogBaseName, lMaxLogSize, iMaxLogNum);
+static void AppendWriteBuf(const char* pData, size_t uLen)
+{
+	if (suWriteLen + uLen > sizeof(sszWriteBuf))
+	{
+		FlushWriteBuf();
+	}
+	memcpy(sszWriteBuf + suWriteLen, pData, uLen);
+	suWriteLen += uLen;
 }
 
-static int WriteLog(const char* cpszLogBaseName, long lMaxLogSize, int iMaxLogNum, const char* cpszFormat, ...)
+static int DrainRing(struct LogRing* pRing)
 {
-	int iRet;
-	va_list ap;
+	uint64_t ullTail = pRing->ullTail;
+	uint64_t ullHead = __atomic_load_n(&pRing->ullHead, __ATOMIC_ACQUIRE);
+	uint64_t ullDropped;
+	int iLines = 0;
 
-	va_start(ap, cpszFormat);
-	iRet = VWriteLog(cpszLogBaseName, lMaxLogSize, iMaxLogNum, cpszFormat, ap);
-	va_end(ap);
+	while (ullTail != ullHead)
+	{
+		uint32_t uiPos = ullTail & (LOG_RING_SIZE - 1);
+		uint32_t uiLen = *(uint32_t*)(pRing->pBuf + uiPos);
 
-	return iRet;
+		if (uiLen == LOG_WRAP_MARK)
+		{
+			ullTail += LOG_RING_SIZE - uiPos;
+			continue;
+		}
+		AppendWriteBuf(pRing->pBuf + uiPos + sizeof(uint32_t), uiLen);
+		ullTail += LOG_RECORD_SIZE(uiLen);
+		++iLines;
+	}
+	__atomic_store_n(&pRing->ullTail, ullTail, __ATOMIC_RELEASE);
+
+	if ((ullDropped = __atomic_exchange_n(&pRing->ullDropped, 0, __ATOMIC_RELAXED)) != 0)
+	{
+		char szLine[128];
+		int iLen = snprintf(szLine, sizeof(szLine), "[ERROR] %llu log lines dropped, ring full\n", (unsigned long long)ullDropped);
+		AppendWriteBuf(szLine, iLen);
+	}
+	return iLines;
 }
 
-static char sszLogBaseName[256];
-static long slMaxLogSize;
-static int siMaxLogNum;
-static int siLogInitialized = 0;
+static void ReapDeadRings(void)
+{
+	struct LogRing* volatile* ppRing;
+
+	pthread_mutex_lock(&sRingsMutex);
+	for (ppRing = &spRings; *ppRing != NULL; )
+	{
+		struct LogRing* pRing = *ppRing;
+		if (pRing->iDead && pRing->ullTail == __atomic_load_n(&pRing->ullHead, __ATOMIC_ACQUIRE))
+		{
+			*ppRing = pRing->pNext;
+			free(pRing->pBuf);
+			free(pRing);
+			continue;
+		}
+		ppRing = &pRing->pNext;
+	}
+	pthread_mutex_unlock(&sRingsMutex);
+}
+
+static void* FlusherMain(void* arg)
+{
+	int iStop = 0;
+
+	while (!iStop)
+	{
+		int iLines = 0;
+		int iDead = 0;
+
+		iStop = siFlusherStop;
+		for (struct LogRing* pRing = spRings; pRing != NULL; pRing = pRing->pNext)
+		{
+			iLines += DrainRing(pRing);
+			iDead |= pRing->iDead;
+		}
+		if (suWriteLen > 0)
+		{
+			FlushWriteBuf();
+		}
+		if (iDead)
+		{
+			ReapDeadRings();
+		}
+		if (iLines == 0 && !iStop)
+		{
+			usleep(LOG_FLUSH_INTERVAL_USEC);
+		}
+	}
+	return NULL;
+}
+
+static void RingRelease(void* pArg)
+{
+	((struct LogRing*)pArg)->iDead = 1;
+}
+
+static void RingKeyCreate(void)
+{
+	pthread_key_create(&sRingKey, RingRelease);
+}
+
+static struct LogRing* GetRing(void)
+{
+	struct LogRing* pRing;
+
+	if (stpRing != NULL)
+	{
+		return stpRing;
+	}
+	if ((pRing = (struct LogRing*)calloc(1, sizeof(struct LogRing))) == NULL)
+	{
+		return NULL;
+	}
+	if ((pRing->pBuf = (char*)malloc(LOG_RING_SIZE)) == NULL)
+	{
+		free(pRing);
+		return NULL;
+	}
+
+	pthread_once(&sRingKeyOnce, RingKeyCreate);
+	pthread_setspecific(sRingKey, pRing);
+
+	pthread_mutex_lock(&sRingsMutex);
+	pRing->pNext = spRings;
+	spRings = pRing;
+	pthread_mutex_unlock(&sRingsMutex);
+
+	stpRing = pRing;
+	return pRing;
+}
+
+static void RingPush(struct LogRing* pRing, const char* pData, uint32_t uiLen)
+{
+	uint64_t ullHead = pRing->ullHead;
+	uint64_t ullTail = __atomic_load_n(&pRing->ullTail, __ATOMIC_ACQUIRE);
+	uint32_t uiPos = ullHead & (LOG_RING_SIZE - 1);
+	uint32_t uiContig = LOG_RING_SIZE - uiPos;
+	uint64_t ullNeed = LOG_RECORD_SIZE(uiLen);
+	uint64_t ullAdvance = ullNeed;
+
+	/* a record never straddles the end of the ring */
+	if (uiContig < ullNeed)
+	{
+		ullAdvance += uiContig;
+	}
+	if (ullHead + ullAdvance - ullTail > LOG_RING_SIZE)
+	{
+		__atomic_add_fetch(&pRing->ullDropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (uiContig < ullNeed)
+	{
+		*(uint32_t*)(pRing->pBuf + uiPos) = LOG_WRAP_MARK;
+		uiPos = 0;
+	}
+	*(uint32_t*)(pRing->pBuf + uiPos) = uiLen;
+	memcpy(pRing->pBuf + uiPos + sizeof(uint32_t), pData, uiLen);
+	__atomic_store_n(&pRing->ullHead, ullHead + ullAdvance, __ATOMIC_RELEASE);
+}
+
+static int GetCurrentTimeStr(char* szTimeStr, size_t uSize)
+{
+	static __thread time_t stCachedSec = 0;
+	static __thread char sszCachedSec[32];
+	struct timeval tval;
+
+	gettimeofday(&tval, NULL);
+	if (tval.tv_sec != stCachedSec)
+	{
+		struct tm curr;
+		localtime_r(&tval.tv_sec, &curr);
+		strftime(sszCachedSec, sizeof(sszCachedSec), "%Y-%m-%d %H:%M:%S", &curr);
+		stCachedSec = tval.tv_sec;
+	}
+
+	return snprintf(szTimeStr, uSize, "[%s.%06d] ", sszCachedSec, (int)tval.tv_usec);
+}
 
 void LogInit(const char* cpszLogBaseName, long lMaxLogSize, int iMaxLogNum)
 {
@@ -128,33 +334,104 @@ void LogInit(const char* cpszLogBaseName, long lMaxLogSize, int iMaxLogNum)
 	strncpy(sszLogBaseName, cpszLogBaseName, sizeof(sszLogBaseName) - 1);
 	slMaxLogSize = lMaxLogSize;
 	siMaxLogNum = iMaxLogNum;
-	siLogInitialized = 1;
+
+	if (siLogInitialized)
+	{
+		return;
+	}
+	__atomic_store_n(&siLogInitialized, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&sFlusher, NULL, FlusherMain, NULL))
+	{
+		printf("[file %s] [function %s] [line %d] pthread_create failed, errno = %d\n", __FILE__, __FUNCTION__, __LINE__, errno);
+		__atomic_store_n(&siLogInitialized, 0, __ATOMIC_RELEASE);
+		return;
+	}
+	atexit(LogShutdown);
+}
+
+void LogShutdown(void)
+{
+	if (!siLogInitialized)
+	{
+		return;
+	}
+	__atomic_store_n(&siLogInitialized, 0, __ATOMIC_RELEASE);
+	siFlusherStop = 1;
+	pthread_join(sFlusher, NULL);
+	if (siLogFd >= 0)
+	{
+		close(siLogFd);
+		siLogFd = -1;
+	}
+}
+
+void LogSetLevel(int iLevel)
+{
+	if (iLevel < LOG_COMPILE_LEVEL)
+	{
+		iLevel = LOG_COMPILE_LEVEL;
+	}
+	if (iLevel > LOG_LEVEL_OFF)
+	{
+		iLevel = LOG_LEVEL_OFF;
+	}
+	__atomic_store_n(&g_iLogLevel, iLevel, __ATOMIC_RELAXED);
+}
+
+int LogGetLevel(void)
+{
+	return __atomic_load_n(&g_iLogLevel, __ATOMIC_RELAXED);
 }
 
 void Log(int iLevel, const char* cpszFormat, ...)
 {
-	char buf[1024 * 1024];
+	char buf[LOG_MAX_LINE];
+	struct LogRing* pRing;
 	int32_t len = 0;
+	int32_t n;
+
+	if (!LogEnabled(iLevel))
+	{
+		return;
+	}
+
+	len += GetCurrentTimeStr(buf, sizeof(buf) - 1);
 	switch (iLevel)
 	{
 	case ERROR:
-		len += snprintf(buf, sizeof(buf) - 1, "[ERROR]");
+		len += snprintf(buf + len, sizeof(buf) - len - 1, "[ERROR]");
 		break;
 	case DEBUG:
-		len += snprintf(buf, sizeof(buf) - 1, "[DEBUG]");
+		len += snprintf(buf + len, sizeof(buf) - len - 1, "[DEBUG]");
 		break;
 	default:
-		len += snprintf(buf, sizeof(buf) - 1, "[ERROR]");
+		len += snprintf(buf + len, sizeof(buf) - len - 1, "[ERROR]");
 		break;
 	}
 	va_list ap;
 	va_start(ap, cpszFormat);
-	len += vsnprintf(buf + len, sizeof(buf) - len - 1, cpszFormat, ap);
+	n = vsnprintf(buf + len, sizeof(buf) - len - 1, cpszFormat, ap);
 	va_end(ap);
+	if (n > 0)
+	{
+		len += n;
+	}
+	if (len > (int32_t)sizeof(buf) - 2)
+	{
+		len = sizeof(buf) - 2;
+	}
 	if (len > 0 && buf[len - 1] != '\n')
 	{
-		strcat(buf, "\n");
+		buf[len++] = '\n';
+	}
+	/* no flusher to drain a ring before LogInit or after LogShutdown */
+	if (!__atomic_load_n(&siLogInitialized, __ATOMIC_ACQUIRE))
+	{
+		fwrite(buf, 1, len, stderr);
+		return;
+	}
+	if ((pRing = GetRing()) != NULL)
+	{
+		RingPush(pRing, buf, len);
 	}
-	WriteLog(sszLogBaseName, slMaxLogSize, siMaxLogNum, buf);
 }
-
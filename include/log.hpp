@@ -9,15 +9,41 @@ extern "C" {
 
 
 void LogInit(const char* cpszLogBaseName, long lMaxLogSize, int iMaxLogNum);
+void LogShutdown(void);
+void LogSetLevel(int iLevel);
+int LogGetLevel(void);
 void Log(int iLevel, const char* cpszFormat, ...);
 
 #define DEBUG 0
 #define ERROR 1
+#define LOG_LEVEL_OFF 2
+
+/*
+ * Lines below LOG_COMPILE_LEVEL are compiled out (build with
+ * -DLOG_COMPILE_LEVEL=1 to drop every Debug). Lines below the runtime
+ * level are skipped before their arguments are evaluated.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL DEBUG
+#endif
+
+/*
+ * The runtime level starts at LOG_DEFAULT_LEVEL, so a production build
+ * stays quiet until "bin/reload debug" turns the traces on.
+ */
+#ifndef LOG_DEFAULT_LEVEL
+#define LOG_DEFAULT_LEVEL ERROR
+#endif
+
+extern volatile int g_iLogLevel;
+
+#define LogEnabled(level) \
+	((level) >= LOG_COMPILE_LEVEL && (level) >= __atomic_load_n(&g_iLogLevel, __ATOMIC_RELAXED))
 
 #define Debug(format, ...) \
-	Log(DEBUG, "[file %s] [function %s] [line %d]\n" format, __FILE__, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+	do { if (LogEnabled(DEBUG)) Log(DEBUG, "[file %s] [function %s] [line %d]\n" format, __FILE__, __FUNCTION__, __LINE__, ##__VA_ARGS__); } while (0)
 #define Error(format, ...) \
-	Log(ERROR, "[file %s] [function %s] [line %d]\n" format, __FILE__, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+	do { if (LogEnabled(ERROR)) Log(ERROR, "[file %s] [function %s] [line %d]\n" format, __FILE__, __FUNCTION__, __LINE__, ##__VA_ARGS__); } while (0)
 
 
 #ifdef __cplusplus
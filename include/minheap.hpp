@@ -1,36 +1,202 @@
 #ifndef _MINHEAP_HPP_
 #define _MINHEAP_HPP_
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "log.hpp"
+#include "event.hpp"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
+/*
+ * 4-ary heap keyed by a 64-bit nanosecond deadline stored next to the
+ * event pointer, so comparisons never touch the event itself. The children
+ * of slot i are 4i+1 .. 4i+4; the array starts MIN_HEAP_PAD entries into a
+ * cache-line aligned block so every group of four children shares one line.
+ */
+#define MIN_HEAP_ARITY		4
+#define MIN_HEAP_CACHELINE	64
+#define MIN_HEAP_PAD		(MIN_HEAP_ARITY - 1)
+
 typedef struct min_heap min_heap_t;
-struct event;
+struct min_heap_entry
+{
+	uint64_t deadline;
+	struct event* ev;
+};
+
 struct min_heap
 {
-	struct event** p;		
+	struct min_heap_entry* p;
 	unsigned n;
 	unsigned a;
 };
 
 
+static inline uint64_t min_heap_deadline(const struct event* e)
+{
+	return (uint64_t)e->ev_timeout.tv_sec * 1000000000 + (uint64_t)e->ev_timeout.tv_usec * 1000;
+}
 
-void min_heap_dtor(min_heap_t* s);
-void min_heap_ctor(min_heap_t* s);
-void min_heap_elem_init(struct event* e);
-int min_heap_elem_greater(struct event* a, struct event* b);
-int min_heap_empty(min_heap_t* s);
-unsigned min_heap_size(min_heap_t* s);
-struct event*  min_heap_top(min_heap_t* s);
-int min_heap_reserve(min_heap_t* s, unsigned n);
-void min_heap_shift_up_(min_heap_t* s, unsigned hole_index, struct event* e);
-void min_heap_shift_down_(min_heap_t* s, unsigned hole_index, struct event* e);
-int min_heap_push(min_heap_t* s, struct event* e);
-struct event* min_heap_pop(min_heap_t* s);
-int min_heap_erase(min_heap_t* s, struct event* e);
+static inline void min_heap_ctor(min_heap_t* s)
+{
+	s->p = 0;
+	s->n = 0;
+	s->a = 0;
+}
+
+static inline void min_heap_dtor(min_heap_t* s)
+{
+	if(s->p)
+	{
+		free(s->p - MIN_HEAP_PAD);
+	}
+}
+
+static inline void min_heap_elem_init(struct event* e)
+{
+	e->min_heap_idx = -1;
+}
+
+static inline int min_heap_empty(min_heap_t* s)
+{
+	return 0u == s->n;
+}
+
+static inline unsigned min_heap_size(min_heap_t* s)
+{
+	return s->n;
+}
 
+static inline struct event* min_heap_top(min_heap_t* s)
+{
+	return s->n ? s->p->ev : 0;
+}
+
+static inline int min_heap_reserve(min_heap_t* s, unsigned n)
+{
+	if(s->a < n)
+	{
+		void* raw;
+		struct min_heap_entry* p;
+		unsigned a = s->a ? s->a * 2 : 8;
+		if(a < n)
+		{
+			a = n;
+		}
+		if(posix_memalign(&raw, MIN_HEAP_CACHELINE, (a + MIN_HEAP_PAD) * sizeof(struct min_heap_entry)))
+		{
+			Error("posix_memalign failed, errno = %d\n", errno);
+			return -1;
+		}
+		p = (struct min_heap_entry*)raw + MIN_HEAP_PAD;
+		if(s->p)
+		{
+			memcpy(p, s->p, s->n * sizeof(*p));
+			free(s->p - MIN_HEAP_PAD);
+		}
+		s->p = p;
+		s->a = a;
+	}
+	return 0;
+}
+
+static inline void min_heap_shift_up_(min_heap_t* s, unsigned hole_index, struct min_heap_entry e)
+{
+	while(hole_index)
+	{
+		unsigned parent = (hole_index - 1) / MIN_HEAP_ARITY;
+		if(s->p[parent].deadline <= e.deadline)
+		{
+			break;
+		}
+		(s->p[hole_index] = s->p[parent]).ev->min_heap_idx = hole_index;
+		hole_index = parent;
+	}
+	(s->p[hole_index] = e).ev->min_heap_idx = hole_index;
+}
+
+static inline void min_heap_shift_down_(min_heap_t* s, unsigned hole_index, struct min_heap_entry e)
+{
+	unsigned child;
+	while((child = MIN_HEAP_ARITY * hole_index + 1) < s->n)
+	{
+		unsigned last = child + MIN_HEAP_ARITY < s->n ? child + MIN_HEAP_ARITY : s->n;
+		unsigned min_child = child;
+		for(++child; child < last; ++child)
+		{
+			if(s->p[child].deadline < s->p[min_child].deadline)
+			{
+				min_child = child;
+			}
+		}
+		if(s->p[min_child].deadline >= e.deadline)
+		{
+			break;
+		}
+		(s->p[hole_index] = s->p[min_child]).ev->min_heap_idx = hole_index;
+		hole_index = min_child;
+	}
+	(s->p[hole_index] = e).ev->min_heap_idx = hole_index;
+}
+
+static inline int min_heap_push(min_heap_t* s, struct event* e)
+{
+	struct min_heap_entry entry;
+	if(min_heap_reserve(s, s->n + 1))
+	{
+		Error("min_heap_reserve failed\n");
+		return -1;
+	}
+	entry.deadline = min_heap_deadline(e);
+	entry.ev = e;
+	min_heap_shift_up_(s, s->n++, entry);
+	return 0;
+}
+
+static inline struct event* min_heap_pop(min_heap_t* s)
+{
+	if(s->n)
+	{
+		struct event* e = s->p->ev;
+		if(--s->n)
+		{
+			min_heap_shift_down_(s, 0u, s->p[s->n]);
+		}
+		e->min_heap_idx = -1;
+		return e;
+	}
+	return 0;
+}
+
+static inline int min_heap_erase(min_heap_t* s, struct event* e)
+{
+	if(((unsigned int)-1) != e->min_heap_idx)
+	{
+		unsigned idx = e->min_heap_idx;
+		struct min_heap_entry last = s->p[--s->n];
+		if(idx < s->n)
+		{
+			if(idx > 0 && s->p[(idx - 1) / MIN_HEAP_ARITY].deadline > last.deadline)
+			{
+				min_heap_shift_up_(s, idx, last);
+			}
+			else
+			{
+				min_heap_shift_down_(s, idx, last);
+			}
+		}
+		e->min_heap_idx = -1;
+		return 0;
+	}
+	return -1;
+}
 
 
 #ifdef __cplusplus
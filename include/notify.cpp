@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "log.hpp"
+#include "event.hpp"
+#include "notify.hpp"
+
+
+/*
+ * Tasks are pushed by any thread onto a lock-free LIFO stack; the loop
+ * thread takes the whole stack with one exchange and reverses it, so
+ * tasks run in the order they were posted.
+ */
+struct evnotify_task
+{
+	struct evnotify_task* next;
+	void (*cb)(void*);
+	void* arg;
+};
+
+static void evnotify_cb(int fd, short what, void* arg)
+{
+	struct event_base* base = (struct event_base*)arg;
+	struct evnotify_task* task;
+	struct evnotify_task* fifo = NULL;
+	uint64_t count;
+
+	/* drain the counter before taking the stack so no post is left without a wakeup */
+	if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+	{
+		Error("read failed, errno = %d", errno);
+	}
+
+	task = __sync_lock_test_and_set(&base->notify->tasks, (struct evnotify_task*)NULL);
+	while (task != NULL)
+	{
+		struct evnotify_task* next = task->next;
+		task->next = fifo;
+		fifo = task;
+		task = next;
+	}
+
+	while ((task = fifo) != NULL)
+	{
+		fifo = task->next;
+		(*task->cb)(task->arg);
+		free(task);
+	}
+}
+
+int evnotify_init(struct event_base* base)
+{
+	struct evnotify_info* notify = base->notify;
+
+	if ((notify->ev_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	{
+		Error("eventfd failed, errno = %d", errno);
+		return -1;
+	}
+
+	notify->ev_notify = (struct event*)calloc(1, sizeof(struct event));
+	if (notify->ev_notify == NULL)
+	{
+		Error("calloc failed, errno = %d", errno);
+		close(notify->ev_notify_fd);
+		notify->ev_notify_fd = -1;
+		return -1;
+	}
+	notify->tasks = NULL;
+	notify->th_owner_set = 0;
+
+	event_set(notify->ev_notify, notify->ev_notify_fd, EV_READ | EV_PERSIST, evnotify_cb, base);
+	notify->ev_notify->ev_base = base;
+	notify->ev_notify->ev_flags |= EVLIST_INTERNAL;
+
+	if (event_add(notify->ev_notify, NULL))
+	{
+		Error("event_add failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+int evnotify_in_loop(struct event_base* base)
+{
+	struct evnotify_info* notify = base->notify;
+
+	return (notify->th_owner_set && pthread_equal(notify->th_owner, pthread_self()));
+}
+
+void evnotify_set_owner(struct event_base* base)
+{
+	base->notify->th_owner = pthread_self();
+	base->notify->th_owner_set = 1;
+}
+
+void evnotify_dealloc(struct event_base* base)
+{
+	struct evnotify_info* notify = base->notify;
+	struct evnotify_task* task;
+
+	if (notify == NULL)
+	{
+		return;
+	}
+	if (notify->ev_notify != NULL)
+	{
+		event_del(notify->ev_notify);
+		free(notify->ev_notify);
+		notify->ev_notify = NULL;
+	}
+	if (notify->ev_notify_fd != -1)
+	{
+		close(notify->ev_notify_fd);
+		notify->ev_notify_fd = -1;
+	}
+
+	task = __sync_lock_test_and_set(&notify->tasks, (struct evnotify_task*)NULL);
+	while (task != NULL)
+	{
+		struct evnotify_task* next = task->next;
+		free(task);
+		task = next;
+	}
+}
+
+int event_base_notify(struct event_base* base)
+{
+	uint64_t one = 1;
+
+	if (base == NULL || base->notify->ev_notify_fd == -1)
+	{
+		return (-1);
+	}
+	if (write(base->notify->ev_notify_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+	{
+		return (-1);
+	}
+	return (0);
+}
+
+int event_base_run_in_loop(struct event_base* base, void (*cb)(void*), void* arg)
+{
+	struct evnotify_task* task;
+	struct evnotify_task* head;
+
+	if ((task = (struct evnotify_task*)malloc(sizeof(struct evnotify_task))) == NULL)
+	{
+		Error("malloc failed, errno = %d", errno);
+		return (-1);
+	}
+	task->cb = cb;
+	task->arg = arg;
+
+	do
+	{
+		head = base->notify->tasks;
+		task->next = head;
+	} while (!__sync_bool_compare_and_swap(&base->notify->tasks, head, task));
+
+	/* only the post that makes the stack non-empty pays for the wakeup */
+	if (head == NULL)
+	{
+		return (event_base_notify(base));
+	}
+	return (0);
+}
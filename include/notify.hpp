@@ -0,0 +1,32 @@
+#ifndef _NOTIFY_HPP_
+#define _NOTIFY_HPP_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+
+struct event;
+struct evnotify_task;
+struct evnotify_info
+{
+	struct event* ev_notify;
+	int ev_notify_fd;
+	struct evnotify_task* volatile tasks;
+	pthread_t th_owner;
+	volatile int th_owner_set;
+};
+
+
+int evnotify_init(struct event_base* base);
+int evnotify_in_loop(struct event_base* base);
+void evnotify_set_owner(struct event_base* base);
+void evnotify_dealloc(struct event_base* base);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -1,182 +1,145 @@
 #include <stdlib.h>
 #include <sys/queue.h>
 #include <assert.h>
-#include <fcntl.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/types.h>
-#include <sys/socket.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 #include "log.hpp"
 #include "event.hpp"
 #include "signal.hpp"
 
 
-struct event_base* evsignal_base = NULL;
+#define EVSIGNAL_BATCH	16
 
-
-static void evsignal_handler(int sig)
-{
-	int save_errno = errno;
-
-	if (evsignal_base == NULL) 
-	{
-		Error("received signal %d, but evsignal_base didn't configured", sig);
-		return;
-	}
-
-	++evsignal_base->sig->evsigcaught[sig];
-	evsignal_base->sig->evsignal_caught = 1;
-
-	signal(sig, evsignal_handler);
-
-	send(evsignal_base->sig->ev_signal_pair[0], "a", 1, 0);
-	errno = save_errno;
-}
-
-static int _evsignal_set_handler(struct event_base* base, int evsignal, void (*handler)(int))
+/*
+ * A signal is only queued for the signalfd while it is blocked, so
+ * evsignal_add blocks it in the calling thread, which should be the loop
+ * thread. Process-directed signals go to any thread that leaves them
+ * unblocked, so a program expecting those here blocks them in every
+ * thread, ideally before creating any. Each base reads its own signalfd;
+ * a signal sent to the whole process is consumed by whichever base reads
+ * it first.
+ */
+static void evsignal_cb(int fd, short what, void* arg)
 {
-	struct sigaction sa;
+	struct event_base* base = (struct event_base*)arg;
 	struct evsignal_info* sig = base->sig;
-	struct sigaction** p;
+	struct signalfd_siginfo info[EVSIGNAL_BATCH];
+	short caught[NSIG];
+	struct event *ev, *next_ev;
+	ssize_t n;
+	int i;
 
-	if (evsignal >= sig->sh_old_max) 
+	memset(caught, 0, sizeof(caught));
+	do
 	{
-		int new_max = evsignal + 1;
-		Debug("evsignal (%d) >= sh_old_max (%d), resizing", evsignal, sig->sh_old_max);
-		p = (struct sigaction **)realloc(sig->sh_old, new_max * sizeof(*sig->sh_old));
-		if (p == NULL) 
+		n = read(fd, info, sizeof(info));
+		if (n == -1)
 		{
-			Error("realloc failed, errno = %d", errno);
-			return (-1);
+			if (errno != EAGAIN && errno != EINTR)
+			{
+				Error("read failed, errno = %d", errno);
+			}
+			break;
 		}
+		for (i = 0; i < (int)(n / sizeof(info[0])); ++i)
+		{
+			if (info[i].ssi_signo < NSIG)
+			{
+				++caught[info[i].ssi_signo];
+			}
+		}
+	} while (n == sizeof(info));
 
-		memset((char*)p + sig->sh_old_max * sizeof(*sig->sh_old), 0, (new_max - sig->sh_old_max) * sizeof(*sig->sh_old));
-
-		sig->sh_old_max = new_max;
-		sig->sh_old = (struct sigaction **)p;
-	}
-
-	sig->sh_old[evsignal] = (struct sigaction *)malloc(sizeof *sig->sh_old[evsignal]);
-	if (sig->sh_old[evsignal] == NULL) 
+	for (i = 1; i < NSIG; ++i) 
 	{
-		Error("malloc failed, errno = %d", errno);
-		return (-1);
+		if (caught[i] == 0)
+		{
+			continue;
+		}
+		for (ev = sig->evsigevents[i].tqh_first; ev != NULL; ev = next_ev) 
+		{
+			next_ev = ev->ev_signal_next.tqe_next;
+			if (!(ev->ev_events & EV_PERSIST))
+			{
+				event_del(ev);
+			}
+			event_active(ev, EV_SIGNAL, caught[i]);
+		}
 	}
+}
 
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = handler;
-	sa.sa_flags |= SA_RESTART;
-	sigfillset(&sa.sa_mask);
-
-	if (sigaction(evsignal, &sa, sig->sh_old[evsignal]) == -1) 
-	{
-		Error("sigaction failed, errno = %d", errno);
-		free(sig->sh_old[evsignal]);
-		sig->sh_old[evsignal] = NULL;
-		return (-1);
-	}
+int evsignal_init(struct event_base* base)
+{
+	base->sig->ev_signal = NULL;
+	base->sig->ev_signal_added = 0;
+	base->sig->ev_signal_fd = -1;
+	base->sig->evsigevents = NULL;
+	sigemptyset(&base->sig->mask);
+	sigemptyset(&base->sig->blocked);
 
-	return (0);
+	return 0;
 }
 
-
-static int _evsignal_restore_handler(struct event_base* base, int evsignal)
+static int evsignal_setup(struct event_base* base)
 {
-	int ret = 0;
 	struct evsignal_info* sig = base->sig;
-	struct sigaction* sh;
 
-	sh = sig->sh_old[evsignal];
-	sig->sh_old[evsignal] = NULL;
-	if (sigaction(evsignal, sh, NULL) == -1) 
+	if (sig->evsigevents == NULL)
 	{
-		Error("sigaction failed, errno = %d", errno);
-		ret = -1;
+		if ((sig->evsigevents = (struct event_list*)malloc(NSIG * sizeof(struct event_list))) == NULL)
+		{
+			Error("malloc failed, errno = %d", errno);
+			return (-1);
+		}
+		for (int i = 0; i < NSIG; ++i)
+		{
+			sig->evsigevents[i].tqh_first = NULL;
+			sig->evsigevents[i].tqh_last = &sig->evsigevents[i].tqh_first;
+		}
 	}
-	free(sh);
-
-	return ret;
-}
-
-static void evsignal_cb(int fd, short what, void* arg)
-{
-	static char signals[1];
-	ssize_t n;
-
-	n = recv(fd, signals, sizeof(signals), 0);
-	if (n == -1)
+	if (sig->ev_signal == NULL)
 	{
-		Error("read failed, errno = %d", errno);
+		if ((sig->ev_signal = (struct event*)calloc(1, sizeof(struct event))) == NULL)
+		{
+			Error("calloc failed, errno = %d", errno);
+			return (-1);
+		}
 	}
+	return (0);
 }
 
-static int make_socket_nonblocking(int fd)
-{
-        long flags;
-        if ((flags = fcntl(fd, F_GETFL, NULL)) < 0)
-        {
-                Error("fcntl(%d, F_GETFL)", fd);
-                return -1;
-        }
-
-        if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
-        {
-                Error("fcntl(%d, F_SETFL)", fd);
-                return -1;
-        }
-
-        return 0;
-}
-
-
-
-int evsignal_init(struct event_base* base)
+/* points the signalfd at sig->mask, creating it on first use */
+static int evsignal_update_fd(struct event_base* base)
 {
-	base->sig->ev_signal = (struct event*)calloc(1, sizeof(struct event));
-
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, base->sig->ev_signal_pair) == -1) 
-	{
-		Error("socketpair failed, errno = %d", errno);
-		return -1;
-	}
-
-	if (fcntl(base->sig->ev_signal_pair[0], F_SETFD, 1) == -1)
-	{
-		Error("fcntl failed, errno = %d", errno);
-	}
+	struct evsignal_info* sig = base->sig;
+	int fd;
 
-	if (fcntl(base->sig->ev_signal_pair[1], F_SETFD, 1) == -1)
+	if ((fd = signalfd(sig->ev_signal_fd, &sig->mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
 	{
-		Error("fcntl failed, errno = %d", errno);
+		Error("signalfd failed, errno = %d", errno);
+		return (-1);
 	}
-
-
-	base->sig->sh_old = NULL;
-	base->sig->sh_old_max = 0;
-	base->sig->evsignal_caught = 0;
-	memset(&base->sig->evsigcaught, 0, sizeof(sig_atomic_t)*NSIG);
-
-
-	for (int i = 0; i < NSIG; ++i)
+	if (sig->ev_signal_fd == -1)
 	{
-		base->sig->evsigevents[i] = (struct event_list*)calloc(1, sizeof(struct event_list));
+		sig->ev_signal_fd = fd;
+		event_set(sig->ev_signal, fd, EV_READ | EV_PERSIST, evsignal_cb, base);
+		sig->ev_signal->ev_base = base;
+		sig->ev_signal->ev_flags |= EVLIST_INTERNAL;
 	}
-
-	for (int i = 0; i < NSIG; ++i)
+	if (!sig->ev_signal_added) 
 	{
-		(base->sig->evsigevents[i])->tqh_first = NULL;
-		(base->sig->evsigevents[i])->tqh_last = &(base->sig->evsigevents[i])->tqh_first;
+		if (event_add(sig->ev_signal, NULL))
+		{
+			Error("event_add failed");
+			return (-1);
+		}
+		sig->ev_signal_added = 1;
 	}
-
-
-    make_socket_nonblocking(base->sig->ev_signal_pair[0]);
-
-	event_set(base->sig->ev_signal, base->sig->ev_signal_pair[1], EV_READ | EV_PERSIST, evsignal_cb, base->sig->ev_signal);
-	base->sig->ev_signal->ev_base = base;
-	base->sig->ev_signal->ev_flags |= EVLIST_INTERNAL;
-
-	return 0;
+	return (0);
 }
 
 int evsignal_add(struct event *ev)
@@ -190,42 +153,73 @@ int evsignal_add(struct event *ev)
 		Error("EV_SIGNAL incompatible use, ev->ev_events = %d", ev->ev_events);
 	}
 	evsignal = ev->ev_fd;
-	assert(evsignal >= 0 && evsignal < NSIG);
-	if (sig->evsigevents[evsignal]->tqh_first == NULL) 
+	assert(evsignal > 0 && evsignal < NSIG);
+	if (evsignal_setup(base) == -1)
 	{
-		Debug("%p: changing signal handler", ev);
-		if (_evsignal_set_handler(base, evsignal, evsignal_handler) == -1)
+		return (-1);
+	}
+	if (sig->evsigevents[evsignal].tqh_first == NULL) 
+	{
+		sigset_t one, old;
+
+		Debug("%p: blocking signal %d for signalfd", ev, evsignal);
+		sigemptyset(&one);
+		sigaddset(&one, evsignal);
+		if (pthread_sigmask(SIG_BLOCK, &one, &old) != 0)
 		{
+			Error("pthread_sigmask failed");
 			return (-1);
 		}
-		evsignal_base = base;
-
-		if (!sig->ev_signal_added) 
+		if (!sigismember(&old, evsignal))
 		{
-			if (event_add(sig->ev_signal, NULL))
-			{
-				Error("event_add failed");
-				return (-1);
-			}
-			sig->ev_signal_added = 1;
+			sigaddset(&sig->blocked, evsignal);
+		}
+		sigaddset(&sig->mask, evsignal);
+		if (evsignal_update_fd(base) == -1)
+		{
+			sigdelset(&sig->mask, evsignal);
+			return (-1);
 		}
 	}
 
 	(ev)->ev_signal_next.tqe_next = NULL;
-	(ev)->ev_signal_next.tqe_prev = (sig->evsigevents[evsignal])->tqh_last;
-	*(sig->evsigevents[evsignal])->tqh_last = (ev);
-	(sig->evsigevents[evsignal])->tqh_last = &(ev)->ev_signal_next.tqe_next;
+	(ev)->ev_signal_next.tqe_prev = sig->evsigevents[evsignal].tqh_last;
+	*sig->evsigevents[evsignal].tqh_last = (ev);
+	sig->evsigevents[evsignal].tqh_last = &(ev)->ev_signal_next.tqe_next;
 
 	return (0);
 }
 
+static void evsignal_unblock(struct evsignal_info* sig, int evsignal)
+{
+	struct timespec zero = {0, 0};
+	sigset_t one;
+
+	if (!sigismember(&sig->blocked, evsignal))
+	{
+		return;
+	}
+	sigdelset(&sig->blocked, evsignal);
+	sigemptyset(&one);
+	sigaddset(&one, evsignal);
+	/* consume a delivery still pending, or unblocking would run the default action */
+	while (sigtimedwait(&one, NULL, &zero) > 0)
+	{
+		;
+	}
+	if (pthread_sigmask(SIG_UNBLOCK, &one, NULL) != 0)
+	{
+		Error("pthread_sigmask failed");
+	}
+}
+
 int evsignal_del(struct event *ev)
 {
 	struct event_base *base = ev->ev_base;
 	struct evsignal_info *sig = base->sig;
 	int evsignal = ev->ev_fd;
 
-	assert(evsignal >= 0 && evsignal < NSIG);
+	assert(evsignal > 0 && evsignal < NSIG);
 
 	if (((ev)->ev_signal_next.tqe_next) != NULL)
 	{
@@ -233,86 +227,47 @@ int evsignal_del(struct event *ev)
 	}
 	else
 	{
-		(sig->evsigevents[evsignal])->tqh_last = (ev)->ev_signal_next.tqe_prev;
+		sig->evsigevents[evsignal].tqh_last = (ev)->ev_signal_next.tqe_prev;
 	}
 	*(ev)->ev_signal_next.tqe_prev = (ev)->ev_signal_next.tqe_next;
 
-
-
-	if (sig->evsigevents[evsignal]->tqh_first != NULL)
+	if (sig->evsigevents[evsignal].tqh_first != NULL)
 	{
 		return (0);
 	}
-	Debug("%p: restoring signal handler", ev);
-
-	return (_evsignal_restore_handler(ev->ev_base, ev->ev_fd));
-}
-
-
-void evsignal_process(struct event_base *base)
-{
-	struct evsignal_info *sig = base->sig;
-	struct event *ev, *next_ev;
-	sig_atomic_t ncalls;
-	int i;
+	Debug("%p: unblocking signal %d", ev, evsignal);
 
-	base->sig->evsignal_caught = 0;
-	for (i = 1; i < NSIG; ++i) 
+	sigdelset(&sig->mask, evsignal);
+	if (signalfd(sig->ev_signal_fd, &sig->mask, SFD_NONBLOCK | SFD_CLOEXEC) == -1)
 	{
-		ncalls = sig->evsigcaught[i];
-		if (ncalls == 0)
-		{
-			continue;
-		}
-		sig->evsigcaught[i] -= ncalls;
-
-		for (ev = sig->evsigevents[i]->tqh_first; ev != NULL; ev = next_ev) 
-		{
-			next_ev = ev->ev_signal_next.tqe_next;
-			if (!(ev->ev_events & EV_PERSIST))
-			{
-				event_del(ev);
-			}
-			event_active(ev, EV_SIGNAL, ncalls);
-		}
-
+		Error("signalfd failed, errno = %d", errno);
 	}
+	evsignal_unblock(sig, evsignal);
+	return (0);
 }
 
 void evsignal_dealloc(struct event_base* base)
 {
-	int i = 0;
-	if (base->sig->ev_signal_added) 
-	{
-		event_del(base->sig->ev_signal);
-		base->sig->ev_signal_added = 0;
-	}
-	for (i = 0; i < NSIG; ++i) 
-	{
-		if (i < base->sig->sh_old_max && base->sig->sh_old[i] != NULL)
-		{
-			_evsignal_restore_handler(base, i);
-		}
-	}
+	struct evsignal_info* sig = base->sig;
 
-	if (base->sig->ev_signal_pair[0] != -1) 
+	if (sig->ev_signal_added) 
 	{
-		close(base->sig->ev_signal_pair[0]);
-		base->sig->ev_signal_pair[0] = -1;
+		event_del(sig->ev_signal);
+		sig->ev_signal_added = 0;
 	}
-	if (base->sig->ev_signal_pair[1] != -1) 
+	for (int i = 1; i < NSIG; ++i) 
 	{
-		close(base->sig->ev_signal_pair[1]);
-		base->sig->ev_signal_pair[1] = -1;
+		evsignal_unblock(sig, i);
 	}
-	base->sig->sh_old_max = 0;
+	sigemptyset(&sig->mask);
 
-	if (base->sig->sh_old) 
+	if (sig->ev_signal_fd != -1) 
 	{
-		free(base->sig->sh_old);
-		base->sig->sh_old = NULL;
+		close(sig->ev_signal_fd);
+		sig->ev_signal_fd = -1;
 	}
-
-
-	free(base->sig->ev_signal);
+	free(sig->evsigevents);
+	sig->evsigevents = NULL;
+	free(sig->ev_signal);
+	sig->ev_signal = NULL;
 }
@@ -9,23 +9,26 @@ extern "C" {
 
 struct event;
 struct event_list;
+
+/*
+ * Signals are read from a per-base signalfd. Everything except the masks
+ * is created on the first evsignal_add, so a base that never watches a
+ * signal owns no fd and no per-signal lists.
+ */
 struct evsignal_info 
 {
 	struct event* ev_signal;
 	int ev_signal_added;
-	int ev_signal_pair[2];
-	volatile sig_atomic_t evsignal_caught;
-	sig_atomic_t evsigcaught[NSIG];
-	struct event_list* evsigevents[NSIG];
-	struct sigaction **sh_old;
-	int sh_old_max;
+	int ev_signal_fd;
+	struct event_list* evsigevents;
+	sigset_t mask;
+	sigset_t blocked;
 };
 
 
 int evsignal_init(struct event_base* base);
 int evsignal_add(struct event *ev);
 int evsignal_del(struct event *ev);
-void evsignal_process(struct event_base *base);
 void evsignal_dealloc(struct event_base* base);
 
 #ifdef __cplusplus
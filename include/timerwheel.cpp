@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "log.hpp"
+#include "event.hpp"
+#include "timerwheel.hpp"
+
+
+
+static uint64_t timer_wheel_tick_floor(const struct timeval* tv)
+{
+	return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec) / TIMER_WHEEL_TICK_USEC;
+}
+
+/* round deadlines up so a timer never fires before its ev_timeout */
+static uint64_t timer_wheel_tick_ceil(const struct timeval* tv)
+{
+	return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec + TIMER_WHEEL_TICK_USEC - 1) / TIMER_WHEEL_TICK_USEC;
+}
+
+static unsigned timer_wheel_slot(timer_wheel_t* tw, uint64_t expires)
+{
+	uint64_t delta;
+	int shift = TIMER_WHEEL_L0_BITS;
+
+	if (expires < tw->cur)
+	{
+		expires = tw->cur;
+	}
+	delta = expires - tw->cur;
+	if (delta < TIMER_WHEEL_L0_SIZE)
+	{
+		return expires & (TIMER_WHEEL_L0_SIZE - 1);
+	}
+
+	for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+	{
+		uint64_t span = (uint64_t)1 << (shift + TIMER_WHEEL_LN_BITS);
+		if (delta < span || level == TIMER_WHEEL_LEVELS - 1)
+		{
+			if (delta >= span)
+			{
+				expires = tw->cur + span - 1;
+			}
+			return TIMER_WHEEL_L0_SIZE + (level - 1) * TIMER_WHEEL_LN_SIZE + ((expires >> shift) & (TIMER_WHEEL_LN_SIZE - 1));
+		}
+		shift += TIMER_WHEEL_LN_BITS;
+	}
+	return 0;
+}
+
+static void timer_wheel_link(timer_wheel_t* tw, unsigned slot, struct event* e)
+{
+	struct event_list* list = &tw->slots[slot];
+
+	e->min_heap_idx = slot;
+	e->ev_timeout_next.tqe_next = NULL;
+	e->ev_timeout_next.tqe_prev = list->tqh_last;
+	*list->tqh_last = e;
+	list->tqh_last = &e->ev_timeout_next.tqe_next;
+}
+
+static void timer_wheel_unlink(timer_wheel_t* tw, struct event* e)
+{
+	struct event_list* list = &tw->slots[e->min_heap_idx];
+
+	if (e->ev_timeout_next.tqe_next != NULL)
+	{
+		e->ev_timeout_next.tqe_next->ev_timeout_next.tqe_prev = e->ev_timeout_next.tqe_prev;
+	}
+	else
+	{
+		list->tqh_last = e->ev_timeout_next.tqe_prev;
+	}
+	*e->ev_timeout_next.tqe_prev = e->ev_timeout_next.tqe_next;
+	e->min_heap_idx = -1;
+}
+
+static struct event* timer_wheel_detach(timer_wheel_t* tw, unsigned slot)
+{
+	struct event_list* list = &tw->slots[slot];
+	struct event* first = list->tqh_first;
+
+	list->tqh_first = NULL;
+	list->tqh_last = &list->tqh_first;
+	return first;
+}
+
+static void timer_wheel_cascade(timer_wheel_t* tw, unsigned slot)
+{
+	struct event* e = timer_wheel_detach(tw, slot);
+
+	while (e != NULL)
+	{
+		struct event* next = e->ev_timeout_next.tqe_next;
+		timer_wheel_link(tw, timer_wheel_slot(tw, timer_wheel_tick_ceil(&e->ev_timeout)), e);
+		e = next;
+	}
+}
+
+int timer_wheel_ctor(timer_wheel_t* tw, const struct timeval* now)
+{
+	tw->slots = (struct event_list*)calloc(TIMER_WHEEL_NSLOTS + 1, sizeof(struct event_list));
+	if (tw->slots == NULL)
+	{
+		Error("calloc failed, errno = %d", errno);
+		return -1;
+	}
+	for (int i = 0; i <= TIMER_WHEEL_NSLOTS; ++i)
+	{
+		tw->slots[i].tqh_first = NULL;
+		tw->slots[i].tqh_last = &tw->slots[i].tqh_first;
+	}
+	tw->cur = timer_wheel_tick_floor(now);
+	tw->n = 0;
+	return 0;
+}
+
+void timer_wheel_dtor(timer_wheel_t* tw)
+{
+	if (tw->slots)
+	{
+		free(tw->slots);
+	}
+}
+
+int timer_wheel_empty(timer_wheel_t* tw)
+{
+	return 0u == tw->n;
+}
+
+unsigned timer_wheel_size(timer_wheel_t* tw)
+{
+	return tw->n;
+}
+
+void timer_wheel_add(timer_wheel_t* tw, struct event* e)
+{
+	timer_wheel_link(tw, timer_wheel_slot(tw, timer_wheel_tick_ceil(&e->ev_timeout)), e);
+	++tw->n;
+}
+
+void timer_wheel_del(timer_wheel_t* tw, struct event* e)
+{
+	if (((unsigned int)-1) != e->min_heap_idx)
+	{
+		timer_wheel_unlink(tw, e);
+		--tw->n;
+	}
+}
+
+int timer_wheel_next(timer_wheel_t* tw, struct timeval* tv)
+{
+	uint64_t tick;
+	uint64_t usec;
+
+	if (tw->n == 0)
+	{
+		return -1;
+	}
+
+	if (tw->slots[TIMER_WHEEL_EXPIRED].tqh_first != NULL)
+	{
+		tick = tw->cur ? tw->cur - 1 : 0;
+	}
+	else
+	{
+		/*
+		 * the first busy first-level slot before the next cascade, or the
+		 * cascade itself since it may bring earlier timers down
+		 */
+		tick = ((tw->cur + TIMER_WHEEL_L0_SIZE - 1) >> TIMER_WHEEL_L0_BITS) << TIMER_WHEEL_L0_BITS;
+		for (uint64_t t = tw->cur; t < tick; ++t)
+		{
+			if (tw->slots[t & (TIMER_WHEEL_L0_SIZE - 1)].tqh_first != NULL)
+			{
+				tick = t;
+				break;
+			}
+		}
+	}
+
+	usec = tick * TIMER_WHEEL_TICK_USEC;
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+	return 0;
+}
+
+void timer_wheel_expire(timer_wheel_t* tw, const struct timeval* now)
+{
+	uint64_t target = timer_wheel_tick_floor(now);
+
+	if (tw->n == 0)
+	{
+		if (target >= tw->cur)
+		{
+			tw->cur = target + 1;
+		}
+		return;
+	}
+
+	for (; tw->cur <= target; ++tw->cur)
+	{
+		unsigned idx = tw->cur & (TIMER_WHEEL_L0_SIZE - 1);
+		struct event* e;
+
+		if (idx == 0)
+		{
+			int shift = TIMER_WHEEL_L0_BITS;
+			for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+			{
+				unsigned lidx = (tw->cur >> shift) & (TIMER_WHEEL_LN_SIZE - 1);
+				timer_wheel_cascade(tw, TIMER_WHEEL_L0_SIZE + (level - 1) * TIMER_WHEEL_LN_SIZE + lidx);
+				if (lidx != 0)
+				{
+					break;
+				}
+				shift += TIMER_WHEEL_LN_BITS;
+			}
+		}
+
+		/* move the whole slot onto the expired list in one pass */
+		e = timer_wheel_detach(tw, idx);
+		while (e != NULL)
+		{
+			struct event* next = e->ev_timeout_next.tqe_next;
+			timer_wheel_link(tw, TIMER_WHEEL_EXPIRED, e);
+			e = next;
+		}
+	}
+}
+
+struct event* timer_wheel_expired(timer_wheel_t* tw)
+{
+	return tw->slots[TIMER_WHEEL_EXPIRED].tqh_first;
+}
+
+struct event* timer_wheel_first(timer_wheel_t* tw)
+{
+	if (tw->n == 0)
+	{
+		return 0;
+	}
+	for (int i = 0; i <= TIMER_WHEEL_NSLOTS; ++i)
+	{
+		if (tw->slots[i].tqh_first != NULL)
+		{
+			return tw->slots[i].tqh_first;
+		}
+	}
+	return 0;
+}
+
+void timer_wheel_shift(timer_wheel_t* tw, const struct timeval* off, const struct timeval* now)
+{
+	struct event* pending = NULL;
+
+	/* pull every timer out, move its deadline back by off and re-place it */
+	for (int i = 0; i <= TIMER_WHEEL_NSLOTS; ++i)
+	{
+		struct event* e = timer_wheel_detach(tw, i);
+		while (e != NULL)
+		{
+			struct event* next = e->ev_timeout_next.tqe_next;
+			timersub(&e->ev_timeout, off, &e->ev_timeout);
+			e->ev_timeout_next.tqe_next = pending;
+			pending = e;
+			e = next;
+		}
+	}
+
+	tw->cur = timer_wheel_tick_floor(now);
+	while (pending != NULL)
+	{
+		struct event* next = pending->ev_timeout_next.tqe_next;
+		timer_wheel_link(tw, timer_wheel_slot(tw, timer_wheel_tick_ceil(&pending->ev_timeout)), pending);
+		pending = next;
+	}
+}
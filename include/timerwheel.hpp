@@ -0,0 +1,54 @@
+#ifndef _TIMERWHEEL_HPP_
+#define _TIMERWHEEL_HPP_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel: 1ms ticks, a 256-slot first level and three
+ * 64-slot levels above it (about 18 hours). Timers further out sit in the
+ * last slot of the top level and are re-placed when it cascades.
+ */
+#define TIMER_WHEEL_TICK_USEC	1000
+#define TIMER_WHEEL_L0_BITS	8
+#define TIMER_WHEEL_LN_BITS	6
+#define TIMER_WHEEL_LEVELS	4
+#define TIMER_WHEEL_L0_SIZE	(1 << TIMER_WHEEL_L0_BITS)
+#define TIMER_WHEEL_LN_SIZE	(1 << TIMER_WHEEL_LN_BITS)
+#define TIMER_WHEEL_NSLOTS	(TIMER_WHEEL_L0_SIZE + (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_LN_SIZE)
+#define TIMER_WHEEL_EXPIRED	TIMER_WHEEL_NSLOTS
+
+typedef struct timer_wheel timer_wheel_t;
+struct event;
+struct event_list;
+struct timeval;
+struct timer_wheel
+{
+	struct event_list* slots;
+	uint64_t cur;
+	unsigned n;
+};
+
+
+int timer_wheel_ctor(timer_wheel_t* tw, const struct timeval* now);
+void timer_wheel_dtor(timer_wheel_t* tw);
+int timer_wheel_empty(timer_wheel_t* tw);
+unsigned timer_wheel_size(timer_wheel_t* tw);
+void timer_wheel_add(timer_wheel_t* tw, struct event* e);
+void timer_wheel_del(timer_wheel_t* tw, struct event* e);
+int timer_wheel_next(timer_wheel_t* tw, struct timeval* tv);
+void timer_wheel_expire(timer_wheel_t* tw, const struct timeval* now);
+struct event* timer_wheel_expired(timer_wheel_t* tw);
+struct event* timer_wheel_first(timer_wheel_t* tw);
+void timer_wheel_shift(timer_wheel_t* tw, const struct timeval* off, const struct timeval* now);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,467 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "log.hpp"
+#include "signal.hpp"
+#include "event.hpp"
+#include "evmap.hpp"
+#include "epoll.hpp"
+#include "uring.hpp"
+
+
+
+static void* uring_init(struct event_base*);
+static int uring_add(void*, struct event*);
+static int uring_del(void*, struct event*);
+static int uring_dispatch(struct event_base*, void*, struct timeval*);
+static void uring_dealloc(struct event_base*, void*);
+
+const struct eventop uringops =
+{
+	"io_uring",
+	uring_init,
+	uring_add,
+	uring_del,
+	uring_dispatch,
+	uring_dealloc,
+	1
+};
+
+
+static const unsigned URING_ENTRIES = 256;
+static const int INITIAL_NFILES = 32;
+static const uint64_t URING_UD_IGNORE = ~(uint64_t)0;
+static const unsigned URING_REQUIRED_FEATURES = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t argsz)
+{
+	return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+static void uring_free_ring(struct uringop* uop)
+{
+	if (uop->sqes != NULL && uop->sqes != MAP_FAILED)
+	{
+		munmap(uop->sqes, uop->sqes_sz);
+	}
+	if (uop->sq_ptr != NULL && uop->sq_ptr != MAP_FAILED)
+	{
+		munmap(uop->sq_ptr, uop->sq_sz);
+	}
+	if (uop->ring_fd >= 0)
+	{
+		close(uop->ring_fd);
+	}
+}
+
+static void* uring_init(struct event_base* base)
+{
+	struct io_uring_params params;
+	struct uringop* uop;
+	char* sq;
+
+	if (getenv("EVENT_NOURING") != NULL)
+	{
+		return (NULL);
+	}
+	if (!(uop = (struct uringop*)calloc(1, sizeof(struct uringop))))
+	{
+		Error("calloc failed, errno = %d\n", errno);
+		return (NULL);
+	}
+
+	memset(&params, 0, sizeof(params));
+	if ((uop->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params)) == -1)
+	{
+		/* ENOSYS or EPERM: no io_uring here, let epoll take over */
+		free(uop);
+		return (NULL);
+	}
+	if ((params.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES)
+	{
+		close(uop->ring_fd);
+		free(uop);
+		return (NULL);
+	}
+
+	uop->sq_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	if (uop->sq_sz < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe))
+	{
+		uop->sq_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	}
+	uop->sq_ptr = mmap(NULL, uop->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uop->ring_fd, IORING_OFF_SQ_RING);
+	uop->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+	uop->sqes = (struct io_uring_sqe*)mmap(NULL, uop->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uop->ring_fd, IORING_OFF_SQES);
+	if (uop->sq_ptr == MAP_FAILED || uop->sqes == MAP_FAILED)
+	{
+		Error("mmap failed, errno = %d\n", errno);
+		uring_free_ring(uop);
+		free(uop);
+		return (NULL);
+	}
+
+	/* IORING_FEAT_SINGLE_MMAP: the completion ring shares the submission mapping */
+	sq = (char*)uop->sq_ptr;
+	uop->sq_head = (unsigned*)(sq + params.sq_off.head);
+	uop->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	uop->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	uop->sq_entries = params.sq_entries;
+	uop->sq_array = (unsigned*)(sq + params.sq_off.array);
+	uop->sq_local_tail = *uop->sq_tail;
+	uop->cq_ptr = uop->sq_ptr;
+	uop->cq_head = (unsigned*)(sq + params.cq_off.head);
+	uop->cq_tail = (unsigned*)(sq + params.cq_off.tail);
+	uop->cq_mask = *(unsigned*)(sq + params.cq_off.ring_mask);
+	uop->cqes = (struct io_uring_cqe*)(sq + params.cq_off.cqes);
+
+	uop->fds = (struct evuring*)calloc(INITIAL_NFILES, sizeof(struct evuring));
+	if (uop->fds == NULL)
+	{
+		uring_free_ring(uop);
+		free(uop);
+		return (NULL);
+	}
+	uop->nfds = INITIAL_NFILES;
+
+	evsignal_init(base);
+
+	return (uop);
+}
+
+static int uring_recalc(struct uringop* uop, int max)
+{
+	if (max >= uop->nfds)
+	{
+		struct evuring* fds;
+		int nfds = uop->nfds;
+		while (nfds <= max)
+		{
+			nfds <<= 1;
+		}
+		fds = (struct evuring*)realloc(uop->fds, nfds * sizeof(struct evuring));
+		if (fds == NULL)
+		{
+			Error("realloc failed, errno = %d\n", errno);
+			return (-1);
+		}
+		uop->fds = fds;
+		memset(fds + uop->nfds, 0, (nfds - uop->nfds) * sizeof(struct evuring));
+		uop->nfds = nfds;
+	}
+	return (0);
+}
+
+static int uring_submit(struct uringop* uop)
+{
+	unsigned pending = uop->sq_local_tail - __atomic_load_n(uop->sq_head, __ATOMIC_ACQUIRE);
+
+	if (pending && sys_io_uring_enter(uop->ring_fd, pending, 0, 0, NULL, 0) == -1 && errno != EINTR)
+	{
+		Error("io_uring_enter failed, errno = %d\n", errno);
+		return (-1);
+	}
+	return (0);
+}
+
+/* SQEs are only published here; the kernel sees them on the next io_uring_enter */
+static struct io_uring_sqe* uring_get_sqe(struct uringop* uop)
+{
+	struct io_uring_sqe* sqe;
+	unsigned idx;
+
+	if (uop->sq_local_tail - __atomic_load_n(uop->sq_head, __ATOMIC_ACQUIRE) >= uop->sq_entries)
+	{
+		if (uring_submit(uop) == -1 || uop->sq_local_tail - __atomic_load_n(uop->sq_head, __ATOMIC_ACQUIRE) >= uop->sq_entries)
+		{
+			return (NULL);
+		}
+	}
+	idx = uop->sq_local_tail & uop->sq_mask;
+	sqe = &uop->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uop->sq_array[idx] = idx;
+	++uop->sq_local_tail;
+	__atomic_store_n(uop->sq_tail, uop->sq_local_tail, __ATOMIC_RELEASE);
+	return (sqe);
+}
+
+static int uring_queue_change(struct uringop* uop, int fd)
+{
+	struct evuring* evu = &uop->fds[fd];
+
+	if (evu->changed)
+	{
+		return (0);
+	}
+	if (uop->nchanges == uop->achanges)
+	{
+		int achanges = uop->achanges ? uop->achanges * 2 : INITIAL_NFILES;
+		int* changes = (int*)realloc(uop->changes, achanges * sizeof(int));
+		if (changes == NULL)
+		{
+			Error("realloc failed, errno = %d\n", errno);
+			return (-1);
+		}
+		uop->changes = changes;
+		uop->achanges = achanges;
+	}
+	uop->changes[uop->nchanges++] = fd;
+	evu->changed = 1;
+	return (0);
+}
+
+/*
+ * Level-triggered events get a oneshot poll that is re-armed after each
+ * completion, since arming re-checks readiness. Only EV_ET interest uses
+ * multishot poll, which reports wakeups rather than levels.
+ */
+static void uring_apply_change(struct uringop* uop, int fd)
+{
+	struct evuring* evu = &uop->fds[fd];
+	struct io_uring_sqe* sqe;
+	short interest = evmap_io_interest(&evu->io);
+	unsigned mask = 0;
+	int multishot = (interest & EV_ET) && !uop->no_multishot;
+
+	evu->changed = 0;
+	if (interest & EV_READ)
+	{
+		mask |= POLLIN;
+	}
+	if (interest & EV_WRITE)
+	{
+		mask |= POLLOUT;
+	}
+
+	/* a poll holds the file it was armed on, so a reused fd number must re-arm */
+	if (evu->armed)
+	{
+		if (evu->armed == mask && !evu->io.verify)
+		{
+			return;
+		}
+		if ((sqe = uring_get_sqe(uop)) == NULL)
+		{
+			Error("io_uring submission queue full, fd = %d", fd);
+			return;
+		}
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = ((uint64_t)evu->gen << 32) | (uint32_t)fd;
+		sqe->user_data = URING_UD_IGNORE;
+		evu->armed = 0;
+	}
+	++evu->gen;
+	evu->io.verify = 0;
+
+	if (mask == 0)
+	{
+		return;
+	}
+	if ((sqe = uring_get_sqe(uop)) == NULL)
+	{
+		Error("io_uring submission queue full, fd = %d", fd);
+		return;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = mask;
+	sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = ((uint64_t)evu->gen << 32) | (uint32_t)fd;
+	evu->armed = mask;
+}
+
+static void uring_apply_changes(struct uringop* uop)
+{
+	int nchanges = uop->nchanges;
+
+	uop->nchanges = 0;
+	for (int i = 0; i < nchanges; ++i)
+	{
+		uring_apply_change(uop, uop->changes[i]);
+	}
+}
+
+static void uring_complete(struct uringop* uop, struct io_uring_cqe* cqe)
+{
+	struct evuring* evu;
+	short active = 0;
+	int fd;
+
+	if (cqe->user_data == URING_UD_IGNORE)
+	{
+		return;
+	}
+	fd = (int)(uint32_t)cqe->user_data;
+	if (fd < 0 || fd >= uop->nfds)
+	{
+		return;
+	}
+	evu = &uop->fds[fd];
+	if ((uint32_t)(cqe->user_data >> 32) != evu->gen)
+	{
+		return;
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+	{
+		evu->armed = 0;
+		if (evu->io.events != NULL)
+		{
+			uring_queue_change(uop, fd);
+		}
+	}
+
+	if (cqe->res < 0)
+	{
+		if (cqe->res == -EINVAL && !uop->no_multishot)
+		{
+			/* kernel without multishot poll: fall back to oneshot re-arming */
+			uop->no_multishot = 1;
+			return;
+		}
+		if (cqe->res == -ECANCELED)
+		{
+			return;
+		}
+		active = EV_READ | EV_WRITE;
+	}
+	else if (cqe->res & (POLLHUP | POLLERR))
+	{
+		active = EV_READ | EV_WRITE;
+	}
+	else
+	{
+		if (cqe->res & POLLIN)
+		{
+			active |= EV_READ;
+		}
+		if (cqe->res & POLLOUT)
+		{
+			active |= EV_WRITE;
+		}
+	}
+	evmap_io_active(&evu->io, active);
+}
+
+static int uring_dispatch(struct event_base* base, void* arg, struct timeval* tv)
+{
+	struct uringop* uop = (struct uringop*)arg;
+	struct io_uring_getevents_arg garg;
+	struct __kernel_timespec ts;
+	unsigned head, tail, pending, wait_nr;
+	int res;
+
+	if (uop->nchanges)
+	{
+		uring_apply_changes(uop);
+	}
+
+	memset(&garg, 0, sizeof(garg));
+	if (tv != NULL)
+	{
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		garg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+
+	/* submit the batch and wait in one call; the ring's own timeout replaces epoll_wait's */
+	pending = uop->sq_local_tail - __atomic_load_n(uop->sq_head, __ATOMIC_ACQUIRE);
+	wait_nr = (*uop->cq_head != __atomic_load_n(uop->cq_tail, __ATOMIC_ACQUIRE)) ? 0 : 1;
+	res = sys_io_uring_enter(uop->ring_fd, pending, wait_nr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &garg, sizeof(garg));
+
+	if (res == -1)
+	{
+		if (errno == EINTR)
+		{
+			return (0);
+		}
+		if (errno != ETIME && errno != EBUSY && errno != EAGAIN)
+		{
+			Error("io_uring_enter failed, errno = %d\n", errno);
+			return (-1);
+		}
+	}
+	head = *uop->cq_head;
+	tail = __atomic_load_n(uop->cq_tail, __ATOMIC_ACQUIRE);
+	Debug("io_uring_enter reports %u", tail - head);
+	for (; head != tail; ++head)
+	{
+		uring_complete(uop, &uop->cqes[head & uop->cq_mask]);
+	}
+	__atomic_store_n(uop->cq_head, head, __ATOMIC_RELEASE);
+
+	return (0);
+}
+
+static int uring_add(void* arg, struct event* ev)
+{
+	struct uringop* uop = (struct uringop*)arg;
+	int fd;
+
+	if (ev->ev_events & EV_SIGNAL)
+	{
+		return (evsignal_add(ev));
+	}
+	fd = ev->ev_fd;
+	if (fd >= uop->nfds && uring_recalc(uop, fd) == -1)
+	{
+		return (-1);
+	}
+	if (uring_queue_change(uop, fd) == -1)
+	{
+		return (-1);
+	}
+	evmap_io_add(&uop->fds[fd].io, ev);
+	return (0);
+}
+
+static int uring_del(void* arg, struct event* ev)
+{
+	struct uringop* uop = (struct uringop*)arg;
+	int fd;
+
+	if (ev->ev_events & EV_SIGNAL)
+	{
+		return (evsignal_del(ev));
+	}
+	fd = ev->ev_fd;
+	if (fd >= uop->nfds)
+	{
+		return (0);
+	}
+	if (uring_queue_change(uop, fd) == -1)
+	{
+		return (-1);
+	}
+	evmap_io_del(&uop->fds[fd].io, ev);
+	return (0);
+}
+
+static void uring_dealloc(struct event_base* base, void* arg)
+{
+	struct uringop* uop = (struct uringop*)arg;
+
+	evsignal_dealloc(base);
+	uring_free_ring(uop);
+	if (uop->fds)
+	{
+		free(uop->fds);
+	}
+	if (uop->changes)
+	{
+		free(uop->changes);
+	}
+	memset(uop, 0, sizeof(struct uringop));
+	free(uop);
+}
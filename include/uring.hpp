@@ -0,0 +1,66 @@
+#ifndef _URING_HPP_
+#define _URING_HPP_
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include "evmap.hpp"
+
+struct event;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*
+ * One poll request per fd. user_data carries the fd and a generation, so
+ * completions of a poll that was removed or replaced are recognised as
+ * stale and dropped.
+ */
+struct evuring
+{
+	struct evmap_io io;
+
+	unsigned armed;
+	uint32_t gen;
+	int changed;
+};
+
+struct uringop
+{
+	int ring_fd;
+
+	void* sq_ptr;
+	size_t sq_sz;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	size_t sqes_sz;
+	unsigned sq_local_tail;
+
+	void* cq_ptr;
+	size_t cq_sz;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+
+	struct evuring* fds;
+	int nfds;
+	int* changes;
+	int nchanges;
+	int achanges;
+
+	int no_multishot;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
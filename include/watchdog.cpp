@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include "log.hpp"
+#include "event.hpp"
+#include "watchdog.hpp"
+
+
+/* CLOCK_MONOTONIC where available, like the timestamps the loop hands us */
+static uint64_t evwatchdog_now(void)
+{
+	struct timespec ts;
+	struct timeval tv;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	{
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+}
+
+/*
+ * Wakes every half stuck interval and reports a callback that has been
+ * running longer than that, once per callback invocation.
+ */
+static void* evwatchdog_thread(void* arg)
+{
+	struct event_watchdog* wd = (struct event_watchdog*)arg;
+	uint64_t reported = 0;
+	struct timespec ts;
+
+	pthread_mutex_lock(&wd->lock);
+	while (!wd->stop)
+	{
+		uint64_t period = __atomic_load_n(&wd->stuck_nsec, __ATOMIC_RELAXED) / 2;
+		uint64_t start, now;
+
+		if (period == 0)
+		{
+			pthread_cond_wait(&wd->cond, &wd->lock);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += period / 1000000000;
+		ts.tv_nsec += period % 1000000000;
+		if (ts.tv_nsec >= 1000000000)
+		{
+			++ts.tv_sec;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&wd->cond, &wd->lock, &ts);
+		if (wd->stop)
+		{
+			break;
+		}
+
+		start = __atomic_load_n(&wd->start, __ATOMIC_ACQUIRE);
+		now = evwatchdog_now();
+		if (start != 0 && start != reported && now > start && now - start >= __atomic_load_n(&wd->stuck_nsec, __ATOMIC_RELAXED))
+		{
+			reported = start;
+			Error("event loop stuck for %llu ms in callback %p, fd %d", 
+				(unsigned long long)((now - start) / 1000000), (void*)wd->callback, wd->fd);
+		}
+	}
+	pthread_mutex_unlock(&wd->lock);
+	return (NULL);
+}
+
+int event_base_set_watchdog(struct event_base* base, int slow_usec, int stuck_msec)
+{
+	struct event_watchdog* wd = base->watchdog;
+
+	if (slow_usec < 0 || stuck_msec < 0)
+	{
+		return (-1);
+	}
+	if (wd == NULL)
+	{
+		if (slow_usec == 0 && stuck_msec == 0)
+		{
+			return (0);
+		}
+		if ((wd = (struct event_watchdog*)calloc(1, sizeof(struct event_watchdog))) == NULL)
+		{
+			Error("calloc failed, errno = %d", errno);
+			return (-1);
+		}
+		pthread_mutex_init(&wd->lock, NULL);
+		{
+			pthread_condattr_t attr;
+			pthread_condattr_init(&attr);
+			pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+			pthread_cond_init(&wd->cond, &attr);
+			pthread_condattr_destroy(&attr);
+		}
+		__atomic_store_n(&base->watchdog, wd, __ATOMIC_RELEASE);
+	}
+
+	/* running is tested and set under the lock, so concurrent callers start one thread */
+	pthread_mutex_lock(&wd->lock);
+	__atomic_store_n(&wd->slow_nsec, (uint64_t)slow_usec * 1000, __ATOMIC_RELAXED);
+	__atomic_store_n(&wd->stuck_nsec, (uint64_t)stuck_msec * 1000000, __ATOMIC_RELAXED);
+	pthread_cond_signal(&wd->cond);
+	if (stuck_msec > 0 && !wd->running)
+	{
+		if (pthread_create(&wd->thread, NULL, evwatchdog_thread, wd))
+		{
+			Error("pthread_create failed, errno = %d", errno);
+			pthread_mutex_unlock(&wd->lock);
+			return (-1);
+		}
+		wd->running = 1;
+	}
+	pthread_mutex_unlock(&wd->lock);
+	return (0);
+}
+
+void evwatchdog_enter(struct event_watchdog* wd, struct event* ev, uint64_t start)
+{
+	wd->callback = ev->ev_callback;
+	wd->fd = ev->ev_fd;
+	__atomic_store_n(&wd->start, start, __ATOMIC_RELEASE);
+}
+
+/* the event may be gone by now, so only what enter() saved is used */
+void evwatchdog_leave(struct event_watchdog* wd, uint64_t end)
+{
+	uint64_t duration = end - wd->start;
+	uint64_t slow_nsec = __atomic_load_n(&wd->slow_nsec, __ATOMIC_RELAXED);
+	struct event_slow_callback* slot;
+
+	__atomic_store_n(&wd->start, 0, __ATOMIC_RELEASE);
+	if (slow_nsec == 0 || duration < slow_nsec)
+	{
+		return;
+	}
+
+	slot = &wd->ring[wd->head % EVWATCHDOG_RING_SIZE];
+	slot->callback = wd->callback;
+	slot->fd = wd->fd;
+	slot->duration_nsec = duration;
+	__atomic_store_n(&wd->head, wd->head + 1, __ATOMIC_RELEASE);
+
+	Error("slow callback %p, fd %d, took %llu us", (void*)wd->callback, wd->fd, (unsigned long long)(duration / 1000));
+}
+
+/*
+ * Copies up to max records, newest first. Slots the loop may have
+ * rewritten during the copy are dropped, so every record returned is whole.
+ */
+int event_base_get_slow_callbacks(struct event_base* base, struct event_slow_callback* out, int max)
+{
+	struct event_watchdog* wd = __atomic_load_n(&base->watchdog, __ATOMIC_ACQUIRE);
+	uint64_t head, after;
+	int n = 0;
+
+	if (wd == NULL)
+	{
+		return (0);
+	}
+	head = __atomic_load_n(&wd->head, __ATOMIC_ACQUIRE);
+	for (uint64_t i = head; i > 0 && n < max && head - i < EVWATCHDOG_RING_SIZE; --i, ++n)
+	{
+		out[n] = wd->ring[(i - 1) % EVWATCHDOG_RING_SIZE];
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	after = __atomic_load_n(&wd->head, __ATOMIC_RELAXED);
+
+	/* record head - 1 - k is intact if the loop has not wrapped onto it yet */
+	while (n > 0 && after - (head - n) > EVWATCHDOG_RING_SIZE - 1)
+	{
+		--n;
+	}
+	return (n);
+}
+
+void evwatchdog_dealloc(struct event_base* base)
+{
+	struct event_watchdog* wd = base->watchdog;
+
+	if (wd == NULL)
+	{
+		return;
+	}
+	if (wd->running)
+	{
+		pthread_mutex_lock(&wd->lock);
+		wd->stop = 1;
+		pthread_cond_signal(&wd->cond);
+		pthread_mutex_unlock(&wd->lock);
+		pthread_join(wd->thread, NULL);
+	}
+	pthread_mutex_destroy(&wd->lock);
+	pthread_cond_destroy(&wd->cond);
+	free(wd);
+	base->watchdog = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef _WATCHDOG_HPP_
+#define _WATCHDOG_HPP_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define EVWATCHDOG_RING_SIZE	64
+
+struct event_base;
+struct event;
+
+struct event_slow_callback
+{
+	void (*callback)(int, short, void*);
+	int fd;
+	uint64_t duration_nsec;
+};
+
+/*
+ * The loop thread publishes the callback it is running (start is 0
+ * between callbacks) and appends slow ones to the ring; head counts every
+ * append, so readers on other threads can tell which slots were
+ * overwritten while they copied.
+ */
+struct event_watchdog
+{
+	/* set from any thread, read with __atomic loads */
+	uint64_t slow_nsec;
+	uint64_t stuck_nsec;
+
+	void (*volatile callback)(int, short, void*);
+	volatile int fd;
+	uint64_t start;
+
+	struct event_slow_callback ring[EVWATCHDOG_RING_SIZE];
+	uint64_t head;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* under lock */
+	int running;
+	int stop;
+};
+
+void evwatchdog_enter(struct event_watchdog* wd, struct event* ev, uint64_t start);
+void evwatchdog_leave(struct event_watchdog* wd, uint64_t end);
+void evwatchdog_dealloc(struct event_base* base);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -14,10 +14,17 @@
 #include "workqueue.hpp"
 
 #define SERVER_PORT 5555
-#define CONNECTION_BACKLOG 8
+#define CONNECTION_BACKLOG 1024
 #define SOCKET_READ_TIMEOUT_SECONDS 10
 #define SOCKET_WRITE_TIMEOUT_SECONDS 10
 #define NUM_THREADS 8
+#define LOG_LEVEL_FILE "loglevel"
+#define BUSY_POLL_USEC 0
+#define SO_BUSY_POLL_USEC 0
+#define MAX_CALLBACKS_PER_LOOP 64
+#define LOOP_STATS 0
+#define SLOW_CALLBACK_USEC 0
+#define STUCK_LOOP_MSEC 0
 
 
 
@@ -26,18 +33,29 @@
 	fprintf(stderr, __VA_ARGS__);\
 }
 
+typedef struct reactor 
+{
+	struct event_base* evbase;
+	int nclients;
+} reactor_t;
+
 typedef struct client 
 {
 	int fd;
 	struct event_base* evbase;
+	struct reactor* reactor;
 	struct bufferevent *buf_ev;
 	struct evbuffer *output_buffer;
 } client_t;
 
 static struct event_base* evbase_accept;
 static workqueue_t workqueue;
+static reactor_t* reactors;
+static int nreactors;
+static int next_reactor;
 
 static void sighandler(int signal);
+static void reloadhandler(int signal);
 
 static int setnonblock(int fd) 
 {
@@ -72,22 +90,22 @@ static void closeAndFreeClient(client_t* client)
 {
 	if (client != NULL) 
 	{
-		closeClient(client);
 		if (client->buf_ev != NULL) 
 		{
 			bufferevent_free(client->buf_ev);
 			client->buf_ev = NULL;
 		}
-		if (client->evbase != NULL) 
-		{
-			event_base_free(client->evbase);
-			client->evbase = NULL;
-		}
+		closeClient(client);
 		if (client->output_buffer != NULL) 
 		{
 			evbuffer_free(client->output_buffer);
 			client->output_buffer = NULL;
 		}
+		if (client->reactor != NULL) 
+		{
+			__sync_fetch_and_sub(&client->reactor->nclients, 1);
+			client->reactor = NULL;
+		}
 		free(client);
 	}
 }
@@ -95,23 +113,14 @@ static void closeAndFreeClient(client_t* client)
 void buffered_on_read(struct bufferevent* bev, void* arg) 
 {
 	client_t* client = (client_t*)arg;
-	char data[4096];
-	int nbytes;
 
-	while ((nbytes = bev->input->off) > 0) 
-	{
-		if (nbytes > 4096) 
-		{
-			nbytes = 4096;
-		}
-		evbuffer_remove(bev->input, data, nbytes); 
-		evbuffer_add(client->output_buffer, data, nbytes);
-	}
+	/* echo: the received segments move to the output as they are, nothing is copied */
+	evbuffer_add_buffer(client->output_buffer, bev->input);
 
 	if (bufferevent_write_buffer(bev, client->output_buffer)) 
 	{
 		errorOut("Error sending data to client on fd %d\n", client->fd);
-		closeClient(client);
+		closeAndFreeClient(client);
 	}
 }
 
@@ -122,26 +131,148 @@ void buffered_on_write(struct bufferevent* bev, void* arg)
 
 void buffered_on_error(struct bufferevent* bev, short what, void* arg) 
 {
-	closeClient((client_t*)arg);
+	closeAndFreeClient((client_t*)arg);
 }
 
-static void server_job_function(struct job* job) 
+static void reactor_add_client(void* arg) 
 {
-	client_t* client = (client_t*)job->user_data;
+	client_t* client = (client_t*)arg;
+
+	if ((client->output_buffer = evbuffer_new()) == NULL) 
+	{
+		warn("client output buffer allocation failed");
+		closeAndFreeClient(client);
+		return;
+	}
+
+	if ((client->buf_ev = bufferevent_new(client->fd, buffered_on_read, buffered_on_write, buffered_on_error, client)) == NULL) 
+	{
+		warn("client bufferevent creation failed");
+		closeAndFreeClient(client);
+		return;
+	}
+	bufferevent_base_set(client->evbase, client->buf_ev);
+	bufferevent_setedge(client->buf_ev, 1);
+
+	bufferevent_settimeout(client->buf_ev, SOCKET_READ_TIMEOUT_SECONDS, SOCKET_WRITE_TIMEOUT_SECONDS);
+
+	bufferevent_enable(client->buf_ev, EV_READ);
+}
 
-	event_base_dispatch(client->evbase);
-	closeAndFreeClient(client);
+static void reactor_print_stats(reactor_t* reactor) 
+{
+	struct event_stats* stats;
+
+	if ((stats = (struct event_stats*)malloc(sizeof(*stats))) == NULL || event_base_get_stats(reactor->evbase, stats)) 
+	{
+		free(stats);
+		return;
+	}
+	fprintf(stdout, "Reactor %d: %llu loops, events/wake p50 %llu p99 %llu, dispatch p99 %llu ns, callback p50 %llu p99 %llu max %llu ns, timer late p99 %llu ns, active depth p99 %llu.\n", 
+		(int)(reactor - reactors), (unsigned long long)stats->loops, 
+		(unsigned long long)evstats_percentile(&stats->events_per_wake, 50), (unsigned long long)evstats_percentile(&stats->events_per_wake, 99), 
+		(unsigned long long)evstats_percentile(&stats->dispatch_nsec, 99), 
+		(unsigned long long)evstats_percentile(&stats->callback_nsec, 50), (unsigned long long)evstats_percentile(&stats->callback_nsec, 99), (unsigned long long)stats->callback_nsec.max, 
+		(unsigned long long)evstats_percentile(&stats->timer_late_nsec, 99), (unsigned long long)evstats_percentile(&stats->active_depth, 99));
+	free(stats);
+}
+
+static void reactor_job_function(struct job* job) 
+{
+	reactor_t* reactor = (reactor_t*)job->user_data;
+
+	event_base_loop(reactor->evbase, EVLOOP_NO_EXIT_ON_EMPTY);
+	if (BUSY_POLL_USEC > 0) 
+	{
+		struct event_busy_poll_stats stats;
+		event_base_get_busy_poll_stats(reactor->evbase, &stats);
+		fprintf(stdout, "Reactor %d: %llu spins (%llu hits, %llu us), %llu sleeps (%llu us).\n", (int)(reactor - reactors), 
+			stats.spins, stats.spin_hits, stats.spin_usec, stats.sleeps, stats.sleep_usec);
+	}
+	if (LOOP_STATS) 
+	{
+		reactor_print_stats(reactor);
+	}
 	free(job);
 }
 
+static reactor_t* reactor_select(void) 
+{
+	reactor_t* best = NULL;
+
+	for (int i = 0; i < nreactors; ++i) 
+	{
+		reactor_t* reactor = &reactors[(next_reactor + i) % nreactors];
+		if (best == NULL || reactor->nclients < best->nclients) 
+		{
+			best = reactor;
+		}
+	}
+	next_reactor = (next_reactor + 1) % nreactors;
+	return best;
+}
+
+static int reactors_init(int num) 
+{
+	if ((reactors = (reactor_t*)calloc(num, sizeof(reactor_t))) == NULL) 
+	{
+		return -1;
+	}
+	nreactors = num;
+
+	for (int i = 0; i < nreactors; ++i) 
+	{
+		reactor_t* reactor = &reactors[i];
+		struct timeval read_timeout = {SOCKET_READ_TIMEOUT_SECONDS, 0};
+		struct timeval write_timeout = {SOCKET_WRITE_TIMEOUT_SECONDS, 0};
+		job_t* job;
+
+		if ((reactor->evbase = event_base_new_with_flags(EVENT_BASE_FLAG_TIMERWHEEL | EVENT_BASE_FLAG_EPOLL_CHANGELIST)) == NULL) 
+		{
+			warn("reactor event_base creation failed");
+			return -1;
+		}
+		event_base_add_common_timeout(reactor->evbase, &read_timeout);
+		event_base_add_common_timeout(reactor->evbase, &write_timeout);
+		event_base_set_busy_poll(reactor->evbase, BUSY_POLL_USEC, SO_BUSY_POLL_USEC);
+		event_base_set_max_callbacks(reactor->evbase, MAX_CALLBACKS_PER_LOOP);
+		if (LOOP_STATS) 
+		{
+			event_base_enable_stats(reactor->evbase);
+		}
+		event_base_set_watchdog(reactor->evbase, SLOW_CALLBACK_USEC, STUCK_LOOP_MSEC);
+
+		if ((job = (job_t*)malloc(sizeof(*job))) == NULL) 
+		{
+			warn("failed to allocate memory for job state");
+			return -1;
+		}
+		job->job_function = reactor_job_function;
+		job->user_data = reactor;
+		workqueue_add_job(&workqueue, job);
+	}
+
+	return 0;
+}
+
+static void reactors_stop(void) 
+{
+	for (int i = 0; i < nreactors; ++i) 
+	{
+		if (reactors[i].evbase != NULL && event_base_loopbreak(reactors[i].evbase)) 
+		{
+			errorOut("Error stopping reactor %d\n", i);
+		}
+	}
+}
+
 void on_accept(int fd, short ev, void* arg) 
 {
 	int client_fd;
 	struct sockaddr_in client_addr;
 	socklen_t client_len = sizeof(client_addr);
-	workqueue_t* workqueue = (workqueue_t*)arg;
+	reactor_t* reactor;
 	client_t* client;
-	job_t *job;
 
 	client_fd = accept(fd, (struct sockaddr*)&client_addr, &client_len);
 	if (client_fd < 0) 
@@ -166,43 +297,16 @@ void on_accept(int fd, short ev, void* arg)
 	memset(client, 0, sizeof(*client));
 	client->fd = client_fd;
 
+	reactor = reactor_select();
+	__sync_fetch_and_add(&reactor->nclients, 1);
+	client->evbase = reactor->evbase;
+	client->reactor = reactor;
 
-	if ((client->output_buffer = evbuffer_new()) == NULL) 
+	if (event_base_run_in_loop(reactor->evbase, reactor_add_client, client)) 
 	{
-		warn("client output buffer allocation failed");
+		warn("failed to hand client to reactor");
 		closeAndFreeClient(client);
-		return;
 	}
-
-	if ((client->evbase = event_base_new()) == NULL) 
-	{
-		warn("client event_base creation failed");
-		closeAndFreeClient(client);
-		return;
-	}
-
-	if ((client->buf_ev = bufferevent_new(client_fd, buffered_on_read, buffered_on_write, buffered_on_error, client)) == NULL) 
-	{
-		warn("client bufferevent creation failed");
-		closeAndFreeClient(client);
-		return;
-	}
-	bufferevent_base_set(client->evbase, client->buf_ev);
-
-	bufferevent_settimeout(client->buf_ev, SOCKET_READ_TIMEOUT_SECONDS, SOCKET_WRITE_TIMEOUT_SECONDS);
-
-	bufferevent_enable(client->buf_ev, EV_READ);
-
-	if ((job = (job_t*)malloc(sizeof(*job))) == NULL) 
-	{
-		warn("failed to allocate memory for job state");
-		closeAndFreeClient(client);
-		return;
-	}
-	job->job_function = server_job_function;
-	job->user_data = client;
-
-	workqueue_add_job(workqueue, job);
 }
 
 int runServer(void) 
@@ -211,6 +315,7 @@ int runServer(void)
 	struct sockaddr_in listen_addr;
 	struct event ev_accept;
 	int reuseaddr_on;
+	int nthreads;
 
 	event_init();
 
@@ -222,6 +327,8 @@ int runServer(void)
 		siginfo.sa_flags = SA_RESTART,
 		sigaction(SIGINT, &siginfo, NULL);
 	sigaction(SIGTERM, &siginfo, NULL);
+	siginfo.sa_handler = reloadhandler;
+	sigaction(SIGUSR1, &siginfo, NULL);
 
 	listenfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (listenfd < 0) 
@@ -232,6 +339,8 @@ int runServer(void)
 	listen_addr.sin_family = AF_INET;
 	listen_addr.sin_addr.s_addr = INADDR_ANY;
 	listen_addr.sin_port = htons(SERVER_PORT);
+	reuseaddr_on = 1;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_on, sizeof(reuseaddr_on));
 	if (bind(listenfd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) 
 	{
 		err(1, "bind failed");
@@ -240,8 +349,6 @@ int runServer(void)
 	{
 		err(1, "listen failed");
 	}
-	reuseaddr_on = 1;
-	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_on, sizeof(reuseaddr_on));
 
 	if (setnonblock(listenfd) < 0) 
 	{
@@ -255,7 +362,12 @@ int runServer(void)
 		return 1;
 	}
 
-	if (workqueue_init(&workqueue, NUM_THREADS)) 
+	if ((nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1) 
+	{
+		nthreads = NUM_THREADS;
+	}
+
+	if (workqueue_init(&workqueue, nthreads)) 
 	{
 		perror("Failed to create work queue");
 		close(listenfd);
@@ -263,7 +375,16 @@ int runServer(void)
 		return 1;
 	}
 
-	event_set(&ev_accept, listenfd, EV_READ | EV_PERSIST, on_accept, (void*)&workqueue);
+	if (reactors_init(nthreads)) 
+	{
+		perror("Failed to create reactors");
+		close(listenfd);
+		reactors_stop();
+		workqueue_shutdown(&workqueue);
+		return 1;
+	}
+
+	event_set(&ev_accept, listenfd, EV_READ | EV_PERSIST, on_accept, NULL);
 	event_base_set(evbase_accept, &ev_accept);
 	event_add(&ev_accept, NULL);
 
@@ -284,10 +405,12 @@ int runServer(void)
 void killServer(void) 
 {
 	fprintf(stdout, "Stopping socket listener event loop.\n");
-	if (event_base_loopexit(evbase_accept, NULL)) 
+	if (event_base_loopbreak(evbase_accept)) 
 	{
 		perror("Error shutting down server");
 	}
+	fprintf(stdout, "Stopping reactors.\n");
+	reactors_stop();
 	fprintf(stdout, "Stopping workers.\n");
 	workqueue_shutdown(&workqueue);
 }
@@ -298,6 +421,42 @@ static void sighandler(int signal)
 	killServer();
 }
 
+/*
+ * bin/reload writes "debug", "error" or "off" to LOG_LEVEL_FILE and sends
+ * SIGUSR1; only async-signal-safe calls are made here.
+ */
+static void reloadhandler(int signal) 
+{
+	char level[16];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(LOG_LEVEL_FILE, O_RDONLY)) < 0)
+	{
+		return;
+	}
+	n = read(fd, level, sizeof(level) - 1);
+	close(fd);
+	if (n <= 0)
+	{
+		return;
+	}
+	level[n] = '\0';
+
+	if (strncmp(level, "debug", 5) == 0)
+	{
+		LogSetLevel(DEBUG);
+	}
+	else if (strncmp(level, "error", 5) == 0)
+	{
+		LogSetLevel(ERROR);
+	}
+	else if (strncmp(level, "off", 3) == 0)
+	{
+		LogSetLevel(LOG_LEVEL_OFF);
+	}
+}
+
 int main(int argc, char** argv) 
 {
 	LogInit("server", 20000000, 10);
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include "log.hpp"
+#include "buffer.hpp"
+
+
+/*
+ * Segmented evbuffer benchmarks.
+ *
+ * Backlog: 1000-byte appends each followed by a 1000-byte drain, behind a
+ * backlog that stays queued the whole time, as on a connection whose peer
+ * reads slowly. Reported: ns per append+drain. The reference is the
+ * contiguous buffer this tree used before segments, which realigns the
+ * whole backlog with memmove once the front is used up.
+ *
+ * Broadcast: one 64 KB payload queued to many client buffers, copied with
+ * evbuffer_add or shared with evbuffer_add_reference, then each buffer
+ * written to a socketpair. Reported: us per client.
+ *
+ * File: a 16 MB file served over a socketpair, either read into the
+ * buffer 64 KB at a time and written out, or queued whole with
+ * evbuffer_add_file and sent with sendfile. Reported: ms and syscalls.
+ *
+ *   make bench_buffer && ./bench_buffer [ops] [clients]
+ */
+
+struct ref_buffer
+{
+	u_char* orig_buffer;
+	u_char* buffer;
+	size_t misalign;
+	size_t totallen;
+	size_t off;
+};
+
+static void ref_align(struct ref_buffer* buf)
+{
+	memmove(buf->orig_buffer, buf->buffer, buf->off);
+	buf->buffer = buf->orig_buffer;
+	buf->misalign = 0;
+}
+
+static int ref_expand(struct ref_buffer* buf, size_t datlen)
+{
+	size_t need = buf->misalign + buf->off + datlen;
+	if (buf->totallen >= need)
+	{
+		return 0;
+	}
+	if (buf->misalign >= datlen)
+	{
+		ref_align(buf);
+	}
+	else
+	{
+		u_char* newbuf;
+		size_t length = buf->totallen;
+		if (length < 256)
+		{
+			length = 256;
+		}
+		while (length < need)
+		{
+			length <<= 1;
+		}
+		if (buf->orig_buffer != buf->buffer)
+		{
+			ref_align(buf);
+		}
+		if ((newbuf = (u_char*)realloc(buf->buffer, length)) == NULL)
+		{
+			return -1;
+		}
+		buf->orig_buffer = buf->buffer = newbuf;
+		buf->totallen = length;
+	}
+	return 0;
+}
+
+static int ref_add(struct ref_buffer* buf, const void* data, size_t datlen)
+{
+	if (buf->totallen < buf->misalign + buf->off + datlen && ref_expand(buf, datlen) == -1)
+	{
+		return -1;
+	}
+	memcpy(buf->buffer + buf->off, data, datlen);
+	buf->off += datlen;
+	return 0;
+}
+
+static void ref_drain(struct ref_buffer* buf, size_t len)
+{
+	if (len >= buf->off)
+	{
+		buf->off = 0;
+		buf->buffer = buf->orig_buffer;
+		buf->misalign = 0;
+		return;
+	}
+	buf->buffer += len;
+	buf->misalign += len;
+	buf->off -= len;
+}
+
+static double now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define PAYLOAD_SIZE	(64 << 10)
+
+/* queues the payload to every buffer, then writes each out through the socketpair */
+static void broadcast(struct evbuffer** bufs, int nclients, const u_char* payload, int reference, int fds[2], double* queue_us, double* total_us)
+{
+	static u_char sink[PAYLOAD_SIZE];
+	double t0, t1, t2;
+
+	t0 = now_nsec();
+	for (int i = 0; i < nclients; ++i)
+	{
+		if (reference)
+		{
+			evbuffer_add_reference(bufs[i], payload, PAYLOAD_SIZE, NULL, NULL);
+		}
+		else
+		{
+			evbuffer_add(bufs[i], payload, PAYLOAD_SIZE);
+		}
+	}
+	t1 = now_nsec();
+	for (int i = 0; i < nclients; ++i)
+	{
+		while (bufs[i]->off > 0)
+		{
+			int n = evbuffer_write(bufs[i], fds[0]);
+			while (n > 0)
+			{
+				n -= read(fds[1], sink, n < PAYLOAD_SIZE ? n : PAYLOAD_SIZE);
+			}
+		}
+	}
+	t2 = now_nsec();
+	*queue_us = (t1 - t0) / nclients / 1000;
+	*total_us = (t2 - t0) / nclients / 1000;
+}
+
+#define FILE_SIZE	(16 << 20)
+#define FILE_READ	(64 << 10)
+
+/* reads whatever the socket holds; the benchmark only needs it drained */
+static size_t sink_all(int fd)
+{
+	static u_char sink[1 << 20];
+	size_t total = 0;
+	ssize_t n;
+
+	while ((n = read(fd, sink, sizeof(sink))) > 0)
+	{
+		total += n;
+	}
+	return total;
+}
+
+/* returns ms; *nsys counts the read, write and sendfile calls that moved data */
+static double serve_file(int file_fd, int use_sendfile, int fds[2], int* nsys)
+{
+	static u_char chunk[FILE_READ];
+	struct evbuffer* buf = evbuffer_new();
+	size_t received = 0;
+	off_t pos = 0;
+	double t0 = now_nsec();
+
+	*nsys = 0;
+	if (use_sendfile)
+	{
+		evbuffer_add_file(buf, dup(file_fd), 0, FILE_SIZE);
+	}
+	while (received < FILE_SIZE)
+	{
+		if (!use_sendfile && buf->off == 0 && pos < FILE_SIZE)
+		{
+			ssize_t n = pread(file_fd, chunk, FILE_READ, pos);
+			evbuffer_add(buf, chunk, n);
+			pos += n;
+			++*nsys;
+		}
+		if (buf->off > 0)
+		{
+			if (evbuffer_write(buf, fds[0]) > 0)
+			{
+				++*nsys;
+			}
+		}
+		received += sink_all(fds[1]);
+	}
+	evbuffer_free(buf);
+	return (now_nsec() - t0) / 1e6;
+}
+
+static int bench_file(void)
+{
+	char path[] = "/tmp/bench_buffer.XXXXXX";
+	u_char* data = (u_char*)calloc(1, FILE_SIZE);
+	int file_fd = mkstemp(path);
+	int fds[2];
+	int nsys;
+
+	if (file_fd == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+	{
+		return (-1);
+	}
+	unlink(path);
+	if (write(file_fd, data, FILE_SIZE) != FILE_SIZE)
+	{
+		return (-1);
+	}
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	printf("\n%d MB file over a socketpair\n", FILE_SIZE >> 20);
+	for (int use_sendfile = 0; use_sendfile <= 1; ++use_sendfile)
+	{
+		double ms = serve_file(file_fd, use_sendfile, fds, &nsys);
+		printf("%-16s %6.2f ms  %6d syscalls\n", use_sendfile ? "add_file" : "read+add+write", ms, nsys);
+	}
+	close(file_fd);
+	close(fds[0]);
+	close(fds[1]);
+	free(data);
+	return (0);
+}
+
+int main(int argc, char* argv[])
+{
+	int ops = argc > 1 ? atoi(argv[1]) : 200000;
+	int nclients = argc > 2 ? atoi(argv[2]) : 1000;
+	char chunk[1000];
+	u_char* payload = (u_char*)malloc(PAYLOAD_SIZE);
+	struct evbuffer** bufs = (struct evbuffer**)malloc(nclients * sizeof(*bufs));
+	int size = 1 << 20;
+	int fds[2];
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	memset(chunk, 'b', sizeof(chunk));
+	printf("%d appends of %zu B, each followed by a drain of as much, ns per pair\n", ops, sizeof(chunk));
+	printf("backlog   contiguous   segmented\n");
+
+	for (int mb = 0; mb <= 4; ++mb)
+	{
+		size_t backlog = (size_t)mb << 20;
+		struct ref_buffer ref;
+		struct evbuffer* buf = evbuffer_new();
+		double t0, t1, t2;
+
+		/* the backlog goes in first; the drains then eat into it while the appends keep it at size */
+		memset(&ref, 0, sizeof(ref));
+		for (size_t n = 0; n < backlog; n += sizeof(chunk))
+		{
+			ref_add(&ref, chunk, sizeof(chunk));
+			evbuffer_add(buf, chunk, sizeof(chunk));
+		}
+
+		t0 = now_nsec();
+		for (int i = 0; i < ops; ++i)
+		{
+			ref_add(&ref, chunk, sizeof(chunk));
+			ref_drain(&ref, sizeof(chunk));
+		}
+		t1 = now_nsec();
+		for (int i = 0; i < ops; ++i)
+		{
+			evbuffer_add(buf, chunk, sizeof(chunk));
+			evbuffer_drain(buf, sizeof(chunk));
+		}
+		t2 = now_nsec();
+		printf("%d MB    %10.1f  %10.1f\n", mb, (t1 - t0) / ops, (t2 - t1) / ops);
+
+		free(ref.orig_buffer);
+		evbuffer_free(buf);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+	{
+		return (1);
+	}
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	memset(payload, 'p', PAYLOAD_SIZE);
+	for (int i = 0; i < nclients; ++i)
+	{
+		bufs[i] = evbuffer_new();
+	}
+	printf("\n%d KB payload to %d clients, us per client\n", PAYLOAD_SIZE >> 10, nclients);
+	printf("             queue   queue+write\n");
+	for (int reference = 0; reference <= 1; ++reference)
+	{
+		double queue_us, total_us;
+		broadcast(bufs, nclients, payload, reference, fds, &queue_us, &total_us);
+		printf("%-10s %7.2f   %7.2f\n", reference ? "reference" : "copy", queue_us, total_us);
+	}
+
+	for (int i = 0; i < nclients; ++i)
+	{
+		evbuffer_free(bufs[i]);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	free(bufs);
+	free(payload);
+
+	return (bench_file() == -1 ? 1 : 0);
+}
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "log.hpp"
+#include "event.hpp"
+
+
+/*
+ * Cold-cache dispatch benchmark for the struct event layout. N events,
+ * each in its own 512-byte holder as it would be inside a connection
+ * object, are spread over N/2 fds with a read and a write event each.
+ * Every round evicts the caches, readies random fds and runs the
+ * callbacks through a replica of the dispatch path: the field accesses of
+ * evmap_io_active, event_active and event_process_queue, run once on the
+ * layout before the hot/cold split and once on the current one.
+ *
+ * malloc only guarantees 16 bytes, so an event can start at any 16-byte
+ * offset within a cache line; every offset is measured. Reported per
+ * activated event: cache lines the path touches, L1D read misses when the
+ * kernel exposes hardware counters, and ns.
+ *
+ *   make bench_event && ./bench_event [nevents] [per round] [rounds]
+ */
+
+#define CACHELINE	64
+
+/* the layout before the hot/cold split */
+struct old_event
+{
+	struct { struct old_event* tqe_next; struct old_event** tqe_prev; } ev_next;
+	struct { struct old_event* tqe_next; struct old_event** tqe_prev; } ev_active_next;
+	struct { struct old_event* tqe_next; struct old_event** tqe_prev; } ev_signal_next;
+	struct { struct old_event* tqe_next; struct old_event** tqe_prev; } ev_timeout_next;
+	struct old_event* ev_io_next;
+	unsigned int min_heap_idx;
+	struct event_base* ev_base;
+	int ev_fd;
+	short ev_events;
+	short ev_ncalls;
+	short* ev_pncalls;
+	struct timeval ev_timeout;
+	int ev_pri;
+	void (*ev_callback)(int, short, void*);
+	void* ev_arg;
+	int ev_res;
+	int ev_flags;
+};
+
+/* the current layout, checked against struct event so the two cannot drift */
+struct new_event
+{
+	struct { struct new_event* tqe_next; struct new_event** tqe_prev; } ev_active_next;
+	void (*ev_callback)(int, short, void*);
+	void* ev_arg;
+	struct event_base* ev_base;
+	struct new_event* ev_io_next;
+	int ev_fd;
+	short ev_events;
+	short ev_ncalls;
+	short ev_res;
+	short ev_pri;
+	int ev_flags;
+	unsigned int min_heap_idx;
+	struct timeval ev_timeout;
+	struct { struct new_event* tqe_next; struct new_event** tqe_prev; } ev_timeout_next;
+	struct { struct new_event* tqe_next; struct new_event** tqe_prev; } ev_next;
+	struct { struct new_event* tqe_next; struct new_event** tqe_prev; } ev_signal_next;
+	short* ev_pncalls;	/* unused: the running count lives in the base */
+};
+
+static_assert(offsetof(struct new_event, ev_io_next) == offsetof(struct event, ev_io_next), "new_event is out of date");
+static_assert(offsetof(struct new_event, ev_flags) == offsetof(struct event, ev_flags), "new_event is out of date");
+static_assert(offsetof(struct new_event, min_heap_idx) == offsetof(struct event, min_heap_idx), "new_event is out of date");
+static_assert(offsetof(struct new_event, ev_signal_next) == offsetof(struct event, ev_signal_next), "new_event is out of date");
+
+template <class E>
+struct replica
+{
+	E** fds;
+	E* active_first;
+	E** active_last;
+	int has_pncalls;
+};
+
+static unsigned long long ncallbacks;
+
+static void bench_cb(int fd, short what, void* arg)
+{
+	++ncallbacks;
+}
+
+/* event_active */
+template <class E>
+static inline void replica_activate(struct replica<E>* r, E* ev, short res)
+{
+	if (ev->ev_flags & EVLIST_ACTIVE)
+	{
+		ev->ev_res |= res;
+		return;
+	}
+	ev->ev_res = res;
+	ev->ev_ncalls = 1;
+	if (r->has_pncalls)
+	{
+		ev->ev_pncalls = NULL;
+	}
+	ev->ev_flags |= EVLIST_ACTIVE;
+	ev->ev_active_next.tqe_next = NULL;
+	ev->ev_active_next.tqe_prev = r->active_last;
+	*r->active_last = ev;
+	r->active_last = &ev->ev_active_next.tqe_next;
+}
+
+/* evmap_io_active followed by event_process_queue */
+template <class E>
+static void replica_round(struct replica<E>* r, const int* ready, int nready)
+{
+	E* ev;
+
+	for (int i = 0; i < nready; ++i)
+	{
+		for (ev = r->fds[ready[i]]; ev != NULL; ev = ev->ev_io_next)
+		{
+			if (ev->ev_base != NULL && (ev->ev_events & (EV_READ | EV_WRITE)))
+			{
+				replica_activate(r, ev, ev->ev_events & (EV_READ | EV_WRITE));
+			}
+		}
+	}
+	while ((ev = r->active_first) != NULL)
+	{
+		short ncalls;
+		if (ev->ev_active_next.tqe_next != NULL)
+		{
+			ev->ev_active_next.tqe_next->ev_active_next.tqe_prev = ev->ev_active_next.tqe_prev;
+		}
+		else
+		{
+			r->active_last = ev->ev_active_next.tqe_prev;
+		}
+		*ev->ev_active_next.tqe_prev = ev->ev_active_next.tqe_next;
+		ev->ev_flags &= ~EVLIST_ACTIVE;
+		ncalls = ev->ev_ncalls;
+		if (r->has_pncalls)
+		{
+			ev->ev_pncalls = &ncalls;
+		}
+		while (ncalls)
+		{
+			ev->ev_ncalls = --ncalls;
+			(*ev->ev_callback)(ev->ev_fd, ev->ev_res, ev->ev_arg);
+		}
+	}
+}
+
+/* distinct cache lines under the fields the replica touches, for an event at this offset */
+template <class E>
+static int lines_touched(size_t shift, int has_pncalls)
+{
+	size_t fields[][2] = {
+		{ offsetof(E, ev_active_next), sizeof(((E*)0)->ev_active_next) },
+		{ offsetof(E, ev_callback), sizeof(void*) },
+		{ offsetof(E, ev_arg), sizeof(void*) },
+		{ offsetof(E, ev_base), sizeof(void*) },
+		{ offsetof(E, ev_io_next), sizeof(void*) },
+		{ offsetof(E, ev_fd), sizeof(int) },
+		{ offsetof(E, ev_events), sizeof(short) },
+		{ offsetof(E, ev_ncalls), sizeof(short) },
+		{ offsetof(E, ev_res), sizeof(((E*)0)->ev_res) },
+		{ offsetof(E, ev_flags), sizeof(int) },
+		{ offsetof(E, ev_pncalls), sizeof(void*) },
+	};
+	unsigned long long mask = 0;
+	int n = 0;
+
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]) - (has_pncalls ? 0 : 1); ++i)
+	{
+		for (size_t b = fields[i][0]; b < fields[i][0] + fields[i][1]; ++b)
+		{
+			mask |= 1ULL << ((shift + b) / CACHELINE);
+		}
+	}
+	for (; mask; mask &= mask - 1)
+	{
+		++n;
+	}
+	return n;
+}
+
+static int perf_open_l1d_misses(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void evict(char* junk, size_t size)
+{
+	for (size_t i = 0; i < size; i += CACHELINE)
+	{
+		junk[i] += 1;
+	}
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+struct result
+{
+	double ns;
+	double misses;
+};
+
+/* events at byte shift from a line boundary inside malloc'd 512-byte holders; returns medians per activated event */
+template <class E>
+static struct result run(int n, int per_round, int rounds, size_t shift, int has_pncalls, int perf_fd, char* junk, size_t junk_size)
+{
+	struct replica<E> r;
+	char** holders = (char**)malloc(n * sizeof(char*));
+	int* ready = (int*)malloc(per_round / 2 * sizeof(int));
+	double* ns = (double*)malloc(rounds * sizeof(double));
+	double* misses = (double*)malloc(rounds * sizeof(double));
+	struct result res;
+	int nfds = n / 2;
+
+	memset(&r, 0, sizeof(r));
+	r.fds = (E**)calloc(nfds, sizeof(E*));
+	r.active_last = &r.active_first;
+	r.has_pncalls = has_pncalls;
+	for (int i = 0; i < n; ++i)
+	{
+		E* ev;
+		char* line;
+		if ((holders[i] = (char*)malloc(512 + CACHELINE)) == NULL)
+		{
+			exit(1);
+		}
+		memset(holders[i], 0, 512 + CACHELINE);
+		line = (char*)(((uintptr_t)holders[i] + CACHELINE - 1) & ~(uintptr_t)(CACHELINE - 1));
+		ev = (E*)(line + shift);
+		ev->ev_fd = i / 2;
+		ev->ev_events = ((i & 1) ? EV_WRITE : EV_READ) | EV_PERSIST;
+		ev->ev_callback = bench_cb;
+		ev->ev_base = (struct event_base*)&r;
+		ev->ev_flags = EVLIST_INIT | EVLIST_INSERTED;
+		ev->ev_io_next = r.fds[i / 2];
+		r.fds[i / 2] = ev;
+	}
+
+	srand(1);
+	for (int k = 0; k < rounds; ++k)
+	{
+		long long count = 0;
+		double t0;
+
+		for (int i = 0; i < per_round / 2; ++i)
+		{
+			ready[i] = rand() % nfds;
+		}
+		evict(junk, junk_size);
+		if (perf_fd != -1)
+		{
+			ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		t0 = now_nsec();
+		replica_round(&r, ready, per_round / 2);
+		ns[k] = (now_nsec() - t0) / (per_round & ~1);
+		if (perf_fd != -1)
+		{
+			ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+			{
+				count = 0;
+			}
+		}
+		misses[k] = (double)count / (per_round & ~1);
+	}
+	qsort(ns, rounds, sizeof(double), cmp_double);
+	qsort(misses, rounds, sizeof(double), cmp_double);
+	res.ns = ns[rounds / 2];
+	res.misses = misses[rounds / 2];
+
+	for (int i = 0; i < n; ++i)
+	{
+		free(holders[i]);
+	}
+	free(holders);
+	free(r.fds);
+	free(ready);
+	free(ns);
+	free(misses);
+	return res;
+}
+
+int main(int argc, char* argv[])
+{
+	int n = argc > 1 ? atoi(argv[1]) : 100000;
+	int per_round = argc > 2 ? atoi(argv[2]) : 10000;
+	int rounds = argc > 3 ? atoi(argv[3]) : 21;
+	size_t junk_size = 64 << 20;
+	char* junk = (char*)calloc(1, junk_size);
+	int perf_fd = perf_open_l1d_misses();
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	printf("%d events on %d fds, %d per round, median of %d rounds\n", n, n / 2, per_round & ~1, rounds);
+	printf("sizeof: old layout %zu, struct event %zu\n", sizeof(struct old_event), sizeof(struct event));
+	if (perf_fd == -1)
+	{
+		printf("no hardware cache counters here, L1D misses not counted\n");
+	}
+	printf("offset   lines old/new   L1D misses old/new   ns old/new\n");
+	for (size_t shift = 0; shift < CACHELINE; shift += 16)
+	{
+		struct result o = run<struct old_event>(n, per_round, rounds, shift, 1, perf_fd, junk, junk_size);
+		struct result w = run<struct new_event>(n, per_round, rounds, shift, 0, perf_fd, junk, junk_size);
+		printf("%4zu     %5d / %-5d", shift, lines_touched<struct old_event>(shift, 1), lines_touched<struct new_event>(shift, 0));
+		if (perf_fd != -1)
+		{
+			printf("     %6.2f / %-6.2f   ", o.misses, w.misses);
+		}
+		else
+		{
+			printf("          - / -         ");
+		}
+		printf("%6.1f / %-6.1f\n", o.ns, w.ns);
+	}
+	printf("(%llu callbacks)\n", ncallbacks);
+
+	if (perf_fd != -1)
+	{
+		close(perf_fd);
+	}
+	free(junk);
+	return (0);
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "log.hpp"
+#include "event.hpp"
+#include "minheap.hpp"
+
+
+/*
+ * Timer heap benchmark: N timers with random deadlines are pushed, half of
+ * them erased in random order, and the rest popped. Each event sits in its
+ * own 512-byte holder, as it would inside a connection object, so the
+ * binary heap pays for dereferencing events during sifts.
+ *
+ * The reference is the binary heap this tree used before the 4-ary one.
+ *
+ *   make bench_minheap && ./bench_minheap [ntimers]
+ */
+
+struct holder
+{
+	struct event ev;
+	char pad[512 - sizeof(struct event)];
+};
+
+struct ref_heap
+{
+	struct event** p;
+	unsigned n;
+	unsigned a;
+};
+
+static int ref_greater(struct event* a, struct event* b)
+{
+	return timercmp(&a->ev_timeout, &b->ev_timeout, >);
+}
+
+static void ref_shift_up(struct ref_heap* s, unsigned hole_index, struct event* e)
+{
+	unsigned parent = (hole_index - 1) / 2;
+	while (hole_index && ref_greater(s->p[parent], e))
+	{
+		(s->p[hole_index] = s->p[parent])->min_heap_idx = hole_index;
+		hole_index = parent;
+		parent = (hole_index - 1) / 2;
+	}
+	(s->p[hole_index] = e)->min_heap_idx = hole_index;
+}
+
+static void ref_shift_down(struct ref_heap* s, unsigned hole_index, struct event* e)
+{
+	unsigned min_child = 2 * (hole_index + 1);
+	while (min_child <= s->n)
+	{
+		min_child -= min_child == s->n || ref_greater(s->p[min_child], s->p[min_child - 1]);
+		if (!ref_greater(e, s->p[min_child]))
+		{
+			break;
+		}
+		(s->p[hole_index] = s->p[min_child])->min_heap_idx = hole_index;
+		hole_index = min_child;
+		min_child = 2 * (hole_index + 1);
+	}
+	ref_shift_up(s, hole_index, e);
+}
+
+static void ref_push(struct ref_heap* s, struct event* e)
+{
+	if (s->n == s->a)
+	{
+		s->a = s->a ? s->a * 2 : 8;
+		s->p = (struct event**)realloc(s->p, s->a * sizeof(*s->p));
+	}
+	ref_shift_up(s, s->n++, e);
+}
+
+static struct event* ref_pop(struct ref_heap* s)
+{
+	struct event* e = *s->p;
+	ref_shift_down(s, 0u, s->p[--s->n]);
+	e->min_heap_idx = -1;
+	return e;
+}
+
+static void ref_erase(struct ref_heap* s, struct event* e)
+{
+	struct event* last = s->p[--s->n];
+	unsigned parent = (e->min_heap_idx - 1) / 2;
+	if (e->min_heap_idx > 0 && ref_greater(s->p[parent], last))
+	{
+		ref_shift_up(s, e->min_heap_idx, last);
+	}
+	else
+	{
+		ref_shift_down(s, e->min_heap_idx, last);
+	}
+	e->min_heap_idx = -1;
+}
+
+static double now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void shuffle(struct holder** v, int n)
+{
+	for (int i = n - 1; i > 0; --i)
+	{
+		int j = rand() % (i + 1);
+		struct holder* t = v[i];
+		v[i] = v[j];
+		v[j] = t;
+	}
+}
+
+static void setup(struct holder** v, int n)
+{
+	srand(1);
+	for (int i = 0; i < n; ++i)
+	{
+		v[i]->ev.ev_timeout.tv_sec = rand() % 3600;
+		v[i]->ev.ev_timeout.tv_usec = rand() % 1000000;
+		v[i]->ev.min_heap_idx = -1;
+	}
+	/* insert in a different order from the one the events sit in memory */
+	shuffle(v, n);
+}
+
+int main(int argc, char* argv[])
+{
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	int half = n / 2;
+	struct holder** v = (struct holder**)malloc(n * sizeof(*v));
+	struct min_heap heap;
+	struct ref_heap ref;
+	double t0, t1, t2, t3;
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	for (int i = 0; i < n; ++i)
+	{
+		v[i] = (struct holder*)calloc(1, sizeof(struct holder));
+	}
+	printf("%d timers, ns per operation\n", n);
+
+	setup(v, n);
+	memset(&ref, 0, sizeof(ref));
+	t0 = now_nsec();
+	for (int i = 0; i < n; ++i)
+	{
+		ref_push(&ref, &v[i]->ev);
+	}
+	t1 = now_nsec();
+	shuffle(v, n);
+	for (int i = 0; i < half; ++i)
+	{
+		ref_erase(&ref, &v[i]->ev);
+	}
+	t2 = now_nsec();
+	while (ref.n)
+	{
+		ref_pop(&ref);
+	}
+	t3 = now_nsec();
+	printf("binary heap:  push %7.1f  erase %7.1f  pop %7.1f\n", (t1 - t0) / n, (t2 - t1) / half, (t3 - t2) / (n - half));
+	free(ref.p);
+
+	setup(v, n);
+	min_heap_ctor(&heap);
+	t0 = now_nsec();
+	for (int i = 0; i < n; ++i)
+	{
+		min_heap_push(&heap, &v[i]->ev);
+	}
+	t1 = now_nsec();
+	shuffle(v, n);
+	for (int i = 0; i < half; ++i)
+	{
+		min_heap_erase(&heap, &v[i]->ev);
+	}
+	t2 = now_nsec();
+	while (!min_heap_empty(&heap))
+	{
+		min_heap_pop(&heap);
+	}
+	t3 = now_nsec();
+	printf("4-ary heap:   push %7.1f  erase %7.1f  pop %7.1f\n", (t1 - t0) / n, (t2 - t1) / half, (t3 - t2) / (n - half));
+	min_heap_dtor(&heap);
+
+	for (int i = 0; i < n; ++i)
+	{
+		free(v[i]);
+	}
+	free(v);
+	return (0);
+}
@@ -0,0 +1,839 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <string>
+#include "log.hpp"
+#include "buffer.hpp"
+
+
+/*
+ * Segmented evbuffer: a randomized run against a std::string model,
+ * reference segments, peek and reserve/commit, vectored I/O over a
+ * socketpair, read sizing, moving segments between buffers and file
+ * segments.
+ */
+
+#define CHECK(cond) \
+	do { if (!(cond)) { printf("[line %d] check failed: %s\n", __LINE__, #cond); return (-1); } } while (0)
+
+#define MODEL_OPS	20000
+/* past this the next operation is a drain, so verifying stays cheap */
+#define MODEL_MAX	(64 << 10)
+
+/* the chain must hold exactly the model's bytes, with off and last consistent */
+static int model_verify(struct evbuffer* buf, const std::string& model)
+{
+	struct evbuffer_chain* chain;
+	size_t pos = 0;
+
+	CHECK(buf->off == model.size());
+	for (chain = buf->first; chain != NULL; chain = chain->next)
+	{
+		CHECK(pos + chain->off <= model.size());
+		if (chain->flags & EVBUFFER_FILE)
+		{
+			std::string range(chain->off, '\0');
+			CHECK(!(chain->flags & EVBUFFER_PIPE));
+			CHECK(pread(chain->fd, &range[0], chain->off, chain->misalign) == (ssize_t)chain->off);
+			CHECK(memcmp(range.data(), model.data() + pos, chain->off) == 0);
+		}
+		else
+		{
+			CHECK(memcmp(chain->buffer + chain->misalign, model.data() + pos, chain->off) == 0);
+		}
+		pos += chain->off;
+		if (chain->next == NULL)
+		{
+			CHECK(buf->last == chain);
+		}
+	}
+	CHECK(pos == model.size());
+	return (0);
+}
+
+static void model_fill(u_char* data, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+	{
+		data[i] = (u_char)rand();
+	}
+}
+
+static int live_refs;
+
+static void ref_release(const void* data, size_t datlen, void* arg)
+{
+	--live_refs;
+	free((void*)data);
+}
+
+/* an unlinked temporary file holding len random bytes */
+static int model_file(u_char* data, size_t len)
+{
+	char path[] = "/tmp/test_buffer.XXXXXX";
+	int fd;
+
+	if ((fd = mkstemp(path)) == -1)
+	{
+		return (-1);
+	}
+	unlink(path);
+	model_fill(data, len);
+	if (write(fd, data, len) != (ssize_t)len)
+	{
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+static int test_model(void)
+{
+	struct evbuffer* buf;
+	struct evbuffer* side;
+	std::string model;
+	std::string side_model;
+	static u_char data[3 * EVBUFFER_CHAIN_SIZE];
+	static u_char file_data[sizeof(data)];
+	int file_fd;
+
+	CHECK((buf = evbuffer_new()) != NULL && (side = evbuffer_new()) != NULL);
+	srand(21);
+	CHECK((file_fd = model_file(file_data, sizeof(file_data))) != -1);
+	for (int op = 0; op < MODEL_OPS; ++op)
+	{
+		size_t len = rand() % sizeof(data);
+		u_char* p;
+
+		size_t offset = rand() % sizeof(file_data);
+		int fd;
+
+		struct iovec vec[4];
+		int nvec;
+
+		switch (model.size() > MODEL_MAX ? 2 : rand() % 10)
+		{
+		case 0:
+			model_fill(data, len);
+			CHECK(evbuffer_add(buf, data, len) == 0);
+			model.append((const char*)data, len);
+			break;
+		case 1:
+			CHECK(evbuffer_remove(buf, data, len) == (int)(len < model.size() ? len : model.size()));
+			CHECK(memcmp(data, model.data(), len < model.size() ? len : model.size()) == 0);
+			model.erase(0, len);
+			break;
+		case 2:
+			CHECK(evbuffer_drain(buf, len) == 0);
+			model.erase(0, len);
+			break;
+		case 3:
+			p = evbuffer_pullup(buf, len);
+			if (len > model.size())
+			{
+				CHECK(p == NULL);
+				break;
+			}
+			CHECK(len == 0 || (p != NULL && memcmp(p, model.data(), len) == 0));
+			break;
+		case 4:
+			model_fill(data, len);
+			CHECK(evbuffer_add(side, data, len) == 0);
+			side_model.append((const char*)data, len);
+			if (rand() % 2)
+			{
+				CHECK(evbuffer_add_buffer(buf, side) == 0);
+				model += side_model;
+				side_model.clear();
+				CHECK(model_verify(side, side_model) == 0);
+			}
+			break;
+		case 5:
+			CHECK(evbuffer_expand(buf, len) == 0);
+			CHECK(buf->last != NULL && buf->last->buffer_len - buf->last->misalign - buf->last->off >= len);
+			break;
+		case 6:
+			/* references go in whole and are released exactly once */
+			if ((p = (u_char*)malloc(len + 1)) == NULL)
+			{
+				break;
+			}
+			model_fill(p, len);
+			model.append((const char*)p, len);
+			++live_refs;
+			CHECK(evbuffer_add_reference(buf, p, len, ref_release, NULL) == 0);
+			break;
+		case 7:
+			/* a range of the file, on a dup the buffer will own */
+			len %= sizeof(file_data) - offset + 1;
+			CHECK((fd = dup(file_fd)) != -1);
+			CHECK(evbuffer_add_file(buf, fd, offset, len) == 0);
+			model.append((const char*)file_data + offset, len);
+			break;
+		case 8:
+			/* reserve in one or two pieces and commit part of it */
+			nvec = evbuffer_reserve_space(buf, len, vec, 1 + rand() % 2);
+			CHECK(nvec == 1 || nvec == 2);
+			CHECK(vec[0].iov_len + (nvec == 2 ? vec[1].iov_len : 0) >= len);
+			len = rand() % (len + 1);
+			for (int i = 0; i < nvec; ++i)
+			{
+				vec[i].iov_len = len < vec[i].iov_len ? len : vec[i].iov_len;
+				model_fill((u_char*)vec[i].iov_base, vec[i].iov_len);
+				model.append((const char*)vec[i].iov_base, vec[i].iov_len);
+				len -= vec[i].iov_len;
+			}
+			CHECK(evbuffer_commit_space(buf, vec, nvec) == 0);
+			break;
+		case 9:
+			/* peek at the head through a few iovecs; reads in any file segments it covers */
+			nvec = evbuffer_peek(buf, len, vec, 4);
+			CHECK(nvec >= 0);
+			offset = 0;
+			for (int i = 0; i < nvec && i < 4; ++i)
+			{
+				CHECK(memcmp(vec[i].iov_base, model.data() + offset, vec[i].iov_len) == 0);
+				offset += vec[i].iov_len;
+			}
+			CHECK(nvec > 4 || offset == (len < model.size() ? len : model.size()));
+			break;
+		}
+		CHECK(model_verify(buf, model) == 0);
+	}
+
+	evbuffer_free(buf);
+	evbuffer_free(side);
+	close(file_fd);
+	CHECK(live_refs == 0);
+	return (0);
+}
+
+static int set_nonblock(int fd)
+{
+	return (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+}
+
+struct ref_record
+{
+	const void* data;
+	size_t datlen;
+	int calls;
+};
+
+static void ref_record_cb(const void* data, size_t datlen, void* arg)
+{
+	struct ref_record* rec = (struct ref_record*)arg;
+
+	rec->data = data;
+	rec->datlen = datlen;
+	++rec->calls;
+}
+
+/* cleanup runs once, with the original range, however the bytes leave the buffer */
+static int test_reference(void)
+{
+	struct evbuffer* buf;
+	struct ref_record rec;
+	char data[1000];
+	char copy[sizeof(data)];
+	char out[3 * sizeof(data)];
+	int fds[2];
+
+	CHECK((buf = evbuffer_new()) != NULL);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	memset(data, 'r', sizeof(data));
+	memcpy(copy, data, sizeof(data));
+
+	/* an empty reference is handed back at once */
+	memset(&rec, 0, sizeof(rec));
+	CHECK(evbuffer_add_reference(buf, data, 0, ref_record_cb, &rec) == 0);
+	CHECK(rec.calls == 1 && buf->off == 0);
+
+	/* drained in pieces, released on the last byte; later appends never land in it */
+	memset(&rec, 0, sizeof(rec));
+	CHECK(evbuffer_add_reference(buf, data, sizeof(data), ref_record_cb, &rec) == 0);
+	CHECK(evbuffer_add(buf, "tail", 4) == 0);
+	CHECK(memcmp(data, copy, sizeof(data)) == 0);
+	CHECK(evbuffer_drain(buf, 600) == 0);
+	CHECK(rec.calls == 0);
+	CHECK(evbuffer_drain(buf, 400) == 0);
+	CHECK(rec.calls == 1 && rec.data == data && rec.datlen == sizeof(data));
+	CHECK(buf->off == 4);
+	evbuffer_drain(buf, 4);
+
+	/* written to a socket */
+	memset(&rec, 0, sizeof(rec));
+	CHECK(evbuffer_add(buf, "head", 4) == 0);
+	CHECK(evbuffer_add_reference(buf, data, sizeof(data), ref_record_cb, &rec) == 0);
+	CHECK(evbuffer_write(buf, fds[0]) == 4 + (int)sizeof(data));
+	CHECK(rec.calls == 1 && rec.data == data && rec.datlen == sizeof(data));
+	CHECK(read(fds[1], out, sizeof(out)) == 4 + (ssize_t)sizeof(data));
+	CHECK(memcmp(out + 4, data, sizeof(data)) == 0);
+
+	/* copied out by a pullup across it */
+	memset(&rec, 0, sizeof(rec));
+	CHECK(evbuffer_add(buf, "head", 4) == 0);
+	CHECK(evbuffer_add_reference(buf, data, sizeof(data), ref_record_cb, &rec) == 0);
+	CHECK(evbuffer_pullup(buf, -1) != NULL);
+	CHECK(rec.calls == 1);
+	CHECK(memcmp(evbuffer_pullup(buf, -1) + 4, data, sizeof(data)) == 0);
+	evbuffer_drain(buf, buf->off);
+
+	/* still queued when the buffer goes */
+	memset(&rec, 0, sizeof(rec));
+	CHECK(evbuffer_add_reference(buf, data, sizeof(data), ref_record_cb, &rec) == 0);
+	evbuffer_free(buf);
+	CHECK(rec.calls == 1);
+
+	close(fds[0]);
+	close(fds[1]);
+	return (0);
+}
+
+static int test_peek(void)
+{
+	struct evbuffer* buf;
+	struct iovec vec[4];
+	char data[3 * EVBUFFER_CHAIN_SIZE];
+
+	CHECK((buf = evbuffer_new()) != NULL);
+	for (size_t i = 0; i < sizeof(data); ++i)
+	{
+		data[i] = (char)i;
+	}
+
+	/* an empty buffer needs no iovecs */
+	CHECK(evbuffer_peek(buf, -1, vec, 4) == 0);
+
+	/* three segments: the whole buffer, a short head, and more than there is */
+	for (int i = 0; i < 3; ++i)
+	{
+		CHECK(evbuffer_add(buf, data + i * EVBUFFER_CHAIN_SIZE, EVBUFFER_CHAIN_SIZE) == 0);
+	}
+	CHECK(evbuffer_peek(buf, -1, vec, 4) == 3);
+	CHECK(vec[0].iov_len + vec[1].iov_len + vec[2].iov_len == sizeof(data));
+	CHECK(memcmp(vec[0].iov_base, data, vec[0].iov_len) == 0);
+	CHECK(memcmp(vec[2].iov_base, data + vec[0].iov_len + vec[1].iov_len, vec[2].iov_len) == 0);
+	CHECK(evbuffer_peek(buf, 10, vec, 4) == 1);
+	CHECK(vec[0].iov_len == 10);
+	CHECK(evbuffer_peek(buf, sizeof(data) + 1, vec, 4) == 3);
+
+	/* fewer iovecs than needed: the count still covers the range, only n_vec are filled */
+	memset(vec, 0, sizeof(vec));
+	CHECK(evbuffer_peek(buf, -1, vec, 1) == 3);
+	CHECK(vec[0].iov_base == buf->first->buffer + buf->first->misalign);
+	CHECK(vec[1].iov_base == NULL);
+
+	/* nothing was drained */
+	CHECK(buf->off == sizeof(data));
+
+	evbuffer_free(buf);
+	return (0);
+}
+
+static int test_reserve_commit(void)
+{
+	struct evbuffer* buf;
+	struct iovec vec[2];
+	struct iovec stale;
+	size_t space;
+
+	CHECK((buf = evbuffer_new()) != NULL);
+	CHECK(evbuffer_reserve_space(buf, -1, vec, 1) == -1);
+	CHECK(evbuffer_reserve_space(buf, 10, vec, 0) == -1);
+
+	/* nothing is readable until the commit, and only what was written */
+	CHECK(evbuffer_reserve_space(buf, 100, vec, 1) == 1);
+	CHECK(vec[0].iov_len >= 100);
+	memcpy(vec[0].iov_base, "0123456789", 10);
+	CHECK(buf->off == 0);
+	vec[0].iov_len = 10;
+	CHECK(evbuffer_commit_space(buf, vec, 1) == 0);
+	CHECK(buf->off == 10);
+
+	/* a commit without a reservation, or a second one, is refused */
+	CHECK(evbuffer_commit_space(buf, vec, 1) == -1);
+	CHECK(buf->off == 10);
+
+	/* with two iovecs the tail's free space comes first, then one fresh segment */
+	space = buf->last->buffer_len - buf->last->misalign - buf->last->off;
+	CHECK(evbuffer_reserve_space(buf, space + 100, vec, 2) == 2);
+	CHECK(vec[0].iov_len == space && vec[1].iov_len >= 100);
+	memset(vec[0].iov_base, 'a', vec[0].iov_len);
+	memset(vec[1].iov_base, 'b', 100);
+	vec[1].iov_len = 100;
+	CHECK(evbuffer_commit_space(buf, vec, 2) == 0);
+	CHECK(buf->off == 10 + space + 100);
+	CHECK(memcmp(evbuffer_pullup(buf, -1) + 10 + space, "bbbb", 4) == 0);
+
+	/* trailing iovecs may be dropped; with one iovec the space is contiguous */
+	evbuffer_drain(buf, buf->off);
+	CHECK(evbuffer_add(buf, "x", 1) == 0);
+	CHECK(evbuffer_reserve_space(buf, 2 * EVBUFFER_CHAIN_SIZE, vec, 1) == 1);
+	CHECK(vec[0].iov_len >= 2 * EVBUFFER_CHAIN_SIZE);
+	vec[0].iov_len = 0;
+	CHECK(evbuffer_commit_space(buf, vec, 1) == 0);
+	CHECK(evbuffer_reserve_space(buf, 2 * EVBUFFER_CHAIN_SIZE, vec, 2) >= 1);
+	vec[0].iov_len = 1;
+	*(char*)vec[0].iov_base = 'y';
+	CHECK(evbuffer_commit_space(buf, vec, 1) == 0);
+	CHECK(buf->off == 2 && memcmp(evbuffer_pullup(buf, -1), "xy", 2) == 0);
+
+	/* a reservation outlived by a change to the buffer is refused, not committed over */
+	CHECK(evbuffer_reserve_space(buf, 10, vec, 1) == 1);
+	stale = vec[0];
+	CHECK(evbuffer_add(buf, "z", 1) == 0);
+	stale.iov_len = 5;
+	CHECK(evbuffer_commit_space(buf, &stale, 1) == -1);
+	CHECK(buf->off == 3 && memcmp(evbuffer_pullup(buf, -1), "xyz", 3) == 0);
+
+	evbuffer_free(buf);
+	return (0);
+}
+
+#define PUMP_SIZE	(8 << 20)
+
+struct pump_counts
+{
+	int nwrite;
+	int nread;
+};
+
+/* pushes PUMP_SIZE bytes queued in random 1-4000 byte appends through a socketpair */
+static int pump(int max_iovec, struct pump_counts* counts)
+{
+	struct evbuffer* out;
+	struct evbuffer* in;
+	u_char* sent = (u_char*)malloc(PUMP_SIZE);
+	u_char* received = (u_char*)malloc(PUMP_SIZE);
+	size_t queued = 0;
+	size_t nreceived = 0;
+	int fds[2];
+
+	CHECK(sent != NULL && received != NULL);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	CHECK(set_nonblock(fds[0]) == 0 && set_nonblock(fds[1]) == 0);
+	CHECK((out = evbuffer_new()) != NULL && (in = evbuffer_new()) != NULL);
+	CHECK(evbuffer_set_max_iovec(max_iovec) == 0);
+
+	srand(22);
+	model_fill(sent, PUMP_SIZE);
+	while (queued < PUMP_SIZE)
+	{
+		size_t len = 1 + rand() % 4000;
+		if (len > PUMP_SIZE - queued)
+		{
+			len = PUMP_SIZE - queued;
+		}
+		CHECK(evbuffer_add(out, sent + queued, len) == 0);
+		queued += len;
+	}
+
+	memset(counts, 0, sizeof(*counts));
+	while (nreceived < PUMP_SIZE)
+	{
+		if (out->off > 0 && evbuffer_write(out, fds[0]) > 0)
+		{
+			++counts->nwrite;
+		}
+		if (evbuffer_read(in, fds[1], -1) > 0)
+		{
+			++counts->nread;
+		}
+		nreceived += evbuffer_remove(in, received + nreceived, PUMP_SIZE - nreceived);
+	}
+	CHECK(memcmp(sent, received, PUMP_SIZE) == 0);
+
+	evbuffer_set_max_iovec(EVBUFFER_MAX_IOVEC);
+	evbuffer_free(out);
+	evbuffer_free(in);
+	close(fds[0]);
+	close(fds[1]);
+	free(sent);
+	free(received);
+	return (0);
+}
+
+/* writev gathers many segments per call; one segment per call is the unvectored baseline */
+static int test_vectored_io(void)
+{
+	struct pump_counts single;
+	struct pump_counts gathered;
+
+	CHECK(evbuffer_set_max_iovec(0) == -1);
+	CHECK(evbuffer_set_max_iovec(IOV_MAX + 1) == -1);
+	CHECK(pump(1, &single) == 0);
+	CHECK(pump(EVBUFFER_MAX_IOVEC, &gathered) == 0);
+	printf("  %d MB: write calls %d -> %d, read calls %d -> %d\n", PUMP_SIZE >> 20, single.nwrite, gathered.nwrite, single.nread, gathered.nread);
+	CHECK(single.nwrite >= PUMP_SIZE / EVBUFFER_CHAIN_SIZE);
+	CHECK(gathered.nwrite * 8 < single.nwrite);
+	return (0);
+}
+
+/* an empty buffer must not be held to one segment per read */
+static int test_read_sizing(void)
+{
+	struct evbuffer* buf;
+	char data[16 * EVBUFFER_CHAIN_SIZE];
+	int fds[2];
+	int size = sizeof(data);
+	int n;
+
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	CHECK(setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == 0);
+	CHECK(set_nonblock(fds[0]) == 0);
+	CHECK((buf = evbuffer_new()) != NULL);
+	memset(data, 'x', sizeof(data));
+
+	CHECK(write(fds[1], data, 8 * EVBUFFER_CHAIN_SIZE) == 8 * EVBUFFER_CHAIN_SIZE);
+	n = evbuffer_read(buf, fds[0], -1);
+	CHECK(n == 8 * EVBUFFER_CHAIN_SIZE);
+	CHECK(buf->off == (size_t)n);
+	/* no segment grows past the standard size */
+	for (struct evbuffer_chain* chain = buf->first; chain != NULL; chain = chain->next)
+	{
+		CHECK(chain->buffer_len == EVBUFFER_CHAIN_SIZE);
+	}
+
+	/* and again once the buffer has been emptied */
+	evbuffer_drain(buf, buf->off);
+	CHECK(write(fds[1], data, 8 * EVBUFFER_CHAIN_SIZE) == 8 * EVBUFFER_CHAIN_SIZE);
+	CHECK(evbuffer_read(buf, fds[0], -1) == 8 * EVBUFFER_CHAIN_SIZE);
+
+	/* howmuch still bounds a read */
+	evbuffer_drain(buf, buf->off);
+	CHECK(write(fds[1], data, 100) == 100);
+	CHECK(evbuffer_read(buf, fds[0], 10) == 10);
+	CHECK(evbuffer_read(buf, fds[0], -1) == 90);
+	CHECK(buf->off == 100);
+
+	evbuffer_free(buf);
+	close(fds[0]);
+	close(fds[1]);
+	return (0);
+}
+
+static int test_add_buffer(void)
+{
+	struct evbuffer* in;
+	struct evbuffer* out;
+	struct evbuffer_chain* seg;
+	struct iovec vec[2];
+	char data[2 * EVBUFFER_CHAIN_SIZE];
+	char check[sizeof(data)];
+
+	CHECK((in = evbuffer_new()) != NULL && (out = evbuffer_new()) != NULL);
+	memset(data, 'a', sizeof(data));
+
+	/* a small lone segment is copied and stays with the source for the next read */
+	CHECK(evbuffer_add(in, data, 100) == 0);
+	seg = in->first;
+	CHECK(evbuffer_add_buffer(out, in) == 0);
+	CHECK(in->off == 0 && out->off == 100);
+	CHECK(in->first == seg && out->first != seg);
+
+	/* a reservation does not follow its segment into the other buffer */
+	evbuffer_drain(out, out->off);
+	CHECK(evbuffer_reserve_space(in, 2 * EVBUFFER_CHAIN_SIZE, vec, 2) >= 1);
+	CHECK(evbuffer_add(in, data, sizeof(data)) == 0);
+	CHECK(in->reserved != NULL);
+	CHECK(evbuffer_add_buffer(out, in) == 0);
+	CHECK(in->reserved == NULL);
+	CHECK(out->off == sizeof(data) && in->off == 0);
+
+	/* a moving source takes the destination's spare once it has been written out */
+	CHECK(evbuffer_remove(out, check, sizeof(check)) == (int)sizeof(check));
+	CHECK(memcmp(check, data, sizeof(data)) == 0);
+	CHECK(evbuffer_add(in, data, sizeof(data)) == 0);
+	CHECK(out->spare != NULL);
+	free(in->spare);
+	in->spare = NULL;
+	seg = out->spare;
+	CHECK(evbuffer_add_buffer(out, in) == 0);
+	CHECK(in->spare == seg);
+
+	evbuffer_free(in);
+	evbuffer_free(out);
+	return (0);
+}
+
+static int pipe_queued(int fd)
+{
+	int n = -1;
+
+	ioctl(fd, FIONREAD, &n);
+	return (n);
+}
+
+static int test_file_checks(void)
+{
+	struct evbuffer* buf;
+	char path[] = "/tmp/test_buffer.XXXXXX";
+	char data[1000];
+	int sv[2];
+	int pfd[2];
+	int fd;
+
+	CHECK((buf = evbuffer_new()) != NULL);
+	CHECK((fd = mkstemp(path)) != -1);
+	unlink(path);
+	memset(data, 'f', sizeof(data));
+	CHECK(write(fd, data, sizeof(data)) == (ssize_t)sizeof(data));
+
+	/* ranges must lie inside the file */
+	CHECK(evbuffer_add_file(buf, fd, 0, sizeof(data) + 1) == -1);
+	CHECK(evbuffer_add_file(buf, fd, sizeof(data) + 1, 0) == -1);
+	CHECK(evbuffer_add_file(buf, fd, 500, 501) == -1);
+	CHECK(buf->off == 0);
+
+	/* only regular files and pipes */
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	CHECK(evbuffer_add_file(buf, sv[0], 0, 1) == -1);
+
+	/* a pipe must already hold the range */
+	CHECK(pipe(pfd) == 0);
+	CHECK(evbuffer_add_file(buf, pfd[0], 0, 10) == -1);
+	CHECK(write(pfd[1], data, 5) == 5);
+	CHECK(evbuffer_add_file(buf, pfd[0], 0, 10) == -1);
+	CHECK(evbuffer_add_file(buf, pfd[0], 1, 5) == -1);
+	CHECK(buf->off == 0);
+
+	/* the buffer owns fd once queued: the range goes out in full */
+	CHECK(evbuffer_add_file(buf, pfd[0], 0, 5) == 0);
+	CHECK(evbuffer_add_file(buf, fd, 500, 500) == 0);
+	CHECK(buf->off == 505);
+	CHECK(evbuffer_write(buf, sv[0]) == 5);
+	CHECK(evbuffer_write(buf, sv[0]) == 500);
+	CHECK(buf->off == 0);
+	CHECK(read(sv[1], data, sizeof(data)) == 505);
+
+	evbuffer_free(buf);
+	close(pfd[1]);
+	close(sv[0]);
+	close(sv[1]);
+	return (0);
+}
+
+/* removing, draining or peeking at part of a pipe segment reads only that part */
+static int test_file_partial_load(void)
+{
+	struct evbuffer* buf;
+	struct iovec vec[2];
+	u_char data[3 * EVBUFFER_CHAIN_SIZE];
+	u_char check[sizeof(data)];
+	int pfd[2];
+
+	for (size_t i = 0; i < sizeof(data); ++i)
+	{
+		data[i] = (u_char)(i * 7);
+	}
+	CHECK((buf = evbuffer_new()) != NULL);
+	CHECK(pipe(pfd) == 0);
+	CHECK(write(pfd[1], data, sizeof(data)) == (ssize_t)sizeof(data));
+	CHECK(evbuffer_add_file(buf, pfd[0], 0, sizeof(data)) == 0);
+
+	CHECK(evbuffer_remove(buf, check, 100) == 100);
+	CHECK(pipe_queued(pfd[0]) == (int)sizeof(data) - 100);
+	CHECK(memcmp(check, data, 100) == 0);
+
+	CHECK(evbuffer_drain(buf, 50) == 0);
+	CHECK(pipe_queued(pfd[0]) == (int)sizeof(data) - 150);
+	CHECK(buf->off == sizeof(data) - 150);
+
+	CHECK(evbuffer_peek(buf, 10, vec, 2) == 1);
+	CHECK(vec[0].iov_len == 10 && memcmp(vec[0].iov_base, data + 150, 10) == 0);
+	CHECK(pipe_queued(pfd[0]) == (int)sizeof(data) - 160);
+	CHECK(buf->last->flags & EVBUFFER_PIPE);
+
+	CHECK(evbuffer_remove(buf, check, sizeof(check)) == (int)sizeof(data) - 150);
+	CHECK(memcmp(check, data + 150, sizeof(data) - 150) == 0);
+	CHECK(buf->off == 0 && buf->first == NULL);
+
+	evbuffer_free(buf);
+	close(pfd[1]);
+	return (0);
+}
+
+static int count_fds(void)
+{
+	int n = 0;
+
+	for (int fd = 0; fd < 1024; ++fd)
+	{
+		if (fcntl(fd, F_GETFD) != -1)
+		{
+			++n;
+		}
+	}
+	return (n);
+}
+
+/* memory, file, pipe and memory segments in one buffer go out in order */
+static int test_file_mixed(void)
+{
+	struct evbuffer* buf;
+	static u_char file_data[5 * EVBUFFER_CHAIN_SIZE];
+	static u_char pipe_data[3 * EVBUFFER_CHAIN_SIZE];
+	static u_char expect[sizeof(file_data) + sizeof(pipe_data) + 8];
+	static u_char received[sizeof(expect)];
+	size_t file_len = sizeof(file_data) - 1000;
+	size_t nexpect = 0;
+	size_t nreceived = 0;
+	int sv[2];
+	int pfd[2];
+	int fd;
+
+	CHECK((buf = evbuffer_new()) != NULL);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	CHECK(set_nonblock(sv[0]) == 0 && set_nonblock(sv[1]) == 0);
+	CHECK((fd = model_file(file_data, sizeof(file_data))) != -1);
+	CHECK(pipe(pfd) == 0);
+	model_fill(pipe_data, sizeof(pipe_data));
+	CHECK(write(pfd[1], pipe_data, sizeof(pipe_data)) == (ssize_t)sizeof(pipe_data));
+
+	CHECK(evbuffer_add(buf, "head", 4) == 0);
+	CHECK(evbuffer_add_file(buf, fd, 500, file_len) == 0);
+	CHECK(evbuffer_add_file(buf, pfd[0], 0, sizeof(pipe_data)) == 0);
+	CHECK(evbuffer_add(buf, "tail", 4) == 0);
+	memcpy(expect, "head", 4);
+	memcpy(expect + 4, file_data + 500, file_len);
+	memcpy(expect + 4 + file_len, pipe_data, sizeof(pipe_data));
+	memcpy(expect + 4 + file_len + sizeof(pipe_data), "tail", 4);
+	nexpect = 8 + file_len + sizeof(pipe_data);
+
+	while (nreceived < nexpect)
+	{
+		ssize_t n;
+		if (buf->off > 0)
+		{
+			CHECK(evbuffer_write(buf, sv[0]) > 0 || errno == EAGAIN);
+		}
+		if ((n = read(sv[1], received + nreceived, sizeof(received) - nreceived)) > 0)
+		{
+			nreceived += n;
+		}
+	}
+	CHECK(nreceived == nexpect && buf->off == 0);
+	CHECK(memcmp(received, expect, nexpect) == 0);
+
+	evbuffer_free(buf);
+	close(pfd[1]);
+	close(sv[0]);
+	close(sv[1]);
+	return (0);
+}
+
+/* whatever happens to a file segment, the buffer closes its fd exactly once */
+static int test_file_fds(void)
+{
+	u_char data[EVBUFFER_CHAIN_SIZE];
+	u_char out[2 * sizeof(data)];
+	int before = count_fds();
+	int fd;
+
+	CHECK((fd = model_file(data, sizeof(data))) != -1);
+	for (int i = 0; i < 100; ++i)
+	{
+		struct evbuffer* buf;
+		int pfd[2];
+		CHECK((buf = evbuffer_new()) != NULL);
+		CHECK(pipe(pfd) == 0);
+		CHECK(write(pfd[1], data, sizeof(data)) == (ssize_t)sizeof(data));
+		close(pfd[1]);
+		CHECK(evbuffer_add_file(buf, dup(fd), 0, sizeof(data)) == 0);
+		CHECK(evbuffer_add_file(buf, pfd[0], 0, sizeof(data)) == 0);
+		CHECK(evbuffer_add_file(buf, dup(fd), 100, 100) == 0);
+		switch (i % 3)
+		{
+		case 0:
+			CHECK(evbuffer_remove(buf, out, sizeof(data) + 10) == (int)sizeof(data) + 10);
+			break;
+		case 1:
+			CHECK(evbuffer_drain(buf, sizeof(data) + 10) == 0);
+			break;
+		case 2:
+			CHECK(evbuffer_pullup(buf, -1) != NULL);
+			break;
+		}
+		evbuffer_free(buf);
+	}
+	close(fd);
+	CHECK(count_fds() == before);
+	return (0);
+}
+
+/* a pipe segment that cannot be read leaves the buffer as it was */
+static int test_drain_failure(void)
+{
+	struct evbuffer* buf;
+	char data[100];
+	int pfd[2];
+
+	CHECK((buf = evbuffer_new()) != NULL);
+	CHECK(pipe(pfd) == 0);
+	memset(data, 'p', sizeof(data));
+	CHECK(write(pfd[1], data, sizeof(data)) == (ssize_t)sizeof(data));
+	CHECK(evbuffer_add_file(buf, pfd[0], 0, sizeof(data)) == 0);
+
+	/* someone else empties the pipe behind the buffer's back */
+	CHECK(read(pfd[0], data, sizeof(data)) == (ssize_t)sizeof(data));
+	close(pfd[1]);
+	CHECK(evbuffer_drain(buf, 50) == -1);
+	CHECK(buf->off == sizeof(data));
+	CHECK(evbuffer_remove(buf, data, 10) == -1);
+	CHECK(buf->off == sizeof(data));
+	CHECK(evbuffer_drain(buf, sizeof(data)) == 0);
+	CHECK(buf->off == 0);
+
+	evbuffer_free(buf);
+	return (0);
+}
+
+int main(int argc, char* argv[])
+{
+	int res, failed;
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	res = test_model();
+	printf("%d random operations against a std::string model %s\n", MODEL_OPS, res == 0 ? "ok" : "FAILED");
+	failed = res;
+	res = test_reference();
+	printf("evbuffer_add_reference releases %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_peek();
+	printf("evbuffer_peek %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_reserve_commit();
+	printf("evbuffer_reserve_space/evbuffer_commit_space %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_vectored_io();
+	printf("readv/writev over a socketpair %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_read_sizing();
+	printf("evbuffer_read sized by the socket %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_add_buffer();
+	printf("evbuffer_add_buffer %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_file_checks();
+	printf("evbuffer_add_file checks %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_file_partial_load();
+	printf("partial loads of a pipe segment %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_file_mixed();
+	printf("memory, file and pipe segments written in order %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_file_fds();
+	printf("file segment fds closed %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_drain_failure();
+	printf("failed pipe loads %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	return (failed ? 1 : 0);
+}
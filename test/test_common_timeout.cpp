@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "log.hpp"
+#include "event.hpp"
+
+
+/*
+ * Common-timeout queues, on the min-heap and on the timer wheel: queued
+ * and heap timers firing together in deadline order, event_del of a
+ * queued timer, and the limit on registered durations.
+ */
+
+#define CHECK(cond) \
+	do { if (!(cond)) { printf("[line %d] check failed: %s\n", __LINE__, #cond); return (-1); } } while (0)
+
+/* as in event.cpp: min_heap_idx of an event sitting in a common-timeout queue */
+#define COMMON_TIMEOUT_IDX_FLAG	0x40000000
+#define MAX_COMMON_TIMEOUTS	256
+
+#define NTIMERS		12
+
+struct fire_log
+{
+	struct event* order[NTIMERS];
+	struct timeval at[NTIMERS];
+	int n;
+};
+
+static struct fire_log* current_log;
+
+/* the clock ev_timeout is kept on */
+static void monotonic_now(struct timeval* tv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+static void fire_cb(int fd, short what, void* arg)
+{
+	struct event* ev = (struct event*)arg;
+
+	if (what == EV_TIMEOUT && current_log->n < NTIMERS)
+	{
+		monotonic_now(&current_log->at[current_log->n]);
+		current_log->order[current_log->n++] = ev;
+	}
+}
+
+static void add_timer(struct event_base* base, struct event* ev, int msec)
+{
+	struct timeval tv = {0, msec * 1000};
+
+	evtimer_set(ev, fire_cb, ev);
+	event_base_set(base, ev);
+	event_add(ev, &tv);
+}
+
+static int is_queued(struct event* ev)
+{
+	return (ev->min_heap_idx != (unsigned int)-1 && (ev->min_heap_idx & COMMON_TIMEOUT_IDX_FLAG));
+}
+
+/* heap timers at 5, 15, 40 and 60 ms around three queued at 25 ms and two at 50 ms */
+static int test_mixed_order(int flags)
+{
+	static const int heap_ms[] = { 40, 5, 60, 15 };
+	struct timeval d25 = {0, 25000};
+	struct timeval d50 = {0, 50000};
+	struct event_base* base;
+	struct event heap[4], q25[3], q50[2];
+	struct fire_log log;
+
+	memset(&log, 0, sizeof(log));
+	current_log = &log;
+	CHECK((base = event_base_new_with_flags(flags)) != NULL);
+	CHECK(event_base_add_common_timeout(base, &d25) == 0);
+	CHECK(event_base_add_common_timeout(base, &d50) == 0);
+	/* registering a duration twice is a no-op */
+	CHECK(event_base_add_common_timeout(base, &d25) == 0);
+	CHECK(base->n_common_timeouts == 2);
+
+	for (int i = 0; i < 2; ++i)
+	{
+		add_timer(base, &q50[i], 50);
+	}
+	for (int i = 0; i < 4; ++i)
+	{
+		add_timer(base, &heap[i], heap_ms[i]);
+		CHECK(!is_queued(&heap[i]));
+	}
+	for (int i = 0; i < 3; ++i)
+	{
+		add_timer(base, &q25[i], 25);
+	}
+	for (int i = 0; i < 3; ++i)
+	{
+		CHECK(is_queued(&q25[i]) && (q25[i].min_heap_idx & ~COMMON_TIMEOUT_IDX_FLAG) == 0);
+	}
+	for (int i = 0; i < 2; ++i)
+	{
+		CHECK(is_queued(&q50[i]) && (q50[i].min_heap_idx & ~COMMON_TIMEOUT_IDX_FLAG) == 1);
+	}
+
+	CHECK(event_base_dispatch(base) == 1);
+	CHECK(log.n == 9);
+	for (int i = 0; i < log.n; ++i)
+	{
+		struct event* ev = log.order[i];
+		CHECK(i == 0 || !timercmp(&log.order[i - 1]->ev_timeout, &ev->ev_timeout, >));
+		/* never early */
+		CHECK(!timercmp(&log.at[i], &ev->ev_timeout, <));
+		CHECK(ev->min_heap_idx == (unsigned int)-1);
+	}
+	CHECK(log.order[0] == &heap[1] && log.order[1] == &heap[3]);
+	CHECK(log.order[2] == &q25[0] && log.order[3] == &q25[1] && log.order[4] == &q25[2]);
+	CHECK(log.order[5] == &heap[0]);
+	CHECK(log.order[6] == &q50[0] && log.order[7] == &q50[1]);
+	CHECK(log.order[8] == &heap[2]);
+
+	event_base_free(base);
+	return (0);
+}
+
+/*
+ * Deleting the head of a queue leaves timeout_event armed to the old
+ * deadline; the callback has to find the next head not yet due and re-arm
+ * without firing it early.
+ */
+static int test_del_queued(int flags)
+{
+	struct timeval d20 = {0, 20000};
+	struct timeval start, now, later = {0, 5000};
+	struct event_base* base;
+	struct event q[4];
+	struct fire_log log;
+
+	memset(&log, 0, sizeof(log));
+	current_log = &log;
+	CHECK((base = event_base_new_with_flags(flags)) != NULL);
+	CHECK(event_base_add_common_timeout(base, &d20) == 0);
+
+	add_timer(base, &q[0], 20);
+	add_timer(base, &q[1], 20);
+	/* 5 ms later, so the new head is not due when the old head's deadline passes */
+	monotonic_now(&start);
+	timeradd(&start, &later, &later);
+	do
+	{
+		monotonic_now(&now);
+	} while (timercmp(&now, &later, <));
+	add_timer(base, &q[2], 20);
+	add_timer(base, &q[3], 20);
+
+	CHECK(event_del(&q[0]) == 0);
+	CHECK(q[0].min_heap_idx == (unsigned int)-1 && !(q[0].ev_flags & EVLIST_TIMEOUT));
+	CHECK(event_del(&q[1]) == 0);
+	CHECK(event_del(&q[3]) == 0);
+	CHECK(!evtimer_pending(&q[1], NULL) && !evtimer_pending(&q[3], NULL));
+	CHECK(evtimer_pending(&q[2], NULL) && is_queued(&q[2]));
+
+	memset(&log, 0, sizeof(log));
+	CHECK(event_base_dispatch(base) == 1);
+	CHECK(log.n == 1 && log.order[0] == &q[2]);
+	CHECK(!timercmp(&log.at[0], &q[2].ev_timeout, <));
+
+	/* the emptied queue takes new timers */
+	add_timer(base, &q[0], 20);
+	CHECK(is_queued(&q[0]));
+	CHECK(event_base_dispatch(base) == 1);
+	CHECK(log.n == 2 && log.order[1] == &q[0]);
+
+	event_base_free(base);
+	return (0);
+}
+
+/* past MAX_COMMON_TIMEOUTS durations registration fails and such timers go to the heap */
+static int test_queue_limit(int flags)
+{
+	struct timeval d;
+	struct event_base* base;
+	struct event over, last;
+	struct fire_log log;
+
+	memset(&log, 0, sizeof(log));
+	current_log = &log;
+	CHECK((base = event_base_new_with_flags(flags)) != NULL);
+	for (int i = 0; i < MAX_COMMON_TIMEOUTS; ++i)
+	{
+		d.tv_sec = 0;
+		d.tv_usec = 1000 + i;
+		CHECK(event_base_add_common_timeout(base, &d) == 0);
+	}
+	CHECK(base->n_common_timeouts == MAX_COMMON_TIMEOUTS);
+	/* a known duration is still accepted, a new one is refused */
+	CHECK(event_base_add_common_timeout(base, &d) == 0);
+	d.tv_usec = 3000;
+	CHECK(event_base_add_common_timeout(base, &d) == -1);
+	CHECK(base->n_common_timeouts == MAX_COMMON_TIMEOUTS);
+
+	add_timer(base, &over, 3);
+	CHECK(!is_queued(&over));
+	evtimer_set(&last, fire_cb, &last);
+	event_base_set(base, &last);
+	d.tv_usec = 1000 + MAX_COMMON_TIMEOUTS - 1;
+	CHECK(event_add(&last, &d) == 0);
+	CHECK(is_queued(&last) && (last.min_heap_idx & ~COMMON_TIMEOUT_IDX_FLAG) == MAX_COMMON_TIMEOUTS - 1);
+
+	CHECK(event_base_dispatch(base) == 1);
+	CHECK(log.n == 2 && log.order[0] == &last && log.order[1] == &over);
+
+	event_base_free(base);
+	return (0);
+}
+
+static int run(const char* name, int flags)
+{
+	int res, failed;
+
+	res = test_mixed_order(flags);
+	printf("%s: queued and heap timers in deadline order %s\n", name, res == 0 ? "ok" : "FAILED");
+	failed = res;
+	res = test_del_queued(flags);
+	printf("%s: event_del of queued timers %s\n", name, res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_queue_limit(flags);
+	printf("%s: %d durations at most %s\n", name, MAX_COMMON_TIMEOUTS, res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	return (failed);
+}
+
+int main(int argc, char* argv[])
+{
+	int failed = 0;
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	failed |= run("min-heap", 0);
+	failed |= run("timer wheel", EVENT_BASE_FLAG_TIMERWHEEL);
+	return (failed ? 1 : 0);
+}
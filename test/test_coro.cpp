@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "log.hpp"
+#include "event.hpp"
+#include "evbuffer.hpp"
+#include "buffer.hpp"
+#include "coro.hpp"
+
+
+/*
+ * Coroutine layer: an echo server and its client as two coroutines on one
+ * base over a socketpair, plus timeouts, an EOF between awaits, callback
+ * restoring and frames destroyed while suspended.
+ */
+
+#define CHECK(cond) \
+	do { if (!(cond)) { printf("[line %d] check failed: %s\n", __LINE__, #cond); return (-1); } } while (0)
+
+#define ECHO_SIZE	(1 << 20)
+
+static int set_nonblock(int fd)
+{
+	return (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+}
+
+struct echo_state
+{
+	struct event_base* base;
+	struct bufferevent* server;
+	struct bufferevent* client;
+	unsigned char* sent;
+	unsigned char* received;
+	size_t nreceived;
+	int server_done;
+	int client_done;
+	int client_ok;
+};
+
+/* echoes until EOF, handing whole segments from input to output */
+static coro_task echo_server(struct echo_state* st)
+{
+	struct bufferevent* bev = st->server;
+
+	for (;;)
+	{
+		if (co_await async_read(bev, 1) <= 0)
+		{
+			break;
+		}
+		bufferevent_write_buffer(bev, bev->input);
+		if (co_await async_write(bev, NULL, 0) == -1)
+		{
+			break;
+		}
+	}
+	st->server_done = 1;
+	if (st->client_done)
+	{
+		event_base_loopbreak(st->base);
+	}
+}
+
+static coro_task echo_client(struct echo_state* st)
+{
+	int n;
+
+	st->client_ok = (co_await async_write(st->client, st->sent, ECHO_SIZE) == 0);
+	while (st->client_ok && st->nreceived < ECHO_SIZE)
+	{
+		if ((n = co_await async_read(st->client, 1)) <= 0)
+		{
+			break;
+		}
+		st->nreceived += evbuffer_remove(st->client->input, st->received + st->nreceived, n);
+	}
+	/* half-close so the server sees EOF and leaves its loop */
+	shutdown(st->client->ev_read.ev_fd, SHUT_WR);
+	st->client_done = 1;
+	if (st->server_done)
+	{
+		event_base_loopbreak(st->base);
+	}
+}
+
+static void echo_server_errorcb(struct bufferevent* bev, short what, void* arg)
+{
+}
+
+static int test_echo(void)
+{
+	struct echo_state st;
+	struct timeval limit = {10, 0};
+	int fds[2];
+
+	memset(&st, 0, sizeof(st));
+	CHECK((st.base = event_base_new_with_flags(EVENT_BASE_FLAG_EPOLL_CHANGELIST)) != NULL);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	CHECK(set_nonblock(fds[0]) == 0 && set_nonblock(fds[1]) == 0);
+
+	st.sent = (unsigned char*)malloc(ECHO_SIZE);
+	st.received = (unsigned char*)malloc(ECHO_SIZE);
+	srand(7);
+	for (int i = 0; i < ECHO_SIZE; ++i)
+	{
+		st.sent[i] = (unsigned char)rand();
+	}
+
+	/* the server has its own errorcb, which must be back once the coroutine stops waiting */
+	st.server = bufferevent_new(fds[0], NULL, NULL, echo_server_errorcb, &st);
+	st.client = bufferevent_new(fds[1], NULL, NULL, NULL, NULL);
+	CHECK(st.server != NULL && st.client != NULL);
+	bufferevent_base_set(st.base, st.server);
+	bufferevent_base_set(st.base, st.client);
+
+	echo_server(&st);
+	echo_client(&st);
+	CHECK(event_base_loopexit(st.base, &limit) == 0);
+	CHECK(event_base_dispatch(st.base) == 0);
+
+	CHECK(st.client_ok);
+	CHECK(st.nreceived == ECHO_SIZE);
+	CHECK(memcmp(st.sent, st.received, ECHO_SIZE) == 0);
+	CHECK(st.server_done && st.client_done);
+	CHECK(st.server->errorcb == echo_server_errorcb && st.server->cbarg == &st);
+	CHECK(st.client->errorcb == NULL && st.client->cbarg == NULL);
+
+	bufferevent_free(st.server);
+	bufferevent_free(st.client);
+	close(fds[0]);
+	close(fds[1]);
+	free(st.sent);
+	free(st.received);
+	event_base_free(st.base);
+	return (0);
+}
+
+static coro_task wait_readable(struct event_base* base, int fd, short* result)
+{
+	struct timeval tv = {0, 20000};
+	short what = co_await readable(base, fd, &tv);
+
+	*result = what;
+}
+
+static coro_task nap(struct event_base* base, int* woke)
+{
+	co_await sleep_for(base, std::chrono::milliseconds(10));
+	*woke = 1;
+}
+
+static int test_timeouts(void)
+{
+	struct event_base* base;
+	short result = 0;
+	int woke = 0;
+	int fds[2];
+
+	CHECK((base = event_base_new()) != NULL);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+	wait_readable(base, fds[0], &result);
+	nap(base, &woke);
+	CHECK(event_base_dispatch(base) == 1);
+	CHECK(result == EV_TIMEOUT);
+	CHECK(woke);
+
+	close(fds[0]);
+	close(fds[1]);
+	event_base_free(base);
+	return (0);
+}
+
+struct eof_state
+{
+	struct bufferevent* bev;
+	int first;
+	int second;
+	int done;
+};
+
+/* the peer closes while the coroutine is busy between two reads */
+static coro_task read_twice(struct eof_state* st)
+{
+	struct bufferevent* bev = st->bev;
+
+	st->first = co_await async_read(bev, 1);
+	evbuffer_drain(bev->input, bev->input->off);
+	co_await sleep_for(bev->ev_base, std::chrono::milliseconds(20));
+	if (co_await async_read(bev, 1) <= 0)
+	{
+		st->second = -1;
+	}
+	/* an edge-triggered read event is persistent and would keep the loop going */
+	bufferevent_disable(bev, EV_READ);
+	st->done = 1;
+}
+
+static int test_eof_between_awaits(int edge)
+{
+	struct event_base* base;
+	struct eof_state st;
+	int fds[2];
+
+	memset(&st, 0, sizeof(st));
+	CHECK((base = event_base_new()) != NULL);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	CHECK(set_nonblock(fds[0]) == 0);
+	CHECK((st.bev = bufferevent_new(fds[0], NULL, NULL, NULL, NULL)) != NULL);
+	bufferevent_base_set(base, st.bev);
+	CHECK(bufferevent_setedge(st.bev, edge) == 0);
+	CHECK(bufferevent_enable(st.bev, EV_READ) == 0);
+
+	read_twice(&st);
+	CHECK(write(fds[1], "x", 1) == 1);
+	CHECK(event_base_loop(base, EVLOOP_ONCE) == 0);
+	CHECK(st.first == 1);
+	/* the EOF lands while the coroutine sleeps, with nothing waiting on the bufferevent */
+	close(fds[1]);
+	CHECK(event_base_dispatch(base) == 1);
+	CHECK(st.done && st.second == -1);
+
+	bufferevent_free(st.bev);
+	close(fds[0]);
+	event_base_free(base);
+	return (0);
+}
+
+/* hands the coroutine's handle out without suspending */
+struct grab_handle
+{
+	std::coroutine_handle<>* out;
+
+	bool await_ready() { return false; }
+	bool await_suspend(std::coroutine_handle<> h) { *out = h; return false; }
+	void await_resume() {}
+};
+
+static coro_task abandoned_read(struct event_base* base, int fd, std::coroutine_handle<>* h, int* resumed)
+{
+	co_await grab_handle{h};
+	co_await readable(base, fd);
+	*resumed = 1;
+}
+
+static coro_task abandoned_bev(struct bufferevent* bev, std::coroutine_handle<>* h, int* resumed)
+{
+	co_await grab_handle{h};
+	co_await async_read(bev, 1);
+	*resumed = 1;
+}
+
+static void user_readcb(struct bufferevent* bev, void* arg)
+{
+}
+
+static int test_destroy_suspended(void)
+{
+	struct event_base* base;
+	struct bufferevent* bev;
+	std::coroutine_handle<> h;
+	int resumed = 0;
+	int fds[2];
+
+	CHECK((base = event_base_new()) != NULL);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	CHECK(set_nonblock(fds[0]) == 0);
+
+	/* the pending readable() event goes with the frame */
+	abandoned_read(base, fds[0], &h, &resumed);
+	h.destroy();
+	CHECK(write(fds[1], "x", 1) == 1);
+	CHECK(event_base_loop(base, EVLOOP_NONBLOCK) == 1);
+	CHECK(!resumed);
+
+	/* and a bufferevent gets its callbacks back */
+	CHECK((bev = bufferevent_new(fds[0], user_readcb, NULL, NULL, base)) != NULL);
+	bufferevent_base_set(base, bev);
+	abandoned_bev(bev, &h, &resumed);
+	CHECK(bev->readcb != user_readcb);
+	h.destroy();
+	CHECK(bev->readcb == user_readcb && bev->cbarg == base);
+	CHECK(event_base_loop(base, EVLOOP_NONBLOCK) == 0);
+	CHECK(!resumed);
+
+	bufferevent_free(bev);
+	close(fds[0]);
+	close(fds[1]);
+	event_base_free(base);
+	return (0);
+}
+
+int main(int argc, char* argv[])
+{
+	int res, failed;
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	res = test_echo();
+	printf("coroutine echo of %d bytes %s\n", ECHO_SIZE, res == 0 ? "ok" : "FAILED");
+	failed = res;
+	res = test_timeouts();
+	printf("readable/sleep_for timeouts %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_eof_between_awaits(0);
+	printf("EOF between awaits, level-triggered %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_eof_between_awaits(1);
+	printf("EOF between awaits, edge-triggered %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_destroy_suspended();
+	printf("frames destroyed while suspended %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	return (failed ? 1 : 0);
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "log.hpp"
+#include "event.hpp"
+#include "epoll.hpp"
+#include "evbuffer.hpp"
+
+
+/*
+ * Per-fd event lists against the backends that defer kernel updates:
+ * the epoll changelist and io_uring, and the per-wakeup read bound of an
+ * edge-triggered bufferevent.
+ */
+
+#define CHECK(cond) \
+	do { if (!(cond)) { printf("[line %d] check failed: %s\n", __LINE__, #cond); return (-1); } } while (0)
+
+struct reuse_ctx
+{
+	struct event_base* base;
+	struct event ev;
+	int fds[2];
+	int old_peer;
+	int reused;
+	int nread;
+};
+
+static void reuse_read_cb(int fd, short what, void* arg)
+{
+	struct reuse_ctx* ctx = (struct reuse_ctx*)arg;
+	char c;
+
+	if (read(fd, &c, 1) == 1)
+	{
+		++ctx->nread;
+		event_base_loopbreak(ctx->base);
+	}
+}
+
+/*
+ * The client on fd N goes away and, in the same loop pass, a new socket is
+ * accepted as fd N and its event lives at the same address as the old one.
+ * The old peer stays open, so nothing wakes a poll left on the old file.
+ */
+static void reuse_swap_cb(int fd, short what, void* arg)
+{
+	struct reuse_ctx* ctx = (struct reuse_ctx*)arg;
+	int old = ctx->fds[0];
+
+	event_del(&ctx->ev);
+	close(ctx->fds[0]);
+	ctx->old_peer = ctx->fds[1];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctx->fds) == -1)
+	{
+		return;
+	}
+	ctx->reused = (ctx->fds[0] == old);
+
+	event_set(&ctx->ev, ctx->fds[0], EV_READ | EV_PERSIST, reuse_read_cb, ctx);
+	event_base_set(ctx->base, &ctx->ev);
+	event_add(&ctx->ev, NULL);
+	if (write(ctx->fds[1], "x", 1) != 1)
+	{
+		ctx->reused = 0;
+	}
+}
+
+static int test_fd_reuse_same_pass(struct event_base* base)
+{
+	struct reuse_ctx ctx;
+	struct event swap;
+	struct timeval tv = {0, 0};
+	struct timeval limit = {2, 0};
+	int res;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.base = base;
+	ctx.old_peer = -1;
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, ctx.fds) == 0);
+	event_set(&ctx.ev, ctx.fds[0], EV_READ | EV_PERSIST, reuse_read_cb, &ctx);
+	event_base_set(base, &ctx.ev);
+	evtimer_set(&swap, reuse_swap_cb, &ctx);
+	event_base_set(base, &swap);
+
+	/* let the backend register the first socket with the kernel */
+	res = event_add(&ctx.ev, NULL);
+	res |= event_base_loop(base, EVLOOP_NONBLOCK);
+
+	res |= evtimer_add(&swap, &tv);
+	res |= event_base_loopexit(base, &limit);
+	res |= event_base_dispatch(base);
+
+	/* the events live on this stack, so take them out of the base on every path */
+	event_del(&swap);
+	event_del(&ctx.ev);
+	close(ctx.fds[0]);
+	close(ctx.fds[1]);
+	if (ctx.old_peer != -1)
+	{
+		close(ctx.old_peer);
+	}
+
+	CHECK(res == 0);
+	CHECK(ctx.reused);
+	CHECK(ctx.nread == 1);
+	return (0);
+}
+
+struct rearm_ctx
+{
+	struct event_base* base;
+	struct event rev;
+	struct event wev;
+	int nwrite;
+};
+
+static void rearm_read_cb(int fd, short what, void* arg)
+{
+}
+
+static void rearm_write_cb(int fd, short what, void* arg)
+{
+	struct rearm_ctx* ctx = (struct rearm_ctx*)arg;
+
+	if (++ctx->nwrite == 3)
+	{
+		event_base_loopbreak(ctx->base);
+		return;
+	}
+	event_add(&ctx->wev, NULL);
+}
+
+/*
+ * A one-shot EV_ET write re-added from its own callback, with a read event
+ * keeping the fd's list non-empty: the interest is unchanged, but the
+ * kernel has to be asked again or an fd that stays writable never reports
+ * another edge.
+ */
+static int test_et_oneshot_readd(struct event_base* base)
+{
+	struct rearm_ctx ctx;
+	struct timeval limit = {2, 0};
+	int fds[2];
+	int res;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.base = base;
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	event_set(&ctx.rev, fds[0], EV_READ | EV_PERSIST | EV_ET, rearm_read_cb, &ctx);
+	event_base_set(base, &ctx.rev);
+	event_set(&ctx.wev, fds[0], EV_WRITE | EV_ET, rearm_write_cb, &ctx);
+	event_base_set(base, &ctx.wev);
+
+	res = event_add(&ctx.rev, NULL);
+	res |= event_add(&ctx.wev, NULL);
+	res |= event_base_loopexit(base, &limit);
+	res |= event_base_dispatch(base);
+
+	event_del(&ctx.wev);
+	event_del(&ctx.rev);
+	close(fds[0]);
+	close(fds[1]);
+
+	CHECK(res == 0);
+	CHECK(ctx.nwrite == 3);
+	return (0);
+}
+
+#define BURST_SIZE	(1 << 20)
+
+struct burst_ctx
+{
+	struct event_base* base;
+	size_t total;
+	size_t largest;
+	int nreadcb;
+	int other_at;
+};
+
+static void burst_readcb(struct bufferevent* bev, void* arg)
+{
+	struct burst_ctx* ctx = (struct burst_ctx*)arg;
+	size_t len = bev->input->off;
+
+	++ctx->nreadcb;
+	if (len > ctx->largest)
+	{
+		ctx->largest = len;
+	}
+	ctx->total += len;
+	evbuffer_drain(bev->input, len);
+	if (ctx->total == BURST_SIZE)
+	{
+		event_base_loopbreak(ctx->base);
+	}
+}
+
+static void burst_other_cb(int fd, short what, void* arg)
+{
+	struct burst_ctx* ctx = (struct burst_ctx*)arg;
+	char c;
+
+	if (read(fd, &c, 1) == 1 && ctx->other_at == 0)
+	{
+		ctx->other_at = ctx->nreadcb + 1;
+	}
+}
+
+/*
+ * A megabyte queued at once behind an edge-triggered bufferevent: readcb
+ * gets it in pieces of at most BUFFEREVENT_ET_READ_MAX, and a plain event
+ * ready at the same time runs before the last piece.
+ */
+static int test_et_read_bound(struct event_base* base)
+{
+	struct burst_ctx ctx;
+	struct bufferevent* bev;
+	struct event other;
+	struct timeval limit = {5, 0};
+	char* data = (char*)calloc(1, BURST_SIZE);
+	int pfd[2], sfd[2];
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.base = base;
+	CHECK(data != NULL);
+	CHECK(pipe(pfd) == 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, sfd) == 0);
+	CHECK(fcntl(pfd[0], F_SETPIPE_SZ, BURST_SIZE) >= BURST_SIZE);
+	CHECK(fcntl(pfd[0], F_SETFL, O_NONBLOCK) == 0);
+	CHECK(write(pfd[1], data, BURST_SIZE) == BURST_SIZE);
+	CHECK(write(sfd[1], "x", 1) == 1);
+
+	CHECK((bev = bufferevent_new(pfd[0], burst_readcb, NULL, NULL, &ctx)) != NULL);
+	bufferevent_base_set(base, bev);
+	CHECK(bufferevent_setedge(bev, 1) == 0);
+	CHECK(bufferevent_enable(bev, EV_READ) == 0);
+	event_set(&other, sfd[0], EV_READ, burst_other_cb, &ctx);
+	event_base_set(base, &other);
+	CHECK(event_add(&other, NULL) == 0);
+	CHECK(event_base_loopexit(base, &limit) == 0);
+	CHECK(event_base_dispatch(base) == 0);
+
+	event_del(&other);
+	bufferevent_free(bev);
+	close(pfd[0]);
+	close(pfd[1]);
+	close(sfd[0]);
+	close(sfd[1]);
+	free(data);
+
+	CHECK(ctx.total == BURST_SIZE);
+	CHECK(ctx.largest <= BUFFEREVENT_ET_READ_MAX);
+	CHECK(ctx.nreadcb >= BURST_SIZE / BUFFEREVENT_ET_READ_MAX);
+	CHECK(ctx.other_at > 0 && ctx.other_at < ctx.nreadcb);
+	return (0);
+}
+
+static int run(const char* name, int nouring, int flags)
+{
+	struct event_base* base;
+	int res, failed;
+
+	if (nouring)
+	{
+		setenv("EVENT_NOURING", "1", 1);
+	}
+	else
+	{
+		unsetenv("EVENT_NOURING");
+	}
+	if ((base = event_base_new_with_flags(flags)) == NULL)
+	{
+		printf("%s: event_base_new failed\n", name);
+		return (-1);
+	}
+	res = test_fd_reuse_same_pass(base);
+	printf("%s (%s): fd reuse in one pass %s\n", name, base->evsel->name, res == 0 ? "ok" : "FAILED");
+	failed = res;
+	res = test_et_oneshot_readd(base);
+	printf("%s (%s): EV_ET one-shot re-add %s\n", name, base->evsel->name, res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_et_read_bound(base);
+	printf("%s (%s): EV_ET bufferevent read bound %s\n", name, base->evsel->name, res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	event_base_free(base);
+	return (failed);
+}
+
+int main(int argc, char* argv[])
+{
+	int failed = 0;
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	failed |= run("epoll", 1, 0);
+	failed |= run("epoll changelist", 1, EVENT_BASE_FLAG_EPOLL_CHANGELIST);
+	failed |= run("default", 0, 0);
+	return (failed ? 1 : 0);
+}
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "log.hpp"
+#include "event.hpp"
+
+
+/*
+ * Reaching a loop from other threads: event_base_run_in_loop posts from
+ * several threads at once and a long run from one, event_base_loopbreak
+ * and event_base_loopexit from outside the loop, and event_base_new
+ * failing cleanly when no backend can start.
+ */
+
+#define CHECK(cond) \
+	do { if (!(cond)) { printf("[line %d] check failed: %s\n", __LINE__, #cond); return (-1); } } while (0)
+
+#define NPOSTERS	4
+#define NPOSTS		20000
+#define NBACKLOG	100000
+
+struct post_state
+{
+	struct event_base* base;
+	pthread_t loop_thread;
+	int next_seq[NPOSTERS];
+	int total;
+	int expected;
+	int wrong_thread;
+	int out_of_order;
+};
+
+struct poster
+{
+	struct post_state* st;
+	int id;
+	int failed;
+};
+
+static struct post_state* current;
+
+/* arg packs the poster id above its sequence number */
+static void seq_cb(void* arg)
+{
+	intptr_t v = (intptr_t)arg;
+	int id = v >> 24;
+	int seq = v & 0xffffff;
+
+	if (!pthread_equal(pthread_self(), current->loop_thread))
+	{
+		++current->wrong_thread;
+	}
+	if (seq != current->next_seq[id])
+	{
+		++current->out_of_order;
+	}
+	current->next_seq[id] = seq + 1;
+	if (++current->total == current->expected)
+	{
+		event_base_loopbreak(current->base);
+	}
+}
+
+static void* poster_main(void* arg)
+{
+	struct poster* p = (struct poster*)arg;
+
+	for (int i = 0; i < NPOSTS; ++i)
+	{
+		if (event_base_run_in_loop(p->st->base, seq_cb, (void*)(((intptr_t)p->id << 24) | i)) == -1)
+		{
+			p->failed = 1;
+		}
+	}
+	return (NULL);
+}
+
+struct guard
+{
+	struct event ev;
+	struct event_base* base;
+	int fired;
+};
+
+/* stops a loop that was never woken, so a failure does not hang the run */
+static void guard_cb(int fd, short what, void* arg)
+{
+	struct guard* g = (struct guard*)arg;
+
+	g->fired = 1;
+	event_base_loopbreak(g->base);
+}
+
+static int guard_add(struct guard* g, struct event_base* base, int sec)
+{
+	struct timeval limit = {sec, 0};
+
+	g->base = base;
+	g->fired = 0;
+	evtimer_set(&g->ev, guard_cb, g);
+	event_base_set(base, &g->ev);
+	return (event_add(&g->ev, &limit));
+}
+
+/* every post runs once, on the loop thread, in the order its thread posted it */
+static int test_cross_thread_posts(void)
+{
+	struct post_state st;
+	struct poster posters[NPOSTERS];
+	pthread_t threads[NPOSTERS];
+	struct guard guard;
+
+	memset(&st, 0, sizeof(st));
+	current = &st;
+	CHECK((st.base = event_base_new()) != NULL);
+	st.loop_thread = pthread_self();
+	st.expected = NPOSTERS * NPOSTS;
+	CHECK(guard_add(&guard, st.base, 10) == 0);
+
+	for (int i = 0; i < NPOSTERS; ++i)
+	{
+		posters[i].st = &st;
+		posters[i].id = i;
+		posters[i].failed = 0;
+		CHECK(pthread_create(&threads[i], NULL, poster_main, &posters[i]) == 0);
+	}
+	CHECK(event_base_loop(st.base, 0) == 0);
+	for (int i = 0; i < NPOSTERS; ++i)
+	{
+		pthread_join(threads[i], NULL);
+		CHECK(!posters[i].failed);
+	}
+
+	CHECK(!guard.fired);
+	CHECK(st.total == st.expected);
+	CHECK(st.wrong_thread == 0 && st.out_of_order == 0);
+	for (int i = 0; i < NPOSTERS; ++i)
+	{
+		CHECK(st.next_seq[i] == NPOSTS);
+	}
+	event_del(&guard.ev);
+	event_base_free(st.base);
+	return (0);
+}
+
+/* a backlog posted before the loop starts drains in one pass, in order */
+static int test_backlog_order(void)
+{
+	struct post_state st;
+
+	memset(&st, 0, sizeof(st));
+	current = &st;
+	CHECK((st.base = event_base_new()) != NULL);
+	st.loop_thread = pthread_self();
+	st.expected = -1;
+	for (int i = 0; i < NBACKLOG; ++i)
+	{
+		CHECK(event_base_run_in_loop(st.base, seq_cb, (void*)(intptr_t)i) == 0);
+	}
+	CHECK(event_base_loop(st.base, EVLOOP_ONCE | EVLOOP_NO_EXIT_ON_EMPTY) == 0);
+	CHECK(st.total == NBACKLOG);
+	CHECK(st.next_seq[0] == NBACKLOG && st.out_of_order == 0);
+
+	event_base_free(st.base);
+	return (0);
+}
+
+struct stopper
+{
+	struct event_base* base;
+	int use_exit;
+};
+
+static void* stopper_main(void* arg)
+{
+	struct stopper* s = (struct stopper*)arg;
+	struct timespec ts = {0, 20 * 1000 * 1000};
+
+	nanosleep(&ts, NULL);
+	if (s->use_exit)
+	{
+		event_base_loopexit(s->base, NULL);
+	}
+	else
+	{
+		event_base_loopbreak(s->base);
+	}
+	return (NULL);
+}
+
+/* a loop blocked with nothing to do is woken by another thread */
+static int test_stop_from_thread(int use_exit)
+{
+	struct stopper s;
+	struct guard guard;
+	pthread_t thread;
+
+	CHECK((s.base = event_base_new()) != NULL);
+	s.use_exit = use_exit;
+	CHECK(guard_add(&guard, s.base, 5) == 0);
+
+	CHECK(pthread_create(&thread, NULL, stopper_main, &s) == 0);
+	CHECK(event_base_loop(s.base, EVLOOP_NO_EXIT_ON_EMPTY) == 0);
+	pthread_join(thread, NULL);
+	CHECK(!guard.fired && evtimer_pending(&guard.ev, NULL));
+
+	event_del(&guard.ev);
+	event_base_free(s.base);
+	return (0);
+}
+
+/* with no descriptors left no backend can start: NULL, not a crash in evnotify_init */
+static int test_no_backend(void)
+{
+	struct rlimit saved, none;
+	struct event_base* base;
+	int fd;
+
+	CHECK(getrlimit(RLIMIT_NOFILE, &saved) == 0);
+	/* the lowest free descriptor is the number still allowed */
+	CHECK((fd = dup(0)) != -1);
+	close(fd);
+	none = saved;
+	none.rlim_cur = fd;
+	CHECK(setrlimit(RLIMIT_NOFILE, &none) == 0);
+	base = event_base_new();
+	CHECK(setrlimit(RLIMIT_NOFILE, &saved) == 0);
+	CHECK(base == NULL);
+
+	CHECK((base = event_base_new()) != NULL);
+	event_base_free(base);
+	return (0);
+}
+
+int main(int argc, char* argv[])
+{
+	int res, failed;
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	res = test_cross_thread_posts();
+	printf("%d run_in_loop posts from %d threads %s\n", NPOSTERS * NPOSTS, NPOSTERS, res == 0 ? "ok" : "FAILED");
+	failed = res;
+	res = test_backlog_order();
+	printf("%d posts queued before the loop, in order %s\n", NBACKLOG, res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_stop_from_thread(0);
+	printf("event_base_loopbreak from another thread %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_stop_from_thread(1);
+	printf("event_base_loopexit from another thread %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_no_backend();
+	printf("event_base_new without a backend %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	return (failed ? 1 : 0);
+}
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "log.hpp"
+#include "event.hpp"
+
+
+/*
+ * Scheduling under a flood: events that re-activate themselves from their
+ * callback keep priority 0 busy forever. With max_callbacks a timer still
+ * fires within one budget of its deadline; with weights the other
+ * priorities get exactly their share, in the weighted round-robin order.
+ */
+
+#define CHECK(cond) \
+	do { if (!(cond)) { printf("[line %d] check failed: %s\n", __LINE__, #cond); return (-1); } } while (0)
+
+#define BUDGET		64
+#define NFLOOD		2
+#define NLOG		6000
+/* callbacks before giving up on a timer that never fires */
+#define STARVE_LIMIT	200000
+
+struct sched_state
+{
+	struct event_base* base;
+	struct event timer;
+	struct timeval deadline;
+	/* callbacks made, and the count when a flood callback first saw the deadline pass */
+	int calls;
+	int calls_at_deadline;
+	int calls_at_timer;
+	int timer_fired;
+	/* the loop breaks at stop_after callbacks, or once the timer fired and min_calls were made */
+	int stop_after;
+	int min_calls;
+	unsigned char pri_log[NLOG];
+};
+
+struct flooder
+{
+	struct event ev;
+	struct sched_state* st;
+};
+
+static void monotonic_now(struct timeval* tv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+static void record(struct sched_state* st, int pri)
+{
+	if (st->calls < NLOG)
+	{
+		st->pri_log[st->calls] = (unsigned char)pri;
+	}
+	if (++st->calls >= st->stop_after)
+	{
+		event_base_loopbreak(st->base);
+	}
+}
+
+static void flood_cb(int fd, short what, void* arg)
+{
+	struct flooder* f = (struct flooder*)arg;
+	struct sched_state* st = f->st;
+	struct timeval now;
+
+	if (st->calls_at_deadline == -1)
+	{
+		monotonic_now(&now);
+		if (!timercmp(&now, &st->deadline, <))
+		{
+			st->calls_at_deadline = st->calls;
+		}
+	}
+	record(st, f->ev.ev_pri);
+	event_active(&f->ev, EV_READ, 1);
+}
+
+static void sched_timer_cb(int fd, short what, void* arg)
+{
+	struct sched_state* st = (struct sched_state*)arg;
+
+	st->timer_fired = 1;
+	st->calls_at_timer = st->calls;
+	if (st->stop_after > st->min_calls)
+	{
+		st->stop_after = st->min_calls;
+	}
+	record(st, st->timer.ev_pri);
+}
+
+static int flood_start(struct sched_state* st, struct flooder* f, int pri)
+{
+	f->st = st;
+	event_set(&f->ev, -1, EV_PERSIST, flood_cb, f);
+	event_base_set(st->base, &f->ev);
+	if (event_priority_set(&f->ev, pri) == -1)
+	{
+		return (-1);
+	}
+	event_active(&f->ev, EV_READ, 1);
+	return (0);
+}
+
+static int sched_init(struct sched_state* st, int npriorities, int timer_pri, int min_calls)
+{
+	struct timeval one_ms = {0, 1000};
+
+	memset(st, 0, sizeof(*st));
+	st->calls_at_deadline = -1;
+	st->stop_after = STARVE_LIMIT;
+	st->min_calls = min_calls;
+	if ((st->base = event_base_new()) == NULL || event_base_priority_init(st->base, npriorities) == -1)
+	{
+		return (-1);
+	}
+	evtimer_set(&st->timer, sched_timer_cb, st);
+	event_base_set(st->base, &st->timer);
+	if (event_priority_set(&st->timer, timer_pri) == -1 || event_add(&st->timer, &one_ms) == -1)
+	{
+		return (-1);
+	}
+	/* the clock ev_timeout is kept on */
+	st->deadline = st->timer.ev_timeout;
+	return (0);
+}
+
+/*
+ * Strict priority, flood and timer both at priority 0: with no budget the
+ * timer waits behind the flood for good, with one it runs at most one
+ * budget, plus the flood events queued ahead of it, after its deadline.
+ */
+static int test_budget(int budget)
+{
+	struct sched_state st;
+	struct flooder flood[NFLOOD];
+
+	CHECK(sched_init(&st, 1, 0, 0) == 0);
+	CHECK(event_base_set_max_callbacks(st.base, budget) == 0);
+	for (int i = 0; i < NFLOOD; ++i)
+	{
+		CHECK(flood_start(&st, &flood[i], 0) == 0);
+	}
+	CHECK(event_base_loop(st.base, 0) == 0);
+	if (budget == 0)
+	{
+		CHECK(st.calls == STARVE_LIMIT && !st.timer_fired);
+	}
+	else
+	{
+		CHECK(st.timer_fired && st.calls_at_deadline != -1);
+		CHECK(st.calls_at_timer - st.calls_at_deadline <= budget + NFLOOD);
+	}
+
+	for (int i = 0; i < NFLOOD; ++i)
+	{
+		event_del(&flood[i].ev);
+	}
+	event_del(&st.timer);
+	event_base_free(st.base);
+	return (0);
+}
+
+/*
+ * Every priority flooded and the timer at the lowest one, under a budget:
+ * callbacks follow the weights exactly, round after round across the
+ * pass boundaries, and the timer takes one of its priority's turns soon
+ * after the deadline.
+ */
+static int test_weights(const int* weights, int npriorities)
+{
+	struct sched_state st;
+	struct flooder flood[3][NFLOOD];
+	int round = 0, pos = 0, pri = 0;
+
+	CHECK(npriorities <= 3);
+	CHECK(sched_init(&st, npriorities, npriorities - 1, NLOG) == 0);
+	CHECK(event_base_set_max_callbacks(st.base, BUDGET) == 0);
+	CHECK(event_base_set_priority_weights(st.base, weights) == 0);
+	for (int p = 0; p < npriorities; ++p)
+	{
+		round += weights[p];
+		for (int i = 0; i < NFLOOD; ++i)
+		{
+			CHECK(flood_start(&st, &flood[p][i], p) == 0);
+		}
+	}
+	CHECK(event_base_loop(st.base, 0) == 0);
+	CHECK(st.timer_fired && st.calls >= NLOG);
+
+	for (int i = 0; i < NLOG; ++i)
+	{
+		CHECK(st.pri_log[i] == pri);
+		if (++pos == weights[pri])
+		{
+			pos = 0;
+			pri = (pri + 1) % npriorities;
+		}
+	}
+	/* the rest of the pass, then up to a round and the lowest queue's flood ahead of it */
+	CHECK(st.calls_at_deadline != -1);
+	CHECK(st.calls_at_timer - st.calls_at_deadline <= BUDGET + round + NFLOOD * round);
+
+	for (int p = 0; p < npriorities; ++p)
+	{
+		for (int i = 0; i < NFLOOD; ++i)
+		{
+			event_del(&flood[p][i].ev);
+		}
+	}
+	event_del(&st.timer);
+	event_base_free(st.base);
+	return (0);
+}
+
+int main(int argc, char* argv[])
+{
+	static const int two[] = { 4, 1 };
+	static const int three[] = { 1, 3, 2 };
+	int res, failed;
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	res = test_budget(0);
+	printf("flood without a budget starves the timer %s\n", res == 0 ? "ok" : "FAILED");
+	failed = res;
+	res = test_budget(BUDGET);
+	printf("flood with a budget of %d lets the timer through %s\n", BUDGET, res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_weights(two, 2);
+	printf("weights {4, 1} under a flood %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_weights(three, 3);
+	printf("weights {1, 3, 2} under a flood %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	return (failed ? 1 : 0);
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "log.hpp"
+#include "event.hpp"
+
+
+/*
+ * Signals through the per-base signalfd: repeats of a standard signal
+ * coalescing into one call, queued real-time signals running the callback
+ * once per delivery across several signalfd reads, distinct signals each
+ * reaching their own events, and the mask restored after the last delete.
+ */
+
+#define CHECK(cond) \
+	do { if (!(cond)) { printf("[line %d] check failed: %s\n", __LINE__, #cond); return (-1); } } while (0)
+
+/* more than one signalfd read's worth */
+#define NQUEUED		40
+
+struct sig_count
+{
+	struct event ev;
+	int calls;
+	/* ev_ncalls seen on the first call: the calls still to come */
+	int first_left;
+};
+
+static void count_cb(int fd, short what, void* arg)
+{
+	struct sig_count* c = (struct sig_count*)arg;
+
+	if (what != EV_SIGNAL)
+	{
+		return;
+	}
+	if (c->calls++ == 0)
+	{
+		c->first_left = c->ev.ev_ncalls;
+	}
+}
+
+static void count_set(struct event_base* base, struct sig_count* c, int signo, short flags)
+{
+	memset(c, 0, sizeof(*c));
+	event_set(&c->ev, signo, EV_SIGNAL | flags, count_cb, c);
+	event_base_set(base, &c->ev);
+}
+
+static int is_blocked(int signo)
+{
+	sigset_t cur;
+
+	pthread_sigmask(SIG_BLOCK, NULL, &cur);
+	return (sigismember(&cur, signo));
+}
+
+/* three raises of one standard signal before the loop looks are one delivery */
+static int test_coalesced(void)
+{
+	struct event_base* base;
+	struct sig_count usr1;
+
+	CHECK((base = event_base_new()) != NULL);
+	CHECK(!is_blocked(SIGUSR1));
+	count_set(base, &usr1, SIGUSR1, EV_PERSIST);
+	CHECK(signal_add(&usr1.ev, NULL) == 0);
+	CHECK(is_blocked(SIGUSR1));
+
+	for (int i = 0; i < 3; ++i)
+	{
+		CHECK(raise(SIGUSR1) == 0);
+	}
+	CHECK(event_base_loop(base, EVLOOP_NONBLOCK) == 0);
+	CHECK(usr1.calls == 1 && usr1.first_left == 0);
+
+	/* and a later raise is a new delivery */
+	CHECK(raise(SIGUSR1) == 0);
+	CHECK(event_base_loop(base, EVLOOP_NONBLOCK) == 0);
+	CHECK(usr1.calls == 2);
+
+	CHECK(signal_del(&usr1.ev) == 0);
+	CHECK(!is_blocked(SIGUSR1));
+	event_base_free(base);
+	return (0);
+}
+
+/*
+ * SIGUSR1, SIGUSR2 and a queued real-time signal at once: each event sees
+ * only its own signal, two events on one signal both run, and a
+ * non-persistent one runs for the whole batch and is then deleted.
+ */
+static int test_distinct(void)
+{
+	struct event_base* base;
+	struct sig_count usr1, usr2, rt, rt_twin, rt_once;
+	int rtsig = SIGRTMIN;
+
+	CHECK((base = event_base_new()) != NULL);
+	count_set(base, &usr1, SIGUSR1, EV_PERSIST);
+	count_set(base, &usr2, SIGUSR2, EV_PERSIST);
+	count_set(base, &rt, rtsig, EV_PERSIST);
+	count_set(base, &rt_twin, rtsig, EV_PERSIST);
+	count_set(base, &rt_once, rtsig, 0);
+	CHECK(signal_add(&usr1.ev, NULL) == 0);
+	CHECK(signal_add(&usr2.ev, NULL) == 0);
+	CHECK(signal_add(&rt.ev, NULL) == 0);
+	CHECK(signal_add(&rt_twin.ev, NULL) == 0);
+	CHECK(signal_add(&rt_once.ev, NULL) == 0);
+
+	CHECK(raise(SIGUSR2) == 0);
+	for (int i = 0; i < NQUEUED; ++i)
+	{
+		CHECK(raise(rtsig) == 0);
+	}
+	CHECK(event_base_loop(base, EVLOOP_NONBLOCK) == 0);
+	CHECK(usr1.calls == 0);
+	CHECK(usr2.calls == 1 && usr2.first_left == 0);
+	/* real-time signals queue, so every raise is one call */
+	CHECK(rt.calls == NQUEUED && rt.first_left == NQUEUED - 1);
+	CHECK(rt_twin.calls == NQUEUED && rt_twin.first_left == NQUEUED - 1);
+	CHECK(rt_once.calls == NQUEUED && !signal_pending(&rt_once.ev, NULL));
+	CHECK(signal_pending(&rt.ev, NULL) && signal_pending(&rt_twin.ev, NULL));
+
+	CHECK(raise(SIGUSR1) == 0);
+	CHECK(raise(rtsig) == 0);
+	CHECK(event_base_loop(base, EVLOOP_NONBLOCK) == 0);
+	CHECK(usr1.calls == 1 && usr2.calls == 1);
+	CHECK(rt.calls == NQUEUED + 1 && rt_twin.calls == NQUEUED + 1 && rt_once.calls == NQUEUED);
+
+	/* the signal stays blocked while any event still watches it */
+	CHECK(signal_del(&rt.ev) == 0);
+	CHECK(is_blocked(rtsig));
+	CHECK(signal_del(&rt_twin.ev) == 0);
+	CHECK(!is_blocked(rtsig));
+	CHECK(signal_del(&usr1.ev) == 0);
+	CHECK(signal_del(&usr2.ev) == 0);
+	CHECK(!is_blocked(SIGUSR1) && !is_blocked(SIGUSR2));
+	event_base_free(base);
+	return (0);
+}
+
+/* a signal the program had blocked itself stays blocked after the base is gone */
+static int test_mask_restored(void)
+{
+	struct event_base* base;
+	struct sig_count usr1, usr2;
+	sigset_t one;
+
+	sigemptyset(&one);
+	sigaddset(&one, SIGUSR2);
+	CHECK(pthread_sigmask(SIG_BLOCK, &one, NULL) == 0);
+
+	CHECK((base = event_base_new()) != NULL);
+	count_set(base, &usr1, SIGUSR1, EV_PERSIST);
+	count_set(base, &usr2, SIGUSR2, EV_PERSIST);
+	CHECK(signal_add(&usr1.ev, NULL) == 0);
+	CHECK(signal_add(&usr2.ev, NULL) == 0);
+	CHECK(raise(SIGUSR1) == 0);
+	CHECK(raise(SIGUSR2) == 0);
+	CHECK(event_base_loop(base, EVLOOP_NONBLOCK) == 0);
+	CHECK(usr1.calls == 1 && usr2.calls == 1);
+
+	/* freed with both still added */
+	event_base_free(base);
+	CHECK(!is_blocked(SIGUSR1));
+	CHECK(is_blocked(SIGUSR2));
+
+	CHECK(pthread_sigmask(SIG_UNBLOCK, &one, NULL) == 0);
+	return (0);
+}
+
+int main(int argc, char* argv[])
+{
+	int res, failed;
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	res = test_coalesced();
+	printf("repeated standard signal coalesced %s\n", res == 0 ? "ok" : "FAILED");
+	failed = res;
+	res = test_distinct();
+	printf("distinct and %d queued real-time signals %s\n", NQUEUED, res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_mask_restored();
+	printf("signal mask restored %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	return (failed ? 1 : 0);
+}
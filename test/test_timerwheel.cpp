@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "log.hpp"
+#include "event.hpp"
+#include "timerwheel.hpp"
+
+
+/*
+ * Timer wheel driven the way the loop drives it: sleep to timer_wheel_next,
+ * expire, take the expired list. Deadlines on either side of the
+ * 256 * 64^n level boundaries, past the top level and random ones must
+ * fire at exactly their tick and in order; timers deleted after a cascade
+ * brought them down a level must not fire.
+ */
+
+#define CHECK(cond) \
+	do { if (!(cond)) { printf("[line %d] check failed: %s\n", __LINE__, #cond); return (-1); } } while (0)
+
+#define L1_SPAN		((uint64_t)TIMER_WHEEL_L0_SIZE)
+#define L2_SPAN		(L1_SPAN * TIMER_WHEEL_LN_SIZE)
+#define L3_SPAN		(L2_SPAN * TIMER_WHEEL_LN_SIZE)
+#define TOP_SPAN	(L3_SPAN * TIMER_WHEEL_LN_SIZE)
+
+#define NRANDOM		2000
+
+static void tick_to_tv(uint64_t tick, struct timeval* tv)
+{
+	tv->tv_sec = tick * TIMER_WHEEL_TICK_USEC / 1000000;
+	tv->tv_usec = tick * TIMER_WHEEL_TICK_USEC % 1000000;
+}
+
+static uint64_t tv_to_tick(const struct timeval* tv)
+{
+	return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec) / TIMER_WHEEL_TICK_USEC;
+}
+
+static void wheel_add(timer_wheel_t* tw, struct event* ev, uint64_t tick)
+{
+	memset(ev, 0, sizeof(*ev));
+	tick_to_tv(tick, &ev->ev_timeout);
+	timer_wheel_add(tw, ev);
+}
+
+/*
+ * Runs the wheel up to tick until. fired[i] gets the tick event i fired
+ * at, order the indexes in firing order; returns how many fired.
+ */
+static int wheel_run(timer_wheel_t* tw, struct event* evs, uint64_t* fired, int* order, uint64_t until)
+{
+	struct timeval tv;
+	struct event* ev;
+	int nfired = 0;
+
+	while (timer_wheel_next(tw, &tv) == 0 && tv_to_tick(&tv) <= until)
+	{
+		timer_wheel_expire(tw, &tv);
+		while ((ev = timer_wheel_expired(tw)) != NULL)
+		{
+			timer_wheel_del(tw, ev);
+			fired[ev - evs] = tv_to_tick(&tv);
+			order[nfired++] = ev - evs;
+		}
+	}
+	return (nfired);
+}
+
+static int test_deadlines(uint64_t start)
+{
+	static const uint64_t spans[] = { L1_SPAN, 2 * L1_SPAN, L2_SPAN, L2_SPAN + L1_SPAN, L3_SPAN, 3 * L3_SPAN, TOP_SPAN };
+	const int nspans = sizeof(spans) / sizeof(spans[0]);
+	const int n = nspans * 3 + 2 + NRANDOM;
+	struct event* evs = (struct event*)calloc(n, sizeof(struct event));
+	uint64_t* deadline = (uint64_t*)calloc(n, sizeof(uint64_t));
+	uint64_t* fired = (uint64_t*)calloc(n, sizeof(uint64_t));
+	int* order = (int*)calloc(n, sizeof(int));
+	timer_wheel_t tw;
+	struct timeval now;
+	int k = 0;
+
+	CHECK(evs != NULL && deadline != NULL && fired != NULL && order != NULL);
+	tick_to_tv(start, &now);
+	CHECK(timer_wheel_ctor(&tw, &now) == 0);
+
+	for (int i = 0; i < nspans; ++i)
+	{
+		deadline[k++] = start + spans[i] - 1;
+		deadline[k++] = start + spans[i];
+		deadline[k++] = start + spans[i] + 1;
+	}
+	/* already due, and beyond the top level so it is re-placed on each top cascade */
+	deadline[k++] = start;
+	deadline[k++] = start + TOP_SPAN + 3 * L2_SPAN + 7;
+	srand(3);
+	while (k < n)
+	{
+		deadline[k++] = start + 1 + (uint64_t)rand() % (2 * L3_SPAN);
+	}
+	for (int i = 0; i < n; ++i)
+	{
+		wheel_add(&tw, &evs[i], deadline[i]);
+	}
+	CHECK(timer_wheel_size(&tw) == (unsigned)n);
+
+	CHECK(wheel_run(&tw, evs, fired, order, UINT64_MAX) == n);
+	CHECK(timer_wheel_empty(&tw));
+	for (int i = 0; i < n; ++i)
+	{
+		CHECK(fired[i] == deadline[i]);
+		CHECK(i == 0 || deadline[order[i - 1]] <= deadline[order[i]]);
+	}
+
+	timer_wheel_dtor(&tw);
+	free(evs);
+	free(deadline);
+	free(fired);
+	free(order);
+	return (0);
+}
+
+/*
+ * Each doomed timer starts two levels up and is deleted right after a
+ * cascade moves it down; a sibling one tick later still fires on time.
+ */
+static int test_cascaded_delete(void)
+{
+	static const uint64_t at[] = { L1_SPAN + 44, L2_SPAN + 3616, L3_SPAN + 51424 };
+	static const uint64_t cascade[] = { L1_SPAN, L2_SPAN, L3_SPAN };
+	static const unsigned level_base[] = { 0, TIMER_WHEEL_L0_SIZE, TIMER_WHEEL_L0_SIZE + TIMER_WHEEL_LN_SIZE };
+	struct event doomed[3], sibling[3];
+	uint64_t fired[3] = { 0, 0, 0 };
+	int order[3];
+	timer_wheel_t tw;
+	struct timeval now;
+
+	tick_to_tv(0, &now);
+	CHECK(timer_wheel_ctor(&tw, &now) == 0);
+	for (int i = 0; i < 3; ++i)
+	{
+		wheel_add(&tw, &doomed[i], at[i]);
+		wheel_add(&tw, &sibling[i], at[i] + 1);
+	}
+
+	for (int i = 0; i < 3; ++i)
+	{
+		CHECK(wheel_run(&tw, sibling, fired, order, cascade[i]) == 0);
+		/* the cascade at cascade[i] put it one level lower */
+		CHECK(doomed[i].min_heap_idx >= level_base[i]);
+		CHECK(doomed[i].min_heap_idx < (i == 0 ? TIMER_WHEEL_L0_SIZE : level_base[i] + TIMER_WHEEL_LN_SIZE));
+		timer_wheel_del(&tw, &doomed[i]);
+		CHECK(doomed[i].min_heap_idx == (unsigned)-1);
+		CHECK(timer_wheel_size(&tw) == (unsigned)(3 - i) + 2 - i);
+		CHECK(wheel_run(&tw, sibling, fired, order, at[i] + 1) == 1);
+		CHECK(order[0] == i && fired[i] == at[i] + 1);
+	}
+	CHECK(timer_wheel_empty(&tw));
+	CHECK(timer_wheel_expired(&tw) == NULL);
+
+	timer_wheel_dtor(&tw);
+	return (0);
+}
+
+int main(int argc, char* argv[])
+{
+	int res, failed;
+
+	LogSetLevel(LOG_LEVEL_OFF);
+	res = test_deadlines(0);
+	printf("deadlines around the level boundaries, from tick 0 %s\n", res == 0 ? "ok" : "FAILED");
+	failed = res;
+	res = test_deadlines(L3_SPAN - 5 * L1_SPAN - 77);
+	printf("deadlines around the level boundaries, from an unaligned tick %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	res = test_cascaded_delete();
+	printf("deletes after a cascade %s\n", res == 0 ? "ok" : "FAILED");
+	failed |= res;
+	return (failed ? 1 : 0);
+}